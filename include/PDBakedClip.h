@@ -0,0 +1,396 @@
+#pragma once
+
+#include "PDClip.h"
+#include "PDPlayback.h"
+#include "PDJointRegistry.h"
+
+// A clip rendered ahead of time into the command frames the control loop
+// would send, for choreographies that are known in advance. A baked clip is
+// a header, a table of buses and one run of slices per bus:
+//
+//   Header     magic, version, control rate, number of cycles, clip timing
+//   Bus        one per bus: name, CRC version, where its slices start and
+//              the joints baked on it with the range, gains and rate they
+//              were rendered with
+//   Slices     per bus, page aligned, one slice per control cycle holding
+//              an encoded PDGoMotorCmd frame for each of the bus' joints in
+//              order. A joint that is not due in a cycle (see
+//              PDBusScheduler) has an all zero frame.
+//
+// bake() does the interpolation, range scaling, quantization and CRC of
+// every frame on the application thread, so playback only has to point
+// each bus at its next slice. Joints are interpolated exactly as PDPlayback
+// does, except that a joint the clip has not recorded yet holds its first
+// recorded position rather than being left alone. The frames are only good for the ranges,
+// gains, rates and control rate they were baked with, PDBakedPlayback
+// refuses a baked clip that no longer matches the robot. Everything is
+// little endian.
+class PDBakedClip {
+public:
+    static constexpr char kMagic[8] = { 'P', 'D', 'B', 'A', 'K', 'E', '\0', '\0' };
+    static constexpr uint16_t kVersion = 1;
+    static constexpr unsigned kMaxBuses = 8;
+    // One per motor ID
+    static constexpr unsigned kMaxBusJoints = 16;
+    static constexpr size_t kFrameSize = PDGoMotorCmd::kFrameSize;
+
+    struct Header {
+        char        fMagic[8];
+        uint16_t    fVersion;
+        uint16_t    fNumBuses;
+        uint32_t    fRate;              // Control cycles per second
+        uint64_t    fNumCycles;
+        uint32_t    fDuration;          // Clip time of the last cycle (ms)
+        uint32_t    fLookahead;         // Clip time each cycle is rendered early (ms)
+    };
+
+    struct Joint {
+        char        fName[28];          // limb.joint
+        uint8_t     fID;
+        uint8_t     fReserved;
+        uint16_t    fRate;              // Hz, 0 for every cycle
+        float       fRange[2];          // Degrees at positions 0 and 1
+        float       fKP;
+        float       fKD;
+        float       fTau;
+        float       fStart;             // Position 0-1 in the first cycle
+    };
+
+    struct Bus {
+        char        fName[16];
+        uint8_t     fCRCVersion;        // PDGoMotorCRC::fVersion
+        uint8_t     fNumJoints;
+        uint16_t    fReserved;
+        uint32_t    fSliceSize;         // fNumJoints frames
+        uint64_t    fSlicesOffset;
+        Joint       fJoints[kMaxBusJoints];
+    };
+
+    PDBakedClip() {}
+
+    PDBakedClip(const PDBakedClip&) = delete;
+    PDBakedClip& operator=(const PDBakedClip&) = delete;
+
+    ~PDBakedClip() {
+        close();
+    }
+
+    // Render clip for every joint of joints that the clip recorded, at the
+    // control rate of joints and with each joint's current range and gains.
+    // Each cycle commands the pose lookahead ms of clip time early, as
+    // PDPlayback::setLookahead() does. Playback speed is fixed at 1.
+    static bool bake(const char* path, const PDClip& clip, const PDJointRegistry& joints, uint32_t lookahead = 0) {
+        if (!clip.isOpen() || clip.numberOfSamples() == 0 || joints.numberOfGroups() == 0) {
+            fprintf(stderr, "Nothing to bake\n");
+            return false;
+        }
+        if (joints.numberOfGroups() > kMaxBuses) {
+            fprintf(stderr, "A baked clip holds 1-%u buses\n", kMaxBuses);
+            return false;
+        }
+        Header header = {};
+        memcpy(header.fMagic, kMagic, sizeof(kMagic));
+        header.fVersion = kVersion;
+        header.fNumBuses = joints.numberOfGroups();
+        header.fRate = joints.getGroup(0).getScheduler().getControlRate();
+        header.fNumCycles = uint64_t(clip.getDuration()) * header.fRate / 1000 + 1;
+        header.fDuration = clip.getDuration();
+        header.fLookahead = lookahead;
+
+        // Clip joint of each baked joint, and where it starts. Joints that
+        // were never recorded are left to their actuators.
+        std::vector<Bus> buses(header.fNumBuses);
+        unsigned clipJoint[kMaxBuses][kMaxBusJoints];
+        unsigned slot[kMaxBuses][kMaxBusJoints];        // Index in the group
+        PDGoActuator* actuators[kMaxBuses][kMaxBusJoints];
+        double start[PDClip::kMaxJoints];
+        findStart(clip, start);
+        static const uint64_t kPageSize = uint64_t(sysconf(_SC_PAGESIZE));
+        uint64_t offset = (sizeof(Header) + buses.size() * sizeof(Bus) + kPageSize - 1) / kPageSize * kPageSize;
+        bool any = false;
+        for (unsigned b = 0; b < buses.size(); b++) {
+            PDJointGroup& group = joints.getGroup(b);
+            Bus& bus = buses[b];
+            memset(&bus, '\0', sizeof(bus));
+            snprintf(bus.fName, sizeof(bus.fName), "%s", group.getBus()->getName());
+            bus.fCRCVersion = group.getBus()->getCRC().fVersion;
+            if (group.getScheduler().getControlRate() != header.fRate) {
+                fprintf(stderr, "Bus %s runs at a different control rate\n", bus.fName);
+                return false;
+            }
+            for (unsigned i = 0; i < group.numberOfActuators() && bus.fNumJoints < kMaxBusJoints; i++) {
+                PDGoActuator& actuator = group.getActuator(i);
+                Joint& joint = bus.fJoints[bus.fNumJoints];
+                snprintf(joint.fName, sizeof(joint.fName), "%s%s%s",
+                    group.getPrefix(i) ? group.getPrefix(i) : "",
+                    group.getPrefix(i) ? "." : "", actuator.getName());
+                int index = clip.findJoint(joint.fName);
+                if (index == -1 || std::isnan(start[index]) || actuator.isIgnored()) {
+                    memset(&joint, '\0', sizeof(joint));
+                    continue;
+                }
+                if (!actuator.isRangeValid()) {
+                    fprintf(stderr, "Actuator %s range has not been set\n", joint.fName);
+                    return false;
+                }
+                joint.fID = actuator.getID();
+                joint.fRate = actuator.getRate();
+                joint.fRange[0] = actuator.scaleToPos(0);
+                joint.fRange[1] = actuator.scaleToPos(1);
+                joint.fKP = actuator.getKP();
+                joint.fKD = actuator.getKD();
+                joint.fTau = actuator.getTau();
+                clipJoint[b][bus.fNumJoints] = index;
+                slot[b][bus.fNumJoints] = i;
+                actuators[b][bus.fNumJoints++] = &actuator;
+            }
+            bus.fSliceSize = bus.fNumJoints * kFrameSize;
+            bus.fSlicesOffset = offset;
+            offset += (header.fNumCycles * bus.fSliceSize + kPageSize - 1) / kPageSize * kPageSize;
+            any |= (bus.fNumJoints != 0);
+        }
+        if (!any) {
+            fprintf(stderr, "Clip has none of the robot's joints\n");
+            return false;
+        }
+
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error creating baked clip %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        // The file starts out all zero, so frames that are not due are already in place
+        void* mem = MAP_FAILED;
+        if (ftruncate(fd, offset) == 0) {
+            mem = mmap(nullptr, offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Error writing baked clip %s: %s\n", path, strerror(errno));
+            ::close(fd);
+            unlink(path);
+            return false;
+        }
+        uint8_t* base = (uint8_t*)mem;
+
+        // Every bus gets a fresh scheduler planned from the joint rates, as
+        // the live one is stepped by the control thread, and every joint
+        // keeps one command that is only updated as it moves
+        std::vector<PDBusScheduler> schedulers(buses.size());
+        std::vector<std::vector<PDGoMotorCmd>> commands(buses.size());
+        double positions[kMaxBuses][kMaxBusJoints];
+        for (unsigned b = 0; b < buses.size(); b++) {
+            const PDJointGroup& group = joints.getGroup(b);
+            for (unsigned i = 0; i < group.numberOfActuators(); i++) {
+                schedulers[b].addSlot(group.getActuator(i).getRate());
+            }
+            schedulers[b].setControlRate(header.fRate);
+            commands[b].resize(buses[b].fNumJoints);
+            for (unsigned j = 0; j < buses[b].fNumJoints; j++) {
+                positions[b][j] = start[clipJoint[b][j]];
+                buses[b].fJoints[j].fStart = positions[b][j];
+            }
+        }
+
+        // Step through the clip as PDPlayback does, one cycle at a time
+        uint64_t last = clip.numberOfSamples() - 1;
+        PDClip::Cursor next;
+        int16_t from[PDClip::kMaxJoints];
+        next.seek(clip, 0);
+        uint64_t index = 0;
+        uint32_t fromTime = next.getTime();
+        memcpy(from, next.getValues(), sizeof(from[0]) * clip.numberOfJoints());
+        next.next();
+        for (uint64_t cycle = 0; cycle < header.fNumCycles; cycle++) {
+            double time = std::min(double(cycle) * 1000 / header.fRate + lookahead, double(header.fDuration));
+            while (index < last && next.getTime() <= time) {
+                index++;
+                fromTime = next.getTime();
+                memcpy(from, next.getValues(), sizeof(from[0]) * clip.numberOfJoints());
+                next.next();
+            }
+            double fraction = (index < last) ? PDPlayback::blend(clip, fromTime, next.getTime(), time) : 0;
+            for (unsigned b = 0; b < buses.size(); b++) {
+                PDJointGroup& group = joints.getGroup(b);
+                const PDGoMotorCRC& crc = group.getBus()->getCRC();
+                uint8_t* slice = base + buses[b].fSlicesOffset + cycle * buses[b].fSliceSize;
+                schedulers[b].next();
+                for (unsigned j = 0; j < buses[b].fNumJoints; j++) {
+                    unsigned c = clipJoint[b][j];
+                    double p0 = PDClip::dequantize(from[c]);
+                    double p1 = (index < last) ? next.getPosition(c) : p0;
+                    double position = PDPlayback::mix(p0, p1, fraction);
+                    if (!std::isnan(position)) {
+                        positions[b][j] = position;
+                    }
+                    if (!schedulers[b].isDue(slot[b][j])) {
+                        continue;
+                    }
+                    PDGoActuator& actuator = *actuators[b][j];
+                    actuator.fill(commands[b][j], true, actuator.scaleToPos(positions[b][j]));
+                    memcpy(slice + j * kFrameSize, commands[b][j].getFrame(crc), kFrameSize);
+                }
+            }
+        }
+        memcpy(base, &header, sizeof(header));
+        memcpy(base + sizeof(header), buses.data(), buses.size() * sizeof(Bus));
+        bool ok = (msync(mem, offset, MS_SYNC) == 0);
+        if (!ok) {
+            fprintf(stderr, "Error writing baked clip %s: %s\n", path, strerror(errno));
+        }
+        munmap(mem, offset);
+        ::close(fd);
+        return ok;
+    }
+
+    bool open(const char* path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening baked clip %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < off_t(sizeof(Header))) {
+            fprintf(stderr, "Not a baked clip: %s\n", path);
+            ::close(fd);
+            return false;
+        }
+        void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Error mapping baked clip %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        fBase = (const uint8_t*)mem;
+        fSize = st.st_size;
+        if (!validate(path)) {
+            close();
+            return false;
+        }
+        madvise((void*)fBase, fSize, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void close() {
+        if (fBase != nullptr) {
+            munmap((void*)fBase, fSize);
+        }
+        fBase = nullptr;
+        fSize = 0;
+        memset(&fHeader, '\0', sizeof(fHeader));
+        fBuses = nullptr;
+    }
+
+    bool isOpen() const {
+        return (fBase != nullptr);
+    }
+
+    // Control cycles per second the clip was baked for
+    unsigned getRate() const {
+        return fHeader.fRate;
+    }
+
+    uint64_t numberOfCycles() const {
+        return fHeader.fNumCycles;
+    }
+
+    // Clip time of the last cycle (ms)
+    uint32_t getDuration() const {
+        return fHeader.fDuration;
+    }
+
+    uint32_t getLookahead() const {
+        return fHeader.fLookahead;
+    }
+
+    unsigned numberOfBuses() const {
+        return fHeader.fNumBuses;
+    }
+
+    const Bus& getBus(unsigned bus) const {
+        return fBuses[bus];
+    }
+
+    // Frames of every joint on bus in cycle
+    inline const uint8_t* getSlice(unsigned bus, uint64_t cycle) const {
+        return fBase + fBuses[bus].fSlicesOffset + cycle * fBuses[bus].fSliceSize;
+    }
+
+    // Ask the kernel to read count cycles from cycle onwards ahead of use
+    void prefetch(uint64_t cycle, uint64_t count) const {
+        if (cycle >= fHeader.fNumCycles) {
+            return;
+        }
+        count = std::min(count, fHeader.fNumCycles - cycle);
+        static const uintptr_t kPageMask = uintptr_t(sysconf(_SC_PAGESIZE)) - 1;
+        for (unsigned b = 0; b < numberOfBuses(); b++) {
+            if (fBuses[b].fSliceSize == 0) {
+                continue;
+            }
+            uintptr_t start = uintptr_t(getSlice(b, cycle)) & ~kPageMask;
+            uintptr_t end = uintptr_t(getSlice(b, cycle + count));
+            madvise((void*)start, end - start, MADV_WILLNEED);
+        }
+    }
+
+    void print(FILE* out) const {
+        fprintf(out, "%llu cycles at %u Hz, %.3f s, %u ms lookahead, %.1f MB\n",
+            (unsigned long long)fHeader.fNumCycles, fHeader.fRate, getDuration() / 1000.0,
+            fHeader.fLookahead, fSize / (1024.0 * 1024.0));
+        for (unsigned b = 0; b < numberOfBuses(); b++) {
+            const Bus& bus = fBuses[b];
+            fprintf(out, "  %s:", bus.fName);
+            for (unsigned j = 0; j < bus.fNumJoints; j++) {
+                fprintf(out, " [%u] %s", bus.fJoints[j].fID, bus.fJoints[j].fName);
+            }
+            fprintf(out, "\n");
+        }
+    }
+
+private:
+    // First recorded position of every clip joint, NAN if it never was
+    static void findStart(const PDClip& clip, double* start) {
+        unsigned missing = clip.numberOfJoints();
+        std::fill(start, start + clip.numberOfJoints(), NAN);
+        PDClip::Cursor cursor;
+        for (bool more = cursor.seek(clip, 0); more && missing != 0; more = cursor.next()) {
+            for (unsigned j = 0; j < clip.numberOfJoints(); j++) {
+                if (std::isnan(start[j]) && !std::isnan(cursor.getPosition(j))) {
+                    start[j] = cursor.getPosition(j);
+                    missing--;
+                }
+            }
+        }
+    }
+
+    bool validate(const char* path) {
+        const Header* header = (const Header*)fBase;
+        if (memcmp(header->fMagic, kMagic, sizeof(kMagic)) != 0) {
+            fprintf(stderr, "Not a baked clip: %s\n", path);
+            return false;
+        }
+        if (header->fVersion != kVersion) {
+            fprintf(stderr, "Unsupported baked clip version %u: %s\n", header->fVersion, path);
+            return false;
+        }
+        memcpy(&fHeader, header, sizeof(fHeader));
+        bool ok = (fHeader.fRate != 0 && fHeader.fNumBuses != 0 && fHeader.fNumBuses <= kMaxBuses &&
+            sizeof(Header) + fHeader.fNumBuses * sizeof(Bus) <= fSize);
+        fBuses = (const Bus*)(fBase + sizeof(Header));
+        for (unsigned b = 0; ok && b < fHeader.fNumBuses; b++) {
+            const Bus& bus = fBuses[b];
+            ok = (bus.fNumJoints <= kMaxBusJoints && bus.fSliceSize == bus.fNumJoints * kFrameSize &&
+                bus.fSlicesOffset <= fSize && fHeader.fNumCycles <= (fSize - bus.fSlicesOffset) / std::max<size_t>(bus.fSliceSize, 1));
+        }
+        if (!ok) {
+            fprintf(stderr, "Corrupt baked clip: %s\n", path);
+            return false;
+        }
+        return true;
+    }
+
+    const uint8_t*  fBase = nullptr;
+    size_t          fSize = 0;
+    Header          fHeader = {};
+    const Bus*      fBuses = nullptr;
+};
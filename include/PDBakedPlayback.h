@@ -0,0 +1,203 @@
+#pragma once
+
+#include "PDBakedClip.h"
+#include "PDJointRegistry.h"
+
+// Plays a baked clip (see PDBakedClip). After the same lead-in as
+// PDPlayback, every control cycle only points each bus at the frames baked
+// for that cycle, so the control thread does no interpolation, scaling or
+// encoding however long the show. The cycle is computed from the cycle time
+// against a fixed start, so late cycles skip ahead rather than delay the
+// rest of the clip.
+//
+// The baked joints bypass their actuators while streaming. The actuators
+// still take feedback, but their commanded position stays at the first pose.
+// PDRobot::relax() (and so the watchdog) returns every joint to its
+// actuator, which ends playback, also during the lead-in.
+class PDBakedPlayback {
+public:
+    // Cycles to ask the kernel to read ahead at a time
+    static constexpr uint64_t kPrefetchCycles = 4096;
+    static constexpr uint32_t kLeadIn = PDPlayback::kLeadIn;
+
+    PDBakedPlayback() {}
+
+    // Match the baked buses and joints to the robot's. Fails if anything the
+    // frames depend on changed since the clip was baked. Call while not playing.
+    bool load(const PDBakedClip& baked, const PDJointRegistry& joints) {
+        fBaked = nullptr;
+        fNumBuses = 0;
+        if (!baked.isOpen()) {
+            return false;
+        }
+        for (unsigned b = 0; b < baked.numberOfBuses(); b++) {
+            const PDBakedClip::Bus& bus = baked.getBus(b);
+            if (bus.fNumJoints == 0) {
+                continue;
+            }
+            PDJointGroup* group = nullptr;
+            for (unsigned g = 0; g < joints.numberOfGroups(); g++) {
+                if (strncmp(joints.getGroup(g).getBus()->getName(), bus.fName, sizeof(bus.fName)) == 0) {
+                    group = &joints.getGroup(g);
+                    break;
+                }
+            }
+            if (group == nullptr) {
+                fprintf(stderr, "Baked clip bus %s is not on the robot\n", bus.fName);
+                return false;
+            }
+            if (group->getBus()->getCRC().fVersion != bus.fCRCVersion ||
+                group->getScheduler().getControlRate() != baked.getRate())
+            {
+                fprintf(stderr, "Bus %s changed since the clip was baked\n", bus.fName);
+                return false;
+            }
+            Bus& playing = fBuses[fNumBuses++];
+            playing.fGroup = group;
+            playing.fBus = b;
+            for (unsigned j = 0; j < bus.fNumJoints; j++) {
+                const PDBakedClip::Joint& joint = bus.fJoints[j];
+                int slot = findJoint(*group, joint.fName);
+                if (slot == -1) {
+                    fprintf(stderr, "Baked clip joint %s is not on bus %s\n", joint.fName, bus.fName);
+                    return false;
+                }
+                PDGoActuator& actuator = group->getActuator(slot);
+                if (actuator.getID() != joint.fID || actuator.getRate() != joint.fRate ||
+                    float(actuator.scaleToPos(0)) != joint.fRange[0] ||
+                    float(actuator.scaleToPos(1)) != joint.fRange[1] ||
+                    float(actuator.getKP()) != joint.fKP || float(actuator.getKD()) != joint.fKD ||
+                    float(actuator.getTau()) != joint.fTau)
+                {
+                    fprintf(stderr, "Joint %s changed since the clip was baked\n", joint.fName);
+                    return false;
+                }
+                playing.fSlot[j] = slot;
+                playing.fStart[j] = joint.fStart;
+            }
+            playing.fNumJoints = bus.fNumJoints;
+        }
+        fBaked = &baked;
+        fJoints = &joints;
+        return true;
+    }
+
+    bool start() {
+        fPlaying = false;
+        if (fBaked == nullptr) {
+            return false;
+        }
+        // Move to the first pose, then hand the joints over to the slices
+        for (unsigned b = 0; b < fNumBuses; b++) {
+            Bus& bus = fBuses[b];
+            for (unsigned j = 0; j < bus.fNumJoints; j++) {
+                bus.fGroup->getActuator(bus.fSlot[j]).moveToPosition(0, kLeadIn, bus.fStart[j]);
+                bus.fGroup->setBaked(bus.fSlot[j], j * PDBakedClip::kFrameSize);
+            }
+        }
+        fAnchorTime = PDCycleClock::now() + PDCycleClock::fromMillis(kLeadIn);
+        fPrefetched = 0;
+        prefetch(0);
+        fRelaxCount = fJoints->getRelaxCount();
+        fPlaying = true;
+        return true;
+    }
+
+    bool stop() {
+        if (fPlaying) {
+            release();
+            relax();
+            return true;
+        }
+        return false;
+    }
+
+    bool update() {
+        if (!fPlaying)
+            return false;
+        if (fJoints->getRelaxCount() != fRelaxCount) {
+            // The robot took the joints back, e.g. after a watchdog trip
+            release();
+            return false;
+        }
+        uint64_t now = PDCycleClock::now();
+        if (now < fAnchorTime) {
+            // Still moving to the first pose
+            return true;
+        }
+        uint64_t cycle = ((now - fAnchorTime) * fBaked->getRate() + 500000000) / 1000000000;
+        if (cycle >= fBaked->numberOfCycles()) {
+            release();
+            relax();
+            return true;
+        }
+        for (unsigned b = 0; b < fNumBuses; b++) {
+            fBuses[b].fGroup->setSlice(fBaked->getSlice(fBuses[b].fBus, cycle));
+        }
+        prefetch(cycle);
+        return true;
+    }
+
+    bool isPlaying() const {
+        return fPlaying;
+    }
+
+private:
+    struct Bus {
+        PDJointGroup*   fGroup = nullptr;
+        unsigned        fBus = 0;       // In the baked clip
+        unsigned        fNumJoints = 0;
+        unsigned        fSlot[PDBakedClip::kMaxBusJoints];  // Index in fGroup
+        double          fStart[PDBakedClip::kMaxBusJoints];
+    };
+
+    static int findJoint(const PDJointGroup& group, const char* name) {
+        for (unsigned i = 0; i < group.numberOfActuators(); i++) {
+            char joint[sizeof(PDBakedClip::Joint::fName)];
+            snprintf(joint, sizeof(joint), "%s%s%s",
+                group.getPrefix(i) ? group.getPrefix(i) : "",
+                group.getPrefix(i) ? "." : "", group.getActuator(i).getName());
+            if (strncmp(joint, name, sizeof(joint)) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Return the baked joints to their actuators
+    void release() {
+        for (unsigned b = 0; b < fNumBuses; b++) {
+            Bus& bus = fBuses[b];
+            bus.fGroup->setSlice(nullptr);
+            for (unsigned j = 0; j < bus.fNumJoints; j++) {
+                bus.fGroup->setBaked(bus.fSlot[j], -1);
+            }
+        }
+        fPlaying = false;
+    }
+
+    void relax() {
+        for (unsigned b = 0; b < fNumBuses; b++) {
+            for (unsigned j = 0; j < fBuses[b].fNumJoints; j++) {
+                fBuses[b].fGroup->getActuator(fBuses[b].fSlot[j]).relax();
+            }
+        }
+    }
+
+    // Keep the kernel reading one window ahead of the playback position
+    void prefetch(uint64_t cycle) {
+        if (cycle + kPrefetchCycles > fPrefetched) {
+            fBaked->prefetch(fPrefetched, kPrefetchCycles);
+            fPrefetched += kPrefetchCycles;
+        }
+    }
+
+    const PDBakedClip* fBaked = nullptr;
+    const PDJointRegistry* fJoints = nullptr;
+    Bus fBuses[PDBakedClip::kMaxBuses];
+    unsigned fNumBuses = 0;
+    uint64_t fAnchorTime = 0;       // Cycle time of the first baked cycle
+    uint64_t fPrefetched = 0;
+    uint64_t fRelaxCount = 0;       // Of fJoints when playback started
+    bool fPlaying = false;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include "PDGoMotorBus.h"
+
+// Finds out which motor IDs answer on each bus. Every bus is probed on its
+// own thread and each ID gets a short reply deadline, so an absent motor
+// costs the probe timeout rather than the bus' normal reply timeout.
+class PDBusDiscovery {
+public:
+    // ID 15 is the broadcast address
+    static constexpr unsigned kNumIDs = 15;
+    // Microseconds to wait for a probed motor to answer
+    static constexpr uint32_t kProbeTimeout = 1000;
+
+    void addBus(PDGoMotorBus* bus) {
+        findBus(bus);
+    }
+
+    // Probe id on bus. Ignored when scanning every ID.
+    void addID(PDGoMotorBus* bus, unsigned id) {
+        if (id < kNumIDs) {
+            findBus(bus)->fExpected |= (1u << id);
+        }
+    }
+
+    void setScanAll(bool scanAll) {
+        fScanAll = scanAll;
+    }
+
+    void setProbeTimeout(uint32_t microseconds) {
+        fProbeTimeout = microseconds;
+    }
+
+    // Probe all buses in parallel. Returns false if an expected ID is missing.
+    bool run() {
+        uint64_t start = currentTimeNanos();
+        std::vector<std::thread> threads;
+        for (auto& probe : fBuses) {
+            probe.fPresent = 0;
+            threads.emplace_back([this, &probe]() { run(probe); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        fElapsed = currentTimeNanos() - start;
+        for (auto& probe : fBuses) {
+            if ((probe.fPresent & probe.fExpected) != probe.fExpected) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isPresent(PDGoMotorBus* bus, unsigned id) const {
+        const Probe* probe = getProbe(bus);
+        return (probe != nullptr && id < kNumIDs && (probe->fPresent & (1u << id)) != 0);
+    }
+
+    // Bit n is set when motor ID n answered
+    uint16_t getPresent(PDGoMotorBus* bus) const {
+        const Probe* probe = getProbe(bus);
+        return (probe != nullptr) ? probe->fPresent : 0;
+    }
+
+    // Reply of a present motor, invalid otherwise
+    const PDGoMotorFeedback& getFeedback(PDGoMotorBus* bus, unsigned id) const {
+        static const PDGoMotorFeedback sNone = []() {
+            PDGoMotorFeedback none = {};
+            none.invalid();
+            return none;
+        }();
+        const Probe* probe = getProbe(bus);
+        return (isPresent(bus, id)) ? probe->fFeedback[id] : sNone;
+    }
+
+    // Nanoseconds the last run() took
+    uint64_t getElapsed() const {
+        return fElapsed;
+    }
+
+    void print(FILE* out) const {
+        for (auto& probe : fBuses) {
+            fprintf(out, "%s:", probe.fBus->getName());
+            for (unsigned id = 0; id < kNumIDs; id++) {
+                uint16_t bit = (1u << id);
+                if (probe.fPresent & bit) {
+                    fprintf(out, " %u%s", id, (fScanAll && !(probe.fExpected & bit)) ? "?" : "");
+                } else if (probe.fExpected & bit) {
+                    fprintf(out, " (%u)", id);
+                }
+            }
+            fprintf(out, "\n");
+        }
+    }
+
+private:
+    struct Probe {
+        PDGoMotorBus*       fBus = nullptr;
+        uint16_t            fExpected = 0;
+        uint16_t            fPresent = 0;
+        PDGoMotorFeedback   fFeedback[kNumIDs] = {};
+    };
+
+    Probe* findBus(PDGoMotorBus* bus) {
+        for (auto& probe : fBuses) {
+            if (probe.fBus == bus) {
+                return &probe;
+            }
+        }
+        fBuses.emplace_back();
+        fBuses.back().fBus = bus;
+        return &fBuses.back();
+    }
+
+    const Probe* getProbe(PDGoMotorBus* bus) const {
+        for (auto& probe : fBuses) {
+            if (probe.fBus == bus) {
+                return &probe;
+            }
+        }
+        return nullptr;
+    }
+
+    void run(Probe& probe) {
+        PDGoMotorBus* bus = probe.fBus;
+        uint32_t replyTimeout = bus->getReplyTimeout();
+        bus->setReplyTimeout(fProbeTimeout);
+        for (unsigned id = 0; id < kNumIDs; id++) {
+            if (!fScanAll && !(probe.fExpected & (1u << id))) {
+                continue;
+            }
+            // A brake command with no gains does not move the motor
+            PDGoMotorCmd cmd;
+            cmd.setMotorID(id);
+            cmd.setBrakeMode();
+            PDGoMotorFeedback feedback;
+            if (bus->sendRecv(&cmd, &feedback) && feedback.getMotorID() == id) {
+                probe.fPresent |= (1u << id);
+                probe.fFeedback[id] = feedback;
+            }
+        }
+        bus->setReplyTimeout(replyTimeout);
+    }
+
+    std::vector<Probe>  fBuses;
+    uint32_t            fProbeTimeout = kProbeTimeout;
+    uint64_t            fElapsed = 0;
+    bool                fScanAll = false;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "PDGoMotorBus.h"
+
+// Runs the I/O of every bus on its own thread. Tasks are grouped by bus and
+// each call to run() starts one cycle on all buses at once. run() returns
+// when the slowest bus has finished so the cycle time is bounded by the
+// slowest bus rather than the sum of all of them.
+class PDBusExecutor {
+public:
+    typedef std::function<bool()> Task;
+
+    PDBusExecutor() {}
+
+    PDBusExecutor(const PDBusExecutor&) = delete;
+    PDBusExecutor& operator=(const PDBusExecutor&) = delete;
+
+    ~PDBusExecutor() {
+        stop();
+    }
+
+    // Tasks for the same bus run in order on that bus' thread
+    void addTask(PDGoMotorBus* bus, Task task) {
+        Lane* lane = nullptr;
+        for (auto& it : fLanes) {
+            if (it->fBus == bus) {
+                lane = it.get();
+                break;
+            }
+        }
+        if (lane == nullptr) {
+            fLanes.emplace_back(new Lane(bus));
+            lane = fLanes.back().get();
+        }
+        lane->fTasks.push_back(task);
+    }
+
+    void start() {
+        if (fRunning) {
+            return;
+        }
+        fQuit = false;
+        fRunning = true;
+        for (auto& it : fLanes) {
+            Lane* lane = it.get();
+            lane->fThread = std::thread([this, lane]() { run(*lane); });
+        }
+    }
+
+    void stop() {
+        if (!fRunning) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fQuit = true;
+        }
+        fStartCond.notify_all();
+        for (auto& it : fLanes) {
+            if (it->fThread.joinable()) {
+                it->fThread.join();
+            }
+        }
+        fRunning = false;
+    }
+
+    // Run one cycle on every bus and wait for all of them to finish
+    bool run() {
+        if (!fRunning) {
+            bool success = true;
+            for (auto& it : fLanes) {
+                if (!runTasks(*it)) {
+                    success = false;
+                }
+            }
+            return success;
+        }
+        std::unique_lock<std::mutex> lock(fMutex);
+        fPending = fLanes.size();
+        fGeneration++;
+        fStartCond.notify_all();
+        fDoneCond.wait(lock, [this]() { return fPending == 0; });
+        bool success = true;
+        for (auto& it : fLanes) {
+            if (!it->fSuccess) {
+                success = false;
+            }
+        }
+        return success;
+    }
+
+    unsigned numberOfBuses() const {
+        return fLanes.size();
+    }
+
+private:
+    struct Lane {
+        Lane(PDGoMotorBus* bus) :
+            fBus(bus)
+        {
+        }
+
+        PDGoMotorBus*       fBus;
+        std::vector<Task>   fTasks;
+        std::thread         fThread;
+        bool                fSuccess = true;
+    };
+
+    static bool runTasks(Lane& lane) {
+        bool success = true;
+        for (auto& task : lane.fTasks) {
+            if (!task()) {
+                success = false;
+            }
+        }
+        return success;
+    }
+
+    void run(Lane& lane) {
+        uint64_t generation = 0;
+        std::unique_lock<std::mutex> lock(fMutex);
+        for (;;) {
+            fStartCond.wait(lock, [&]() { return fQuit || fGeneration != generation; });
+            if (fQuit) {
+                break;
+            }
+            generation = fGeneration;
+            lock.unlock();
+            bool success = runTasks(lane);
+            lock.lock();
+            lane.fSuccess = success;
+            if (--fPending == 0) {
+                fDoneCond.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Lane>> fLanes;
+    std::mutex              fMutex;
+    std::condition_variable fStartCond;
+    std::condition_variable fDoneCond;
+    uint64_t                fGeneration = 0;
+    unsigned                fPending = 0;
+    bool                    fQuit = false;
+    bool                    fRunning = false;
+};
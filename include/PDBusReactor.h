@@ -0,0 +1,149 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "PDUtils.h"
+
+// Waits for a nonblocking bus file descriptor to become readable or
+// writable with an absolute nanosecond deadline. The deadline is armed on a
+// timerfd so waits are not limited to the millisecond resolution of
+// epoll_wait or the 100ms resolution of termios VTIME.
+class PDBusReactor {
+public:
+    enum Event {
+        kReady,
+        kTimeout,
+        kError
+    };
+
+    PDBusReactor() {}
+
+    PDBusReactor(const PDBusReactor&) = delete;
+    PDBusReactor& operator=(const PDBusReactor&) = delete;
+
+    ~PDBusReactor() {
+        close();
+    }
+
+    bool open(int fd) {
+        close();
+#if defined(HAVE_CLOCK_MONOTONIC)
+        fTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+        fTimerFD = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+        if (fTimerFD == -1) {
+            fprintf(stderr, "Error %i from timerfd_create: %s\n", errno, strerror(errno));
+            return false;
+        }
+        fEpollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (fEpollFD == -1) {
+            fprintf(stderr, "Error %i from epoll_create1: %s\n", errno, strerror(errno));
+            close();
+            return false;
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fTimerFD;
+        if (epoll_ctl(fEpollFD, EPOLL_CTL_ADD, fTimerFD, &ev) != 0) {
+            fprintf(stderr, "Error %i from epoll_ctl: %s\n", errno, strerror(errno));
+            close();
+            return false;
+        }
+        ev.events = fEvents = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(fEpollFD, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            fprintf(stderr, "Error %i from epoll_ctl: %s\n", errno, strerror(errno));
+            close();
+            return false;
+        }
+        fFD = fd;
+        return true;
+    }
+
+    void close() {
+        if (fEpollFD != -1) {
+            ::close(fEpollFD);
+            fEpollFD = -1;
+        }
+        if (fTimerFD != -1) {
+            ::close(fTimerFD);
+            fTimerFD = -1;
+        }
+        fFD = -1;
+    }
+
+    bool isOpen() const {
+        return (fFD != -1);
+    }
+
+    // Deadlines are absolute currentTimeNanos() values
+    inline Event waitReadable(uint64_t deadline) {
+        return wait(EPOLLIN, deadline);
+    }
+
+    inline Event waitWritable(uint64_t deadline) {
+        return wait(EPOLLOUT, deadline);
+    }
+
+private:
+    Event wait(uint32_t events, uint64_t deadline) {
+        if (fFD == -1) {
+            return kError;
+        }
+        if (events != fEvents) {
+            struct epoll_event ev = {};
+            ev.events = events;
+            ev.data.fd = fFD;
+            if (epoll_ctl(fEpollFD, EPOLL_CTL_MOD, fFD, &ev) != 0) {
+                return kError;
+            }
+            fEvents = events;
+        }
+        struct itimerspec spec = {};
+        spec.it_value.tv_sec = deadline / 1000000000;
+        spec.it_value.tv_nsec = deadline % 1000000000;
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            // A zero it_value disarms the timer
+            spec.it_value.tv_nsec = 1;
+        }
+        if (timerfd_settime(fTimerFD, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+            return kError;
+        }
+        for (;;) {
+            struct epoll_event ev[2];
+            int count = epoll_wait(fEpollFD, ev, 2, -1);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return kError;
+            }
+            bool timedOut = false;
+            for (int i = 0; i < count; i++) {
+                if (ev[i].data.fd == fFD) {
+                    if (ev[i].events & (EPOLLERR | EPOLLHUP)) {
+                        return kError;
+                    }
+                    return kReady;
+                }
+                timedOut = true;
+            }
+            if (timedOut) {
+                uint64_t expirations;
+                if (::read(fTimerFD, &expirations, sizeof(expirations)) < 0) {
+                    /* already cleared */
+                }
+                return kTimeout;
+            }
+        }
+    }
+
+    int         fFD = -1;
+    int         fEpollFD = -1;
+    int         fTimerFD = -1;
+    uint32_t    fEvents = 0;
+};
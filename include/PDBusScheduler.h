@@ -0,0 +1,141 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <stdint.h>
+
+// Decides which actuators on a bus are commanded in each control cycle.
+// Every slot has a rate in Hz. A slot polled at 1/N of the control rate is
+// due every N cycles, and its phase within those N cycles is chosen so the
+// number of frames per cycle stays as even as possible. Rate 0 (or a rate at
+// or above the control rate) means every cycle.
+class PDBusScheduler {
+public:
+    // Slower joints would not answer often enough for PDGoActuator::isResponding
+    static constexpr unsigned kMinRate = 20;
+    // Longest schedule that is balanced exactly. Rates that do not fit are
+    // still polled at their rate, only their phase is chosen less carefully.
+    static constexpr unsigned kMaxHyperperiod = 1000;
+
+    unsigned addSlot(unsigned rate = 0) {
+        Slot slot;
+        slot.fRate = rate;
+        fSlots.push_back(slot);
+        plan();
+        return fSlots.size() - 1;
+    }
+
+    void setRate(unsigned slot, unsigned rate) {
+        fSlots[slot].fRate = rate;
+        plan();
+    }
+
+    unsigned getRate(unsigned slot) const {
+        return fSlots[slot].fRate;
+    }
+
+    void setControlRate(unsigned rate) {
+        fControlRate = (rate != 0) ? rate : 1;
+        plan();
+    }
+
+    unsigned getControlRate() const {
+        return fControlRate;
+    }
+
+    unsigned numberOfSlots() const {
+        return fSlots.size();
+    }
+
+    // Called once per control cycle before isDue()
+    void next() {
+        for (auto& slot : fSlots) {
+            slot.fDue = (slot.fCountdown == 0);
+            slot.fCountdown = slot.fDue ? slot.fDivisor - 1 : slot.fCountdown - 1;
+        }
+    }
+
+    inline bool isDue(unsigned slot) const {
+        return fSlots[slot].fDue;
+    }
+
+    unsigned getDivisor(unsigned slot) const {
+        return fSlots[slot].fDivisor;
+    }
+
+    unsigned getPhase(unsigned slot) const {
+        return fSlots[slot].fPhase;
+    }
+
+    // Most frames sent on the bus in a single cycle
+    unsigned getPeakLoad() const {
+        return fPeakLoad;
+    }
+
+    // Frames per cycle averaged over the schedule
+    double getAverageLoad() const {
+        double load = 0;
+        for (auto& slot : fSlots) {
+            load += 1.0 / slot.fDivisor;
+        }
+        return load;
+    }
+
+private:
+    struct Slot {
+        unsigned fRate = 0;
+        unsigned fDivisor = 1;
+        unsigned fPhase = 0;
+        unsigned fCountdown = 0;
+        bool     fDue = true;
+    };
+
+    void plan() {
+        fHyperperiod = 1;
+        for (auto& slot : fSlots) {
+            unsigned rate = (slot.fRate != 0) ? std::max(slot.fRate, kMinRate) : fControlRate;
+            slot.fDivisor = std::max(1u, (fControlRate + rate / 2) / rate);
+            slot.fPhase = 0;
+            unsigned hyperperiod = std::lcm(fHyperperiod, slot.fDivisor);
+            if (hyperperiod <= kMaxHyperperiod) {
+                fHyperperiod = hyperperiod;
+            }
+        }
+        // Place the most frequent slots first, each at the phase where the
+        // busiest cycle it lands on is least busy
+        std::vector<unsigned> order(fSlots.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [this](unsigned a, unsigned b) {
+            return fSlots[a].fDivisor < fSlots[b].fDivisor;
+        });
+        std::vector<unsigned> load(fHyperperiod, 0);
+        for (unsigned index : order) {
+            Slot& slot = fSlots[index];
+            unsigned bestPeak = ~0u;
+            for (unsigned phase = 0; phase < slot.fDivisor; phase++) {
+                unsigned peak = 0;
+                for (unsigned cycle = phase; cycle < fHyperperiod; cycle += slot.fDivisor) {
+                    peak = std::max(peak, load[cycle]);
+                }
+                if (peak < bestPeak) {
+                    bestPeak = peak;
+                    slot.fPhase = phase;
+                }
+            }
+            for (unsigned cycle = slot.fPhase; cycle < fHyperperiod; cycle += slot.fDivisor) {
+                load[cycle]++;
+            }
+        }
+        fPeakLoad = load.empty() ? 0 : *std::max_element(load.begin(), load.end());
+        for (auto& slot : fSlots) {
+            slot.fCountdown = slot.fPhase;
+            slot.fDue = true;
+        }
+    }
+
+    std::vector<Slot>   fSlots;
+    unsigned            fControlRate = 500;
+    unsigned            fHyperperiod = 1;
+    unsigned            fPeakLoad = 0;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "PDUtils.h"
+#include "PDHistogram.h"
+
+// Latency and error counts for one motor bus. Written only by the thread
+// driving the bus, readable from any thread while the robot runs.
+struct PDBusStats {
+    static constexpr unsigned kNumIDs = 16;
+    // Line rate of the Go motor RS-485 link, 8N1 framing is 10 bits per byte
+    static constexpr uint64_t kBaudRate = 4000000;
+
+    PDHistogram     fTransfer;          // Whole batch, first byte written to last reply or timeout
+    PDHistogram     fRoundTrip[kNumIDs];// Per motor ID, command written to reply decoded
+    PDCounter       fBatches;
+    PDCounter       fFrames;            // Commands written
+    PDCounter       fReplies;           // Replies matched to a command
+    PDCounter       fTimeouts;          // Replies that never arrived
+    PDCounter       fShortReads;        // Timeouts with part of a frame buffered
+    PDCounter       fWrongID;           // Valid replies that matched no outstanding command
+    PDCounter       fCRCErrors;
+    PDCounter       fDroppedBytes;
+    PDCounter       fTxBytes;
+    PDCounter       fRxBytes;
+    PDCounter       fBusyTime;          // Nanoseconds spent in transfers
+    PDCounter       fStartTime;         // First transfer
+
+    // Fraction of the elapsed time the wire was carrying bytes
+    double getWireUtilization(uint64_t now = currentTimeNanos()) const {
+        uint64_t start = fStartTime.get();
+        if (start == 0 || now <= start) {
+            return 0;
+        }
+        double wireTime = (fTxBytes.get() + fRxBytes.get()) * 10 * 1e9 / kBaudRate;
+        return wireTime / (now - start);
+    }
+
+    // Fraction of the elapsed time the bus thread spent in transfers
+    double getBusyUtilization(uint64_t now = currentTimeNanos()) const {
+        uint64_t start = fStartTime.get();
+        if (start == 0 || now <= start) {
+            return 0;
+        }
+        return double(fBusyTime.get()) / (now - start);
+    }
+
+    // labels names each motor ID, nullptr to print only IDs that have samples
+    void print(FILE* out, const char* name, const char* const* labels = nullptr) const {
+        fprintf(out, "%s: %llu batches, %llu frames, %llu replies, %llu timeouts, %llu short, %llu wrong id, %llu crc, %llu dropped\n",
+            name, (unsigned long long)fBatches.get(), (unsigned long long)fFrames.get(),
+            (unsigned long long)fReplies.get(), (unsigned long long)fTimeouts.get(),
+            (unsigned long long)fShortReads.get(), (unsigned long long)fWrongID.get(),
+            (unsigned long long)fCRCErrors.get(), (unsigned long long)fDroppedBytes.get());
+        fprintf(out, "%s: %llu bytes out, %llu bytes in, wire %.1f%%, busy %.1f%%\n",
+            name, (unsigned long long)fTxBytes.get(), (unsigned long long)fRxBytes.get(),
+            getWireUtilization() * 100, getBusyUtilization() * 100);
+        fTransfer.print(out, "  transfer");
+        for (unsigned id = 0; id < kNumIDs; id++) {
+            if (fRoundTrip[id].getCount() == 0 && (labels == nullptr || labels[id] == nullptr)) {
+                continue;
+            }
+            char label[32];
+            snprintf(label, sizeof(label), "  [%u] %s", id, (labels && labels[id]) ? labels[id] : "");
+            fRoundTrip[id].print(out, label);
+        }
+    }
+};
@@ -0,0 +1,1173 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Motion clip file. A clip is a fixed header, a joint map, samples, a time
+// index and, for delta encoded clips, a keyframe table:
+//
+//   Header     magic, version, counts and offsets of the sections below
+//   Joint      one per joint, name and motor ID
+//   Sample     uint32 time in ms from the start of the clip followed by one
+//              int16 position per joint, 0-1 in steps of 1/32767, then one
+//              int16 per joint for each optional feedback channel in
+//              fChannels, in bit order
+//   IndexEntry one per kIndexInterval ms of clip time, written on close
+//   Keyframe   uint64 offset from fSamplesOffset of every fKeyInterval'th
+//              sample, kDelta only, written on close
+//
+// kRaw clips store every sample as above. kDelta clips store every
+// fKeyInterval'th sample as above and the others as zigzag varints of the
+// difference in time and in each value from the sample before, about one
+// byte per value for smooth motion. A Cursor reads either kind in order.
+//
+// Everything is little endian. PDClip maps a clip read only so playback
+// pages samples in as it goes, and PDClipWriter appends samples from a
+// writer thread so the control thread never touches the file.
+class PDClip {
+public:
+    static constexpr char kMagic[8] = { 'P', 'D', 'C', 'L', 'I', 'P', '\0', '\0' };
+    static constexpr uint16_t kVersion = 2;
+    static constexpr unsigned kMaxJoints = 32;
+    static constexpr unsigned kMaxValues = kMaxJoints * 5;
+    static constexpr uint32_t kIndexInterval = 1000;
+    static constexpr uint16_t kDefaultKeyInterval = 64;
+    static constexpr int16_t kPositionScale = 32767;
+    static constexpr int16_t kNoPosition = INT16_MIN;
+
+    // Optional feedback recorded next to the positions
+    enum Channel : uint16_t {
+        kTau = 1 << 0,              // Nm, steps of 1/256
+        kDQ = 1 << 1,               // rad/s, steps of 1/128
+        kTemperature = 1 << 2,      // Degrees C
+        kFootForce = 1 << 3,        // Raw sensor value
+        kAllChannels = 0xF
+    };
+
+    enum Encoding : uint16_t {
+        kRaw = 0,
+        kDelta = 1
+    };
+
+    enum Flag : uint32_t {
+        // Samples are keyframes left by PDClipReducer, to be interpolated
+        // in a straight line however far apart they are
+        kKeyframes = 1 << 0
+    };
+
+    struct Header {
+        char        fMagic[8];
+        uint16_t    fVersion;
+        uint16_t    fNumJoints;
+        uint16_t    fSampleSize;        // Bytes per sample, before encoding
+        uint16_t    fChannels;          // Channel bits, 0 for positions only
+        uint32_t    fIndexInterval;     // Clip time between index entries (ms)
+        uint32_t    fDuration;          // Time of the last sample (ms)
+        uint64_t    fNumSamples;
+        uint64_t    fSamplesOffset;
+        uint64_t    fIndexOffset;       // 0 if the writer did not finish
+        uint64_t    fNumIndexEntries;
+        // Version 2
+        uint16_t    fEncoding;
+        uint16_t    fKeyInterval;       // Samples from one keyframe to the next
+        uint32_t    fFlags;
+        uint64_t    fKeyframesOffset;
+    };
+
+    // Version 1 clips end the header before fEncoding and are all kRaw
+    static constexpr size_t kVersion1HeaderSize = 56;
+
+    struct Joint {
+        char        fName[28];          // limb.joint
+        uint8_t     fID;
+        uint8_t     fReserved[3];
+    };
+
+    struct IndexEntry {
+        uint32_t    fTime;
+        uint32_t    fReserved;
+        uint64_t    fSample;            // First sample at or after fTime
+    };
+
+    static constexpr unsigned numberOfValues(uint16_t channels) {
+        return 1 + ((channels & kTau) != 0) + ((channels & kDQ) != 0) +
+            ((channels & kTemperature) != 0) + ((channels & kFootForce) != 0);
+    }
+
+    static constexpr size_t sampleSize(unsigned numJoints, uint16_t channels = 0) {
+        return sizeof(uint32_t) + numJoints * numberOfValues(channels) * sizeof(int16_t);
+    }
+
+    // Largest delta encoded sample, the difference of two int16 fits 3 bytes
+    static constexpr size_t maxDeltaSize(unsigned numJoints, uint16_t channels = 0) {
+        return std::max<size_t>(sampleSize(numJoints, channels), 5 + numJoints * numberOfValues(channels) * 3);
+    }
+
+    // Where channel starts in the values of a sample, in joints. 0 is the positions.
+    static inline unsigned channelOffset(uint16_t channels, Channel channel, unsigned numJoints) {
+        return numJoints * numberOfValues(channels & (channel - 1));
+    }
+
+    static inline double channelScale(Channel channel) {
+        switch (channel) {
+            case kTau: return 256;
+            case kDQ: return 128;
+            default: return 1;
+        }
+    }
+
+    static inline int16_t quantize(double value, Channel channel) {
+        double scaled = std::lround(value * channelScale(channel));
+        return int16_t(std::min(std::max(scaled, -32767.0), 32767.0));
+    }
+
+    static inline int16_t quantize(double position) {
+        if (std::isnan(position)) {
+            return kNoPosition;
+        }
+        return int16_t(std::lround(std::min(std::max(position, 0.0), 1.0) * kPositionScale));
+    }
+
+    static inline double dequantize(int16_t value) {
+        return (value == kNoPosition) ? NAN : double(value) / kPositionScale;
+    }
+
+    static inline uint32_t zigzag(int32_t value) {
+        return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+    }
+
+    static inline int32_t unzigzag(uint32_t value) {
+        return int32_t(value >> 1) ^ -int32_t(value & 1);
+    }
+
+    static inline uint8_t* putVarint(uint8_t* p, uint32_t value) {
+        while (value >= 0x80) {
+            *p++ = uint8_t(value) | 0x80;
+            value >>= 7;
+        }
+        *p++ = uint8_t(value);
+        return p;
+    }
+
+    // False, with value 0, if end comes before the last byte
+    static inline bool getVarint(const uint8_t*& p, const uint8_t* end, uint32_t& value) {
+        if (p < end && *p < 0x80) {
+            value = *p++;
+            return true;
+        }
+        uint32_t result = 0;
+        for (unsigned shift = 0; p < end && shift < 35; shift += 7) {
+            uint8_t byte = *p++;
+            result |= uint32_t(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                value = result;
+                return true;
+            }
+        }
+        value = 0;
+        return false;
+    }
+
+    // Encode a sample as the difference from the one before. p needs
+    // maxDeltaSize() bytes. Returns the end of the encoded sample.
+    static inline uint8_t* encodeDelta(uint8_t* p, uint32_t time, const int16_t* values,
+        uint32_t prevTime, const int16_t* prevValues, unsigned numValues)
+    {
+        p = putVarint(p, zigzag(int32_t(time - prevTime)));
+        for (unsigned i = 0; i < numValues; i++) {
+            p = putVarint(p, zigzag(int32_t(values[i]) - prevValues[i]));
+        }
+        return p;
+    }
+
+    // Decode the sample at p over time and values, which hold the sample
+    // before unless key is set. False if end cuts the sample short.
+    static inline bool decodeSample(const uint8_t*& p, const uint8_t* end, bool key,
+        uint32_t& time, int16_t* values, unsigned numValues)
+    {
+        if (key) {
+            size_t size = sizeof(time) + numValues * sizeof(int16_t);
+            if (size_t(end - p) < size) {
+                p = end;
+                return false;
+            }
+            memcpy(&time, p, sizeof(time));
+            memcpy(values, p + sizeof(time), numValues * sizeof(int16_t));
+            p += size;
+            return true;
+        }
+        uint32_t delta;
+        bool ok = getVarint(p, end, delta);
+        time += uint32_t(unzigzag(delta));
+        for (unsigned i = 0; i < numValues; i++) {
+            ok &= getVarint(p, end, delta);
+            values[i] = int16_t(values[i] + unzigzag(delta));
+        }
+        return ok;
+    }
+
+    // Reads the samples of a clip in order. next() decodes one sample
+    // whatever the encoding, seek() decodes forward from the keyframe before.
+    class Cursor {
+    public:
+        // False if the clip does not have sample
+        bool seek(const PDClip& clip, uint64_t sample) {
+            fClip = &clip;
+            if (sample >= clip.fNumSamples) {
+                return false;
+            }
+            fNumValues = clip.numberOfJoints() * numberOfValues(clip.getChannels());
+            uint64_t keyframe = sample / clip.fKeyInterval;
+            fPos = clip.fSamples + clip.getKeyframeOffset(keyframe);
+            fSample = keyframe * clip.fKeyInterval;
+            decodeSample(fPos, clip.fSamplesEnd, true, fTime, fValues, fNumValues);
+            while (fSample < sample) {
+                next();
+            }
+            return true;
+        }
+
+        // False at the end of the clip
+        inline bool next() {
+            if (fSample + 1 >= fClip->fNumSamples) {
+                return false;
+            }
+            fSample++;
+            decodeSample(fPos, fClip->fSamplesEnd, fSample % fClip->fKeyInterval == 0, fTime, fValues, fNumValues);
+            return true;
+        }
+
+        uint64_t getSample() const {
+            return fSample;
+        }
+
+        uint32_t getTime() const {
+            return fTime;
+        }
+
+        // Positions then each channel, see channelOffset()
+        const int16_t* getValues() const {
+            return fValues;
+        }
+
+        // Position 0-1, NAN if the joint was not recorded
+        inline double getPosition(unsigned joint) const {
+            return dequantize(fValues[joint]);
+        }
+
+        // Recorded feedback, NAN if the clip does not have channel
+        inline double getValue(Channel channel, unsigned joint) const {
+            uint16_t channels = fClip->getChannels();
+            if ((channels & channel) == 0) {
+                return NAN;
+            }
+            return fValues[channelOffset(channels, channel, fClip->numberOfJoints()) + joint] / channelScale(channel);
+        }
+
+    private:
+        const PDClip*   fClip = nullptr;
+        const uint8_t*  fPos = nullptr;
+        uint64_t        fSample = 0;
+        uint32_t        fTime = 0;
+        unsigned        fNumValues = 0;
+        int16_t         fValues[kMaxValues] = {};
+    };
+
+    PDClip() {}
+
+    PDClip(const PDClip&) = delete;
+    PDClip& operator=(const PDClip&) = delete;
+
+    ~PDClip() {
+        close();
+    }
+
+    bool open(const char* path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening clip %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < off_t(kVersion1HeaderSize)) {
+            fprintf(stderr, "Not a motion clip: %s\n", path);
+            ::close(fd);
+            return false;
+        }
+        void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Error mapping clip %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        fBase = (const uint8_t*)mem;
+        fSize = st.st_size;
+        if (!validate(path)) {
+            close();
+            return false;
+        }
+        madvise((void*)fBase, fSize, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void close() {
+        if (fBase != nullptr) {
+            munmap((void*)fBase, fSize);
+        }
+        fBase = nullptr;
+        fSize = 0;
+        memset(&fHeader, '\0', sizeof(fHeader));
+        fJoints = nullptr;
+        fSamples = nullptr;
+        fSamplesEnd = nullptr;
+        fIndex = nullptr;
+        fKeyframes = nullptr;
+        fRecoveredKeyframes.clear();
+        fKeyInterval = 1;
+        fDuration = 0;
+        fNumSamples = 0;
+        fNumIndexEntries = 0;
+    }
+
+    bool isOpen() const {
+        return (fBase != nullptr);
+    }
+
+    unsigned numberOfJoints() const {
+        return fHeader.fNumJoints;
+    }
+
+    uint16_t getChannels() const {
+        return fHeader.fChannels;
+    }
+
+    Encoding getEncoding() const {
+        return Encoding(fHeader.fEncoding);
+    }
+
+    uint32_t getFlags() const {
+        return fHeader.fFlags;
+    }
+
+    // Samples from one keyframe to the next, 1 for kRaw clips
+    uint64_t getKeyInterval() const {
+        return fKeyInterval;
+    }
+
+    const char* getJointName(unsigned joint) const {
+        return fJoints[joint].fName;
+    }
+
+    uint8_t getJointID(unsigned joint) const {
+        return fJoints[joint].fID;
+    }
+
+    // Index of the joint named name, or -1
+    int findJoint(const char* name) const {
+        for (unsigned i = 0; i < numberOfJoints(); i++) {
+            if (strncmp(fJoints[i].fName, name, sizeof(fJoints[i].fName)) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    uint64_t numberOfSamples() const {
+        return fNumSamples;
+    }
+
+    // Bytes of sample data, after encoding
+    uint64_t getSamplesSize() const {
+        return fSamplesEnd - fSamples;
+    }
+
+    // Time of the last sample (ms)
+    uint32_t getDuration() const {
+        return fDuration;
+    }
+
+    // Random access for kRaw clips. Use a Cursor to read either encoding.
+    inline uint32_t getTime(uint64_t sample) const {
+        uint32_t time;
+        memcpy(&time, fSamples + sample * fSampleSize, sizeof(time));
+        return time;
+    }
+
+    // Position 0-1, NAN if the joint was not recorded. kRaw clips only.
+    inline double getPosition(uint64_t sample, unsigned joint) const {
+        int16_t value;
+        memcpy(&value, fSamples + sample * fSampleSize + sizeof(uint32_t) + joint * sizeof(int16_t), sizeof(value));
+        return dequantize(value);
+    }
+
+    // Recorded feedback, NAN if the clip does not have channel. kRaw clips only.
+    inline double getValue(uint64_t sample, Channel channel, unsigned joint) const {
+        if ((fHeader.fChannels & channel) == 0) {
+            return NAN;
+        }
+        unsigned offset = channelOffset(fHeader.fChannels, channel, numberOfJoints()) + joint;
+        int16_t value;
+        memcpy(&value, fSamples + sample * fSampleSize + sizeof(uint32_t) + offset * sizeof(int16_t), sizeof(value));
+        return value / channelScale(channel);
+    }
+
+    // Last sample at or before time, 0 if time is before the first sample.
+    // The index narrows the search to one interval, then the keyframes in
+    // it are searched and a kDelta clip decodes forward from the last one.
+    uint64_t seek(uint32_t time) const {
+        uint64_t lo = 0;
+        uint64_t hi = fNumSamples;
+        if (fNumIndexEntries != 0) {
+            const IndexEntry* end = fIndex + fNumIndexEntries;
+            const IndexEntry* entry = std::upper_bound(fIndex, end, time,
+                [](uint32_t t, const IndexEntry& e) { return t < e.fTime; });
+            if (entry != fIndex) {
+                lo = (entry - 1)->fSample;
+            }
+            if (entry != end) {
+                hi = std::min(entry->fSample + 1, fNumSamples);
+            }
+        }
+        lo /= fKeyInterval;
+        hi = (hi + fKeyInterval - 1) / fKeyInterval;
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (getKeyframeTime(mid) <= time) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        if (fKeyInterval == 1) {
+            return lo;
+        }
+        Cursor cursor;
+        cursor.seek(*this, lo * fKeyInterval);
+        uint64_t sample = cursor.getSample();
+        while (cursor.next() && cursor.getTime() <= time) {
+            sample = cursor.getSample();
+        }
+        return sample;
+    }
+
+    // Ask the kernel to read count samples from sample onwards ahead of use
+    void prefetch(uint64_t sample, uint64_t count) const {
+        if (sample >= fNumSamples) {
+            return;
+        }
+        count = std::min(count, fNumSamples - sample);
+        uint64_t first = sample / fKeyInterval;
+        uint64_t last = (sample + count + fKeyInterval - 1) / fKeyInterval;
+        static const uintptr_t kPageMask = uintptr_t(sysconf(_SC_PAGESIZE)) - 1;
+        uintptr_t start = uintptr_t(fSamples + getKeyframeOffset(first)) & ~kPageMask;
+        uintptr_t end = (last * fKeyInterval < fNumSamples) ?
+            uintptr_t(fSamples + getKeyframeOffset(last)) : uintptr_t(fSamplesEnd);
+        madvise((void*)start, end - start, MADV_WILLNEED);
+    }
+
+    void print(FILE* out, bool samples = false) const {
+        fprintf(out, "%llu samples, %.3f s, %u joints%s%s%s%s%s%s%s\n",
+            (unsigned long long)fNumSamples, getDuration() / 1000.0, numberOfJoints(),
+            (getChannels() & kTau) ? ", tau" : "", (getChannels() & kDQ) ? ", dq" : "",
+            (getChannels() & kTemperature) ? ", temperature" : "",
+            (getChannels() & kFootForce) ? ", foot force" : "",
+            (getEncoding() == kDelta) ? ", delta encoded" : "",
+            (getFlags() & kKeyframes) ? ", keyframes" : "",
+            (fHeader.fIndexOffset == 0) ? " (unfinished)" : "");
+        for (unsigned j = 0; j < numberOfJoints(); j++) {
+            fprintf(out, "  [%u] %s\n", getJointID(j), getJointName(j));
+        }
+        Cursor cursor;
+        for (bool more = samples && cursor.seek(*this, 0); more; more = cursor.next()) {
+            fprintf(out, "[%u]:", cursor.getTime());
+            for (unsigned j = 0; j < numberOfJoints(); j++) {
+                fprintf(out, " %f", cursor.getPosition(j));
+            }
+            fprintf(out, "\n");
+        }
+    }
+
+private:
+    // Offset of every fKeyInterval'th sample from fSamples
+    inline uint64_t getKeyframeOffset(uint64_t keyframe) const {
+        if (fKeyframes == nullptr) {
+            return keyframe * fSampleSize;
+        }
+        uint64_t offset;
+        memcpy(&offset, fKeyframes + keyframe * sizeof(offset), sizeof(offset));
+        return offset;
+    }
+
+    inline uint32_t getKeyframeTime(uint64_t keyframe) const {
+        uint32_t time;
+        memcpy(&time, fSamples + getKeyframeOffset(keyframe), sizeof(time));
+        return time;
+    }
+
+    bool validate(const char* path) {
+        const Header* header = (const Header*)fBase;
+        if (memcmp(header->fMagic, kMagic, sizeof(kMagic)) != 0) {
+            fprintf(stderr, "Not a motion clip: %s\n", path);
+            return false;
+        }
+        size_t headerSize = (header->fVersion == 1) ? kVersion1HeaderSize : sizeof(Header);
+        if ((header->fVersion != 1 && header->fVersion != kVersion) || fSize < headerSize) {
+            fprintf(stderr, "Unsupported clip version %u: %s\n", header->fVersion, path);
+            return false;
+        }
+        memcpy(&fHeader, header, headerSize);
+        size_t jointsEnd = headerSize + fHeader.fNumJoints * sizeof(Joint);
+        if (fHeader.fNumJoints == 0 || fHeader.fNumJoints > kMaxJoints ||
+            (fHeader.fChannels & ~kAllChannels) != 0 ||
+            fHeader.fSampleSize != sampleSize(fHeader.fNumJoints, fHeader.fChannels) ||
+            fHeader.fEncoding > kDelta || (fHeader.fEncoding == kDelta && fHeader.fKeyInterval == 0) ||
+            fHeader.fSamplesOffset < jointsEnd || fHeader.fSamplesOffset > fSize ||
+            (fHeader.fIndexOffset != 0 && (fHeader.fIndexOffset < fHeader.fSamplesOffset || fHeader.fIndexOffset > fSize)))
+        {
+            fprintf(stderr, "Corrupt clip header: %s\n", path);
+            return false;
+        }
+        fJoints = (const Joint*)(fBase + headerSize);
+        fSamples = fBase + fHeader.fSamplesOffset;
+        fSampleSize = fHeader.fSampleSize;
+        fKeyInterval = (fHeader.fEncoding == kDelta) ? fHeader.fKeyInterval : 1;
+        if (fHeader.fIndexOffset == 0) {
+            // The writer did not finish, keep every complete sample
+            recover();
+            return true;
+        }
+        fSamplesEnd = fBase + fHeader.fIndexOffset;
+        fNumSamples = fHeader.fNumSamples;
+        uint64_t numKeyframes = (fNumSamples + fKeyInterval - 1) / fKeyInterval;
+        // Counts are bounded by the file before they are multiplied out
+        bool ok = (fHeader.fNumIndexEntries <= (fSize - fHeader.fIndexOffset) / sizeof(IndexEntry));
+        uint64_t indexEnd = fHeader.fIndexOffset + fHeader.fNumIndexEntries * sizeof(IndexEntry);
+        if (fHeader.fEncoding == kRaw) {
+            ok &= (fNumSamples <= getSamplesSize() / fSampleSize);
+        } else {
+            ok &= (fHeader.fKeyframesOffset >= indexEnd && fHeader.fKeyframesOffset <= fSize &&
+                numKeyframes <= (fSize - fHeader.fKeyframesOffset) / sizeof(uint64_t));
+            fKeyframes = fBase + fHeader.fKeyframesOffset;
+            for (uint64_t k = 0; ok && k < numKeyframes; k++) {
+                ok = (fSampleSize <= getSamplesSize() && getKeyframeOffset(k) <= getSamplesSize() - fSampleSize);
+            }
+        }
+        // seek() trusts the index to be in order and to point into the clip
+        fIndex = (const IndexEntry*)(fBase + fHeader.fIndexOffset);
+        for (uint64_t i = 0; ok && i < fHeader.fNumIndexEntries; i++) {
+            ok = (fIndex[i].fSample <= fNumSamples);
+            if (ok && i != 0) {
+                ok = (fIndex[i].fTime >= fIndex[i - 1].fTime && fIndex[i].fSample >= fIndex[i - 1].fSample);
+            }
+        }
+        if (!ok) {
+            fIndex = nullptr;
+            fprintf(stderr, "Corrupt clip: %s\n", path);
+            return false;
+        }
+        fNumIndexEntries = fHeader.fNumIndexEntries;
+        fDuration = fHeader.fDuration;
+        return true;
+    }
+
+    // Count the complete samples of an unfinished clip and, for kDelta,
+    // rebuild the keyframe table the writer did not get to write
+    void recover() {
+        const uint8_t* end = fBase + fSize;
+        if (fHeader.fEncoding == kRaw) {
+            fNumSamples = (fSize - fHeader.fSamplesOffset) / fSampleSize;
+            fSamplesEnd = fSamples + fNumSamples * fSampleSize;
+            fDuration = (fNumSamples != 0) ? getTime(fNumSamples - 1) : 0;
+            return;
+        }
+        unsigned numValues = fHeader.fNumJoints * numberOfValues(fHeader.fChannels);
+        int16_t values[kMaxValues];
+        uint32_t time = 0;
+        const uint8_t* p = fSamples;
+        fSamplesEnd = p;
+        while (p < end) {
+            bool key = (fNumSamples % fKeyInterval == 0);
+            uint64_t offset = p - fSamples;
+            if (!decodeSample(p, end, key, time, values, numValues)) {
+                break;
+            }
+            if (key) {
+                fRecoveredKeyframes.push_back(offset);
+            }
+            fDuration = time;
+            fNumSamples++;
+            fSamplesEnd = p;
+        }
+        fKeyframes = (const uint8_t*)fRecoveredKeyframes.data();
+    }
+
+    const uint8_t*      fBase = nullptr;
+    size_t              fSize = 0;
+    Header              fHeader = {};
+    const Joint*        fJoints = nullptr;
+    const uint8_t*      fSamples = nullptr;
+    const uint8_t*      fSamplesEnd = nullptr;
+    const IndexEntry*   fIndex = nullptr;
+    const uint8_t*      fKeyframes = nullptr;       // nullptr for kRaw
+    std::vector<uint64_t> fRecoveredKeyframes;
+    size_t              fSampleSize = 0;
+    uint64_t            fKeyInterval = 1;
+    uint32_t            fDuration = 0;
+    uint64_t            fNumSamples = 0;
+    uint64_t            fNumIndexEntries = 0;
+};
+
+// Drops the samples of a clip that playback can interpolate back to within
+// a tolerance of every joint's recorded position. Tolerances are per joint
+// in positions 0-1, 0 to keep the joint's recorded values exactly. A
+// sample is needed when a joint is further from the straight line between
+// the keyframes either side than its tolerance, or is recorded at one of
+// them and not at the other.
+//
+// reduce() finds the keyframes of a whole clip with Ramer-Douglas-Peucker,
+// splitting at the worst sample until every sample fits. add() decides as
+// samples arrive, for PDClipWriter: it keeps extending a line from the
+// last keyframe until one of the samples since no longer fits and makes
+// the sample before a keyframe, so each sample is held back at most
+// kMaxWindow samples.
+class PDClipReducer {
+public:
+    static constexpr unsigned kMaxWindow = 256;
+
+    // How far off the line from a to b the sample p is, as a multiple of
+    // the tolerance of the joint furthest off. Above 1 p has to be kept.
+    static inline double error(uint32_t ta, const int16_t* a, uint32_t tb, const int16_t* b,
+        uint32_t tp, const int16_t* p, const double* limits, unsigned numJoints)
+    {
+        double fraction = (tb > ta) ? double(int64_t(tp) - ta) / (tb - ta) : 0;
+        double worst = 0;
+        for (unsigned j = 0; j < numJoints; j++) {
+            bool recorded = (p[j] != PDClip::kNoPosition);
+            if ((a[j] != PDClip::kNoPosition) != recorded || (b[j] != PDClip::kNoPosition) != recorded) {
+                return INFINITY;
+            }
+            if (recorded) {
+                double line = a[j] + (b[j] - a[j]) * fraction;
+                worst = std::max(worst, std::fabs(p[j] - line) / limits[j]);
+            }
+        }
+        return worst;
+    }
+
+    // Tolerance in quantized steps. Half a step keeps the recorded value.
+    static inline double limit(double tolerance) {
+        return std::max(tolerance * PDClip::kPositionScale, 0.5);
+    }
+
+    // Sample numbers of the keyframes of clip, in order
+    static std::vector<uint64_t> reduce(const PDClip& clip, const double* tolerance) {
+        std::vector<uint64_t> keyframes;
+        uint64_t count = clip.numberOfSamples();
+        unsigned numJoints = clip.numberOfJoints();
+        if (count == 0) {
+            return keyframes;
+        }
+        double limits[PDClip::kMaxJoints];
+        for (unsigned j = 0; j < numJoints; j++) {
+            limits[j] = limit(tolerance[j]);
+        }
+        std::vector<uint32_t> times(count);
+        std::vector<int16_t> positions(count * numJoints);
+        PDClip::Cursor cursor;
+        for (bool more = cursor.seek(clip, 0); more; more = cursor.next()) {
+            times[cursor.getSample()] = cursor.getTime();
+            memcpy(&positions[cursor.getSample() * numJoints], cursor.getValues(), numJoints * sizeof(int16_t));
+        }
+        std::vector<bool> keep(count, false);
+        keep[0] = keep[count - 1] = true;
+        // Keep both samples around a joint starting or stopping being
+        // recorded, so every segment below has the same joints throughout
+        std::vector<std::pair<uint64_t, uint64_t>> segments;
+        uint64_t start = 0;
+        for (uint64_t i = 1; i < count; i++) {
+            const int16_t* a = &positions[(i - 1) * numJoints];
+            const int16_t* b = &positions[i * numJoints];
+            for (unsigned j = 0; j < numJoints; j++) {
+                if ((a[j] == PDClip::kNoPosition) != (b[j] == PDClip::kNoPosition)) {
+                    keep[i - 1] = keep[i] = true;
+                    segments.push_back({ start, i - 1 });
+                    start = i;
+                    break;
+                }
+            }
+        }
+        segments.push_back({ start, count - 1 });
+        while (!segments.empty()) {
+            uint64_t a = segments.back().first;
+            uint64_t b = segments.back().second;
+            segments.pop_back();
+            double worst = 1;
+            uint64_t split = 0;
+            for (uint64_t i = a + 1; i < b; i++) {
+                double e = error(times[a], &positions[a * numJoints], times[b], &positions[b * numJoints],
+                    times[i], &positions[i * numJoints], limits, numJoints);
+                if (e > worst) {
+                    worst = e;
+                    split = i;
+                }
+            }
+            if (split != 0) {
+                keep[split] = true;
+                segments.push_back({ split, b });
+                segments.push_back({ a, split });
+            }
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            if (keep[i]) {
+                keyframes.push_back(i);
+            }
+        }
+        return keyframes;
+    }
+
+    // Start a stream of samples laid out as in a clip
+    void reset(unsigned numJoints, uint16_t channels, const double* tolerance) {
+        fNumJoints = numJoints;
+        size_t sampleSize = PDClip::sampleSize(numJoints, channels);
+        if (fWindow == nullptr || sampleSize != fSampleSize) {
+            fSampleSize = sampleSize;
+            fWindow.reset(new uint8_t[kMaxWindow * fSampleSize]);
+        }
+        for (unsigned j = 0; j < numJoints; j++) {
+            fLimits[j] = limit(tolerance[j]);
+        }
+        fCount = 0;
+    }
+
+    // Offer the next sample. Returns a keyframe, valid until the next
+    // call, or nullptr. The first sample is always a keyframe.
+    const uint8_t* add(const uint8_t* sample) {
+        if (fCount > 1 && (fCount == kMaxWindow || !fits(sample))) {
+            // The last sample that fit ends this line and starts the next
+            memcpy(slot(0), slot(fCount - 1), fSampleSize);
+            memcpy(slot(1), sample, fSampleSize);
+            fCount = 2;
+            return slot(0);
+        }
+        memcpy(slot(fCount++), sample, fSampleSize);
+        return (fCount == 1) ? slot(0) : nullptr;
+    }
+
+    // The last sample, which is always a keyframe, or nullptr if it was
+    // already returned
+    const uint8_t* finish() {
+        unsigned count = fCount;
+        fCount = 0;
+        return (count > 1) ? slot(count - 1) : nullptr;
+    }
+
+private:
+    inline uint8_t* slot(unsigned i) {
+        return &fWindow[i * fSampleSize];
+    }
+
+    static inline uint32_t timeOf(const uint8_t* sample) {
+        uint32_t time;
+        memcpy(&time, sample, sizeof(time));
+        return time;
+    }
+
+    static inline const int16_t* positionsOf(const uint8_t* sample) {
+        return (const int16_t*)(sample + sizeof(uint32_t));
+    }
+
+    // Whether every sample since the last keyframe is close enough to the
+    // line from it to sample
+    bool fits(const uint8_t* sample) {
+        const uint8_t* first = slot(0);
+        for (unsigned i = 1; i < fCount; i++) {
+            const uint8_t* p = slot(i);
+            if (error(timeOf(first), positionsOf(first), timeOf(sample), positionsOf(sample),
+                timeOf(p), positionsOf(p), fLimits, fNumJoints) > 1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned            fNumJoints = 0;
+    size_t              fSampleSize = 0;
+    double              fLimits[PDClip::kMaxJoints];
+    std::unique_ptr<uint8_t[]> fWindow;     // From the last keyframe on
+    unsigned            fCount = 0;
+};
+
+// Writes a clip from a background thread. The control thread fills sample
+// slots in a ring allocated by open() and the writer thread writes them to
+// the file straight from the ring, in as few write() calls as possible, or
+// reduces and delta encodes them first. It builds the time index and
+// keyframe table, which close() appends with the final header.
+class PDClipWriter {
+public:
+    static constexpr size_t kDefaultArenaSize = 4 * 1024 * 1024;
+
+    PDClipWriter() {}
+
+    PDClipWriter(const PDClipWriter&) = delete;
+    PDClipWriter& operator=(const PDClipWriter&) = delete;
+
+    ~PDClipWriter() {
+        close();
+    }
+
+    // Bytes of samples that may wait for the writer thread. Call before open().
+    void setArenaSize(size_t bytes) {
+        fArenaSize = bytes;
+    }
+
+    // Call before open()
+    void setEncoding(PDClip::Encoding encoding, uint16_t keyInterval = PDClip::kDefaultKeyInterval) {
+        fEncoding = encoding;
+        fKeyInterval = std::max<uint16_t>(keyInterval, 1);
+    }
+
+    // Keep only the samples playback needs to stay within tolerance of
+    // every joint's recorded position, see PDClipReducer. 0 for every joint
+    // keeps every sample. Call before open().
+    void setTolerance(double tolerance) {
+        std::fill(fTolerance, fTolerance + PDClip::kMaxJoints, std::max(tolerance, 0.0));
+    }
+
+    void setTolerance(unsigned joint, double tolerance) {
+        if (joint < PDClip::kMaxJoints) {
+            fTolerance[joint] = std::max(tolerance, 0.0);
+        }
+    }
+
+    // PDClip::Flag bits. Call before open().
+    void setFlags(uint32_t flags) {
+        fFlags = flags;
+    }
+
+    // Create the file and start the writer thread. names are limb.joint.
+    bool open(const char* path, unsigned numJoints, const char* const* names, const uint8_t* ids, uint16_t channels = 0) {
+        close();
+        if (numJoints == 0 || numJoints > PDClip::kMaxJoints) {
+            fprintf(stderr, "A clip holds 1-%u joints\n", PDClip::kMaxJoints);
+            return false;
+        }
+        memset(&fHeader, '\0', sizeof(fHeader));
+        memcpy(fHeader.fMagic, PDClip::kMagic, sizeof(PDClip::kMagic));
+        fHeader.fVersion = PDClip::kVersion;
+        fHeader.fNumJoints = numJoints;
+        fHeader.fChannels = channels & PDClip::kAllChannels;
+        fHeader.fSampleSize = PDClip::sampleSize(numJoints, fHeader.fChannels);
+        fHeader.fIndexInterval = PDClip::kIndexInterval;
+        fHeader.fSamplesOffset = sizeof(PDClip::Header) + numJoints * sizeof(PDClip::Joint);
+        fHeader.fEncoding = fEncoding;
+        fHeader.fKeyInterval = (fEncoding == PDClip::kDelta) ? fKeyInterval : 0;
+        fReduce = std::any_of(fTolerance, fTolerance + numJoints, [](double t) { return t > 0; });
+        fHeader.fFlags = fFlags | (fReduce ? uint32_t(PDClip::kKeyframes) : 0u);
+        if (fReduce) {
+            fReducer.reset(numJoints, fHeader.fChannels, fTolerance);
+        }
+        size_t slots = std::max<size_t>(fArenaSize / fHeader.fSampleSize, 2);
+        if (fArena == nullptr || slots * fHeader.fSampleSize != fArenaBytes) {
+            fArenaBytes = slots * fHeader.fSampleSize;
+            fArena.reset(new uint8_t[fArenaBytes]);
+            // Fault the pages in now rather than on the control thread
+            memset(fArena.get(), '\0', fArenaBytes);
+        }
+        fSlots = slots;
+        if ((fEncoding == PDClip::kDelta || fReduce) && fEncoded == nullptr) {
+            fEncoded.reset(new uint8_t[kEncodedSize + PDClip::maxDeltaSize(PDClip::kMaxJoints, PDClip::kAllChannels)]);
+        }
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error creating clip %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        std::vector<PDClip::Joint> joints(numJoints);
+        for (unsigned i = 0; i < numJoints; i++) {
+            memset(&joints[i], '\0', sizeof(joints[i]));
+            snprintf(joints[i].fName, sizeof(joints[i].fName), "%s", names[i]);
+            joints[i].fID = ids[i];
+        }
+        if (!writeAll(&fHeader, sizeof(fHeader)) ||
+            !writeAll(joints.data(), numJoints * sizeof(PDClip::Joint)))
+        {
+            fprintf(stderr, "Error writing clip %s: %s\n", path, strerror(errno));
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        snprintf(fPath, sizeof(fPath), "%s", path);
+        fIndex.clear();
+        fKeyframes.clear();
+        fHead.store(0, std::memory_order_relaxed);
+        fTail.store(0, std::memory_order_relaxed);
+        fNumSamples = 0;
+        fNextIndexTime = 0;
+        fBytes = 0;
+        fEncodedBytes = 0;
+        fAdded = 0;
+        fDropped.store(0, std::memory_order_relaxed);
+        fFailed = false;
+        fRunning = true;
+        fThread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    // Finish the file. Call once samples are no longer being added.
+    bool close() {
+        if (fd == -1) {
+            return true;
+        }
+        fRunning = false;
+        if (fThread.joinable()) {
+            fThread.join();
+        }
+        // Keep the index and keyframe table aligned
+        static const uint8_t kPadding[8] = {};
+        uint64_t samplesEnd = fHeader.fSamplesOffset + fBytes;
+        size_t padding = (8 - samplesEnd % 8) % 8;
+        fHeader.fNumSamples = fNumSamples;
+        fHeader.fIndexOffset = samplesEnd + padding;
+        fHeader.fNumIndexEntries = fIndex.size();
+        if (fEncoding == PDClip::kDelta) {
+            fHeader.fKeyframesOffset = fHeader.fIndexOffset + fIndex.size() * sizeof(PDClip::IndexEntry);
+        }
+        bool ok = !fFailed && writeAll(kPadding, padding) &&
+            writeAll(fIndex.data(), fIndex.size() * sizeof(PDClip::IndexEntry)) &&
+            writeAll(fKeyframes.data(), fKeyframes.size() * sizeof(uint64_t)) &&
+            pwrite(fd, &fHeader, sizeof(fHeader), 0) == ssize_t(sizeof(fHeader));
+        if (!ok) {
+            fprintf(stderr, "Error writing clip %s: %s\n", fPath, strerror(errno));
+        }
+        uint64_t dropped = fDropped.load(std::memory_order_relaxed);
+        if (dropped != 0) {
+            fprintf(stderr, "Clip %s: %llu samples dropped, writer fell behind\n", fPath, (unsigned long long)dropped);
+        }
+        ::close(fd);
+        fd = -1;
+        return ok;
+    }
+
+    bool isOpen() const {
+        return (fd != -1);
+    }
+
+    unsigned numberOfJoints() const {
+        return fHeader.fNumJoints;
+    }
+
+    uint16_t getChannels() const {
+        return fHeader.fChannels;
+    }
+
+    // Control thread. Returns the values of the next sample to fill in,
+    // positions first then each channel (see PDClip::channelOffset), or
+    // nullptr if the ring is full. Finish with endSample().
+    inline int16_t* beginSample(uint32_t time) {
+        uint64_t head = fHead.load(std::memory_order_relaxed);
+        if (fd == -1 || head - fTail.load(std::memory_order_acquire) == fSlots) {
+            fDropped.store(fDropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        uint8_t* slot = &fArena[(head % fSlots) * fHeader.fSampleSize];
+        memcpy(slot, &time, sizeof(time));
+        return (int16_t*)(slot + sizeof(time));
+    }
+
+    inline void endSample() {
+        fHead.store(fHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        fAdded++;
+    }
+
+    // Wait until the writer thread has room for a sample, for writing a
+    // clip faster than real time off the control thread
+    void waitForRoom() {
+        while (fd != -1 && fHead.load(std::memory_order_relaxed) - fTail.load(std::memory_order_acquire) == fSlots) {
+            usleep(kPollInterval / 10);
+        }
+    }
+
+    // Control thread. positions are 0-1 or NAN, one per joint. Channels are left 0.
+    inline bool add(uint32_t time, const double* positions) {
+        int16_t* values = beginSample(time);
+        if (values == nullptr) {
+            return false;
+        }
+        unsigned numValues = fHeader.fNumJoints * PDClip::numberOfValues(fHeader.fChannels);
+        for (unsigned i = 0; i < numValues; i++) {
+            values[i] = (i < fHeader.fNumJoints) ? PDClip::quantize(positions[i]) : 0;
+        }
+        endSample();
+        return true;
+    }
+
+    // Samples accepted since open()
+    uint64_t getAdded() const {
+        return fAdded;
+    }
+
+    uint64_t getDropped() const {
+        return fDropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr useconds_t kPollInterval = 10000;
+    // Encoded bytes collected before a write
+    static constexpr size_t kEncodedSize = 64 * 1024;
+
+    bool writeAll(const void* buffer, size_t size) {
+        size_t len = 0;
+        while (len < size) {
+            ssize_t wrote = ::write(fd, (const uint8_t*)buffer + len, size - len);
+            if (wrote < 0 && errno == EINTR) {
+                continue;
+            }
+            if (wrote <= 0) {
+                return false;
+            }
+            len += wrote;
+        }
+        return true;
+    }
+
+    // Writer thread. Add a sample to the index, and to the encoded buffer
+    // unless the ring is written directly.
+    void append(const uint8_t* sample, bool encoded) {
+        uint32_t time;
+        memcpy(&time, sample, sizeof(time));
+        if (fNumSamples == 0 || time >= fNextIndexTime) {
+            fIndex.push_back({ time, 0, fNumSamples });
+            fNextIndexTime = (time / PDClip::kIndexInterval + 1) * PDClip::kIndexInterval;
+        }
+        if (encoded) {
+            encode(sample);
+        }
+        fHeader.fDuration = time;
+        fNumSamples++;
+    }
+
+    void encode(const uint8_t* slot) {
+        if (fEncoding == PDClip::kRaw) {
+            memcpy(&fEncoded[fEncodedBytes], slot, fHeader.fSampleSize);
+            fEncodedBytes += fHeader.fSampleSize;
+            if (fEncodedBytes >= kEncodedSize) {
+                flush();
+            }
+            return;
+        }
+        unsigned numValues = fHeader.fNumJoints * PDClip::numberOfValues(fHeader.fChannels);
+        uint32_t time;
+        int16_t values[PDClip::kMaxValues];
+        memcpy(&time, slot, sizeof(time));
+        memcpy(values, slot + sizeof(time), numValues * sizeof(int16_t));
+        uint8_t* p = &fEncoded[fEncodedBytes];
+        if (fNumSamples % fKeyInterval == 0) {
+            fKeyframes.push_back(fBytes + fEncodedBytes);
+            memcpy(p, slot, fHeader.fSampleSize);
+            p += fHeader.fSampleSize;
+        } else {
+            p = PDClip::encodeDelta(p, time, values, fPrevTime, fPrevValues, numValues);
+        }
+        fEncodedBytes = p - fEncoded.get();
+        fPrevTime = time;
+        memcpy(fPrevValues, values, numValues * sizeof(int16_t));
+        if (fEncodedBytes >= kEncodedSize) {
+            flush();
+        }
+    }
+
+    void flush() {
+        fFailed |= !writeAll(fEncoded.get(), fEncodedBytes);
+        fBytes += fEncodedBytes;
+        fEncodedBytes = 0;
+    }
+
+    void run() {
+        size_t sampleSize = fHeader.fSampleSize;
+        // Raw samples that are all kept are written straight from the ring
+        bool direct = (fEncoding == PDClip::kRaw && !fReduce);
+        for (;;) {
+            // Check before draining so nothing added before close() is missed
+            bool running = fRunning.load(std::memory_order_acquire);
+            uint64_t tail = fTail.load(std::memory_order_relaxed);
+            uint64_t head = fHead.load(std::memory_order_acquire);
+            while (tail != head) {
+                // One contiguous run of slots, up to the end of the ring
+                uint64_t first = tail % fSlots;
+                uint64_t count = std::min(head - tail, fSlots - first);
+                const uint8_t* slots = &fArena[first * sampleSize];
+                for (uint64_t i = 0; i < count; i++) {
+                    const uint8_t* sample = slots + i * sampleSize;
+                    if (fReduce && (sample = fReducer.add(sample)) == nullptr) {
+                        continue;
+                    }
+                    append(sample, !direct);
+                }
+                if (direct) {
+                    fFailed |= !writeAll(slots, count * sampleSize);
+                    fBytes += count * sampleSize;
+                }
+                tail += count;
+                fTail.store(tail, std::memory_order_release);
+            }
+            if (!running && fReduce) {
+                const uint8_t* last = fReducer.finish();
+                if (last != nullptr) {
+                    append(last, true);
+                }
+            }
+            if (fEncodedBytes != 0) {
+                flush();
+            }
+            if (!running) {
+                break;
+            }
+            usleep(kPollInterval);
+        }
+    }
+
+    int                 fd = -1;
+    char                fPath[256] = {};
+    PDClip::Header      fHeader = {};
+    PDClip::Encoding    fEncoding = PDClip::kRaw;
+    uint16_t            fKeyInterval = PDClip::kDefaultKeyInterval;
+    uint32_t            fFlags = 0;
+    double              fTolerance[PDClip::kMaxJoints] = {};
+    bool                fReduce = false;
+    size_t              fArenaSize = kDefaultArenaSize;
+    size_t              fArenaBytes = 0;
+    uint64_t            fSlots = 0;
+    std::unique_ptr<uint8_t[]> fArena;
+    // Writer thread
+    std::unique_ptr<uint8_t[]> fEncoded;
+    size_t              fEncodedBytes = 0;
+    uint32_t            fPrevTime = 0;
+    PDClipReducer       fReducer;
+    uint32_t            fNextIndexTime = 0;
+    int16_t             fPrevValues[PDClip::kMaxValues];
+    std::vector<PDClip::IndexEntry> fIndex;
+    std::vector<uint64_t> fKeyframes;
+    uint64_t            fNumSamples = 0;
+    uint64_t            fBytes = 0;             // Sample bytes written
+    uint64_t            fAdded = 0;             // Control thread
+    std::atomic<uint64_t> fDropped { 0 };
+    bool                fFailed = false;
+    std::atomic<bool>   fRunning { false };
+    // Producer and consumer positions in samples, on separate cache lines
+    alignas(64) std::atomic<uint64_t> fHead { 0 };
+    alignas(64) std::atomic<uint64_t> fTail { 0 };
+    std::thread         fThread;
+};
@@ -35,6 +35,8 @@ struct Bus {
     BusType type;
     PDString adapter;
     int version;
+    bool pipelined = false;
+    int timeout = 0;    // Reply timeout in microseconds (0 for default)
 
     bool isUsed() const {
         return name.length() != 0;
@@ -49,6 +51,7 @@ struct Neck {
     double kd;
     double tau;
     bool invert;
+    int rate = 0;       // Command rate in Hz (0 for every cycle)
 };
 
 struct Leg {
@@ -61,6 +64,7 @@ struct Leg {
         double kd;
         double tau;
         bool invert;
+        int rate = 0;   // Command rate in Hz (0 for every cycle)
     };     
 
     struct {
@@ -106,6 +110,12 @@ struct convert<PDConfig::Bus> {
         node["type"] = "GoMotor";
         node["adapter"] = rhs.adapter;
         node["version"] = rhs.version;
+        if (rhs.pipelined) {
+            node["pipelined"] = rhs.pipelined;
+        }
+        if (rhs.timeout != 0) {
+            node["timeout"] = rhs.timeout;
+        }
         return node;
     }
 
@@ -128,6 +138,8 @@ struct convert<PDConfig::Bus> {
         if (rhs.version != 1 && rhs.version != 2) {
             return false;
         }
+        rhs.pipelined = (node["pipelined"]) ? node["pipelined"].as<bool>() : false;
+        rhs.timeout = (node["timeout"]) ? node["timeout"].as<int>() : 0;
         return true;
     }
 };
@@ -180,6 +192,9 @@ struct convert<PDConfig::Neck> {
         node["kd"] = rhs.kd;
         node["tau"] = rhs.tau;
         node["invert"] = rhs.invert;
+        if (rhs.rate != 0) {
+            node["rate"] = rhs.rate;
+        }
         return node;
     }
 
@@ -201,6 +216,7 @@ struct convert<PDConfig::Neck> {
         rhs.kd = node["kd"].as<double>();
         rhs.tau = node["tau"].as<double>();
         rhs.invert = node["invert"].as<bool>();
+        rhs.rate = (node["rate"]) ? node["rate"].as<int>() : 0;
         return true;
     }
 };
@@ -215,6 +231,9 @@ struct convert<PDConfig::Leg::Joint> {
         node["kd"] = rhs.kd;
         node["tau"] = rhs.tau;
         node["invert"] = rhs.invert;
+        if (rhs.rate != 0) {
+            node["rate"] = rhs.rate;
+        }
         return node;
     }
 
@@ -234,6 +253,7 @@ struct convert<PDConfig::Leg::Joint> {
         rhs.kd = node["kd"].as<double>();
         rhs.tau = node["tau"].as<double>();
         rhs.invert = node["invert"].as<bool>();
+        rhs.rate = (node["rate"]) ? node["rate"].as<int>() : 0;
         return true;
     }
 };
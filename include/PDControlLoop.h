@@ -0,0 +1,151 @@
+#pragma once
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "PDUtils.h"
+
+// Runs the control loop at a fixed rate. Each cycle sleeps until an
+// absolute CLOCK_MONOTONIC deadline so time spent in the cycle does not
+// accumulate as drift. The wake-up latency of every cycle is recorded in a
+// histogram and cycles whose deadline had already passed are counted as
+// overruns. Overrun cycles are skipped rather than run back to back.
+class PDControlLoop {
+public:
+    // Wake-up latency buckets are powers of two in microseconds
+    static constexpr unsigned kNumBuckets = 16;
+
+    PDControlLoop(unsigned rate = 500) {
+        setRate(rate);
+    }
+
+    void setRate(unsigned rate) {
+        fRate = (rate != 0) ? rate : 1;
+        fPeriod = 1000000000ull / fRate;
+    }
+
+    unsigned getRate() const {
+        return fRate;
+    }
+
+    uint64_t getPeriod() const {
+        return fPeriod;
+    }
+
+    // Run the calling thread as SCHED_FIFO and lock all memory to avoid page faults
+    bool setRealtime(int priority = 80) {
+        bool success = true;
+        struct sched_param param = {};
+        param.sched_priority = priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n", priority, strerror(err));
+            success = false;
+        }
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+            fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+            success = false;
+        }
+        return success;
+    }
+
+    // Pin the calling thread to a single CPU
+    bool setCPU(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "Failed to pin to CPU %d: %s\n", cpu, strerror(err));
+            return false;
+        }
+        return true;
+    }
+
+    void start() {
+        fDeadline = currentTimeNanos() + fPeriod;
+        fCycleCount = 0;
+        fOverrunCount = 0;
+        fMaxLatency = 0;
+        memset(fHistogram, '\0', sizeof(fHistogram));
+    }
+
+    // Sleep until the next cycle. Returns the time the cycle started.
+    uint64_t wait() {
+        uint64_t now = currentTimeNanos();
+        if (now >= fDeadline) {
+            // Missed the deadline. Skip to the next one we can still make.
+            uint64_t missed = (now - fDeadline) / fPeriod + 1;
+            fOverrunCount += missed;
+            fDeadline += missed * fPeriod;
+        }
+        struct timespec ts;
+        ts.tv_sec = fDeadline / 1000000000;
+        ts.tv_nsec = fDeadline % 1000000000;
+#if defined(HAVE_CLOCK_MONOTONIC)
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+#else
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+#endif
+        }
+        now = currentTimeNanos();
+        uint64_t latency = (now > fDeadline) ? now - fDeadline : 0;
+        record(latency);
+        fDeadline += fPeriod;
+        fCycleCount++;
+        return now;
+    }
+
+    uint64_t getCycleCount() const {
+        return fCycleCount;
+    }
+
+    uint64_t getOverrunCount() const {
+        return fOverrunCount;
+    }
+
+    uint64_t getMaxLatency() const {
+        return fMaxLatency;
+    }
+
+    void report(FILE* out = stdout) const {
+        fprintf(out, "Control loop %u Hz: %llu cycles, %llu overruns, max wake-up latency %.1f us\n",
+            fRate, (unsigned long long)fCycleCount, (unsigned long long)fOverrunCount,
+            double(fMaxLatency) / 1000.0);
+        for (unsigned i = 0; i < kNumBuckets; i++) {
+            if (fHistogram[i] == 0)
+                continue;
+            unsigned low = (i == 0) ? 0 : (1u << (i - 1));
+            if (i + 1 == kNumBuckets) {
+                fprintf(out, "  >= %6u us: %llu\n", low, (unsigned long long)fHistogram[i]);
+            } else {
+                fprintf(out, "  < %7u us: %llu\n", 1u << i, (unsigned long long)fHistogram[i]);
+            }
+        }
+    }
+
+private:
+    void record(uint64_t latency) {
+        uint64_t us = latency / 1000;
+        unsigned bucket = 0;
+        while (us != 0 && bucket + 1 < kNumBuckets) {
+            us >>= 1;
+            bucket++;
+        }
+        fHistogram[bucket]++;
+        if (latency > fMaxLatency) {
+            fMaxLatency = latency;
+        }
+    }
+
+    unsigned    fRate = 500;
+    uint64_t    fPeriod = 0;
+    uint64_t    fDeadline = 0;
+    uint64_t    fCycleCount = 0;
+    uint64_t    fOverrunCount = 0;
+    uint64_t    fMaxLatency = 0;
+    uint64_t    fHistogram[kNumBuckets] = {};
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include "PDUtils.h"
+
+// Timestamp of the current control cycle in nanoseconds. The control loop
+// reads the monotonic clock once per cycle with tick() and passes the value
+// down through PDRobot::update. Code that runs between cycles (motion
+// commands, recording, playback) uses now() so every joint in a cycle sees
+// the same time. Before the first tick now() reads the clock directly.
+class PDCycleClock {
+public:
+    static inline uint64_t tick() {
+        return tick(currentTimeNanos());
+    }
+
+    static inline uint64_t tick(uint64_t now) {
+        sNow.store(now, std::memory_order_relaxed);
+        return now;
+    }
+
+    static inline uint64_t now() {
+        uint64_t now = sNow.load(std::memory_order_relaxed);
+        return (now != 0) ? now : currentTimeNanos();
+    }
+
+    static constexpr uint64_t fromMillis(uint64_t millis) {
+        return millis * 1000000;
+    }
+
+    static constexpr uint64_t toMillis(uint64_t nanos) {
+        return nanos / 1000000;
+    }
+
+private:
+    static inline std::atomic<uint64_t> sNow { 0 };
+};
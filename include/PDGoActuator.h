@@ -5,9 +5,29 @@
 #include "PDEasing.h"
 #include "PDGoMotorBus.h"
 #include "PDUtils.h"
+#include "PDCycleClock.h"
 
 class PDGoActuator {
 public:
+    // Copy of the actuator state for code that runs outside the control thread
+    struct State {
+        double      fCommanded = NAN;   // Commanded position (degrees)
+        double      fDegrees = NAN;     // Measured position (degrees)
+        double      fPosition = NAN;    // Measured position within range [0-1]
+        double      fMinDegrees = NAN;
+        double      fMaxDegrees = NAN;
+        float       fDQ = 0;
+        float       fTau = 0;
+        int         fTemperature = 0;
+        int         fError = 0;
+        int         fFootForce = 0;
+        unsigned    fMissCount = 0;
+        unsigned    fErrorCount = 0;
+        bool        fActive = false;
+        bool        fMoving = false;
+        bool        fIgnore = false;
+    };
+
     PDGoActuator() {
         fName[0] = '\0';
     }
@@ -47,14 +67,35 @@ public:
         fKP = kp;
     }
 
+    double getKP() const {
+        return fKP;
+    }
+
     void setKD(double kd) {
         fKD = kd;
     }
 
+    double getKD() const {
+        return fKD;
+    }
+
     void setTau(double tau) {
         fTau = tau;
     }
 
+    double getTau() const {
+        return fTau;
+    }
+
+    // How often the actuator is commanded in Hz, 0 for every control cycle
+    void setRate(unsigned rate) {
+        fRate = rate;
+    }
+
+    unsigned getRate() const {
+        return fRate;
+    }
+
     inline bool isRangeValid() const {
         return (fRange[0] != fRange[1]);
     }
@@ -80,22 +121,23 @@ public:
         fActive = true;
         double finalPos = std::min(getMaximum(), std::max(getMinimum(), degrees));
         if (moveTime != 0) {
-            uint64_t timeNow = currentTimeMillis();
-            fStartTime = startDelay + timeNow;
-            fFinishTime = moveTime + fStartTime;
+            uint64_t timeNow = PDCycleClock::now();
+            fStartTime = PDCycleClock::fromMillis(startDelay) + timeNow;
+            fFinishTime = PDCycleClock::fromMillis(moveTime) + fStartTime;
             fOffTime = fFinishTime;
             if (moveTime == 0)
-                fOffTime += 200;
+                fOffTime += PDCycleClock::fromMillis(200);
             fFinishPos = finalPos;
             fPosNow = fDegrees;
             fStartPosition = fPosNow;
             fDeltaPos = fFinishPos - fPosNow;
-            fLastMoveTime = currentTimeMillis();
+            fLastMoveTime = timeNow;
         } else {
             fPosNow = finalPos;
         }
     }
 
+    // timeNow is the cycle time in nanoseconds (see PDCycleClock)
     void move(uint64_t timeNow)
     {
         Easing::Method easing = Easing::get(fEasingMethod);
@@ -112,8 +154,8 @@ public:
             }
             else if (fLastMoveTime != timeNow)
             {
-                uint32_t timeSinceLastMove = timeNow - fStartTime;
-                uint32_t denominator = fFinishTime - fStartTime;
+                uint64_t timeSinceLastMove = timeNow - fStartTime;
+                uint64_t denominator = fFinishTime - fStartTime;
                 double fractionChange = easing(double(timeSinceLastMove) / double(denominator));
                 double distanceToMove = fDeltaPos * fractionChange;
                 double newPos = fStartPosition + distanceToMove;
@@ -145,20 +187,28 @@ public:
         fOffTime = 0;
     }
 
-    void update(PDGoMotorCmd& cmd, PDGoMotorFeedback& feedback) {
+    void update(PDGoMotorCmd& cmd, PDGoMotorFeedback& feedback, uint64_t now) {
         if (fIgnore) {
             cmd.setInvalid();
             return;
         }
-        move(currentTimeMillis());
+        move(now);
+        if (fActive && PDLog::isVerboseMove()) {
+            PDTrace::value(PDTrace::kMove, nullptr, getName(), fPosNow);
+        }
+        fill(cmd, fActive, fPosNow);
+        feedback.init();
+    }
+
+    // The command update() sends to hold degrees, or to brake when not
+    // active. Also used to render commands ahead of time.
+    void fill(PDGoMotorCmd& cmd, bool active, double degrees) const {
         cmd.setMotorID(fMotorID);
-        if (fActive) {
-            if (PDLog::isVerboseMove())
-                printf("[%s]: %f\n", getName(), fPosNow);
+        if (active) {
             cmd.setFOCMode();
             cmd.setKP(fKP);
             cmd.setKD(fKD);
-            cmd.setQRadians(degreesToRadians(fPosNow));
+            cmd.setQRadians(degreesToRadians(degrees));
             cmd.setTau(fTau);
         } else {
             cmd.setBrakeMode();
@@ -168,7 +218,6 @@ public:
             cmd.setTau(0.0);
         }
         cmd.setDQ(0);
-        feedback.init();
     }
 
     bool checkRange() const {
@@ -178,7 +227,10 @@ public:
         return true;
     }
 
-    void update(PDGoMotorFeedback& feedback) {
+    void update(const PDGoMotorFeedback& feedback, uint64_t now) {
+        if (feedback.getMotorID() == fMotorID) {
+            fFeedback = feedback;
+        }
         if (feedback.getError() != 0) {
             fErrorCount++;
         } else if (feedback.getMotorID() != fMotorID) {
@@ -194,27 +246,32 @@ public:
             if (std::isnan(fMaxDegrees) || fMaxDegrees > fDegrees) {
                 fMaxDegrees = fDegrees;
             }
-            fLastResponse = currentTimeMillis();
+            fLastResponse = now;
         }
     }
 
-    bool update() {
+    bool update(uint64_t now = PDCycleClock::now()) {
         if (fBus == nullptr) {
             fprintf(stderr, "UNRESOLVED ACTUATOR BUS\n");
             return false;
         }
         PDGoMotorCmd cmd;
         PDGoMotorFeedback feedback;
-        update(cmd, feedback);
+        update(cmd, feedback, now);
         if (!fBus->sendRecv(&cmd, &feedback)) {
             printf("ERROR");
             fMissCount++;
             return false;
         }
-        update(feedback);
+        update(feedback, now);
         return true;
     }
 
+    // Called when the bus gave up waiting for this motor's reply
+    void noResponse() {
+        fMissCount++;
+    }
+
     unsigned getMissCount() const {
         return fMissCount;
     }
@@ -247,16 +304,45 @@ public:
     }
 
     inline double getPosition() const {
+        return toPosition(fDegrees, true);
+    }
+
+    // Last feedback received from this motor
+    const PDGoMotorFeedback& getFeedback() const {
+        return fFeedback;
+    }
+
+    void getState(State& state) const {
+        state.fCommanded = fPosNow;
+        state.fDegrees = fDegrees;
+        state.fPosition = toPosition(fDegrees, false);
+        state.fMinDegrees = fMinDegrees;
+        state.fMaxDegrees = fMaxDegrees;
+        state.fDQ = fFeedback.getDQ();
+        state.fTau = fFeedback.getTau();
+        state.fTemperature = fFeedback.getTemperature();
+        state.fError = fFeedback.getError();
+        state.fFootForce = fFeedback.getFootForce();
+        state.fMissCount = fMissCount;
+        state.fErrorCount = fErrorCount;
+        state.fActive = fActive;
+        state.fMoving = isMoving();
+        state.fIgnore = fIgnore;
+    }
+
+    double toPosition(double degrees, bool report) const {
         if (isRangeValid()) {
             double position;
             if (fRange[0] < fRange[1]) {
-                position = (fDegrees - fRange[0]) / (fRange[1] - fRange[0]);
+                position = (degrees - fRange[0]) / (fRange[1] - fRange[0]);
             } else {
-                position = -((fDegrees - fRange[0]) / (fRange[0] - fRange[1]));
+                position = -((degrees - fRange[0]) / (fRange[0] - fRange[1]));
             }
             if (position < -0.5 || position > 1.5) {
-                fprintf(stderr, "ERROR ACUTATOR: \"%s\" OUT OF ALIGNMENT\n", fName);
-                fprintf(stderr, "[%s] pos=%f degrees=%f [%f:%f]\n", fName, position, fDegrees, fRange[0], fRange[1]);
+                if (report) {
+                    fprintf(stderr, "ERROR ACUTATOR: \"%s\" OUT OF ALIGNMENT\n", fName);
+                    fprintf(stderr, "[%s] pos=%f degrees=%f [%f:%f]\n", fName, position, degrees, fRange[0], fRange[1]);
+                }
                 return NAN;
             } else if (position < 0) {
                 return 0;
@@ -293,9 +379,13 @@ public:
         fIgnore = true;
     }
 
+    bool isIgnored() const {
+        return fIgnore;
+    }
+
     inline uint32_t timeSinceLastResponse() const {
         if (fLastResponse) {
-            return currentTimeMillis() - fLastResponse;
+            return PDCycleClock::toMillis(PDCycleClock::now() - fLastResponse);
         }
         return ~0;
     }
@@ -312,6 +402,7 @@ private:
     bool            fIgnore = false;
     uint8_t         fMotorID = 0;
     bool            fActive = false;
+    unsigned        fRate = 0;
     double          fRange[2] = { 0, 0 };
     double          fMinDegrees = NAN;
     double          fMaxDegrees = NAN;
@@ -328,5 +419,6 @@ private:
     double          fDeltaPos = 0;
     double          fDegrees = 0;
     uint64_t        fLastResponse = 0;
+    PDGoMotorFeedback fFeedback = {};
     double          (*fEasingMethod)(double completion) = nullptr;
 };
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <string>
+#include <algorithm>
 #include <assert.h>
 #include <fcntl.h>
 #include <string.h>
 #include "PDUtils.h"
 #include "PDGoMotorCmd.h"
+#include "PDBusStats.h"
+#include "PDBusReactor.h"
+#include "PDGoMotorStream.h"
 
 class PDGoMotorBus {
 public:
@@ -18,7 +22,7 @@ public:
         snprintf(fPort, sizeof(fPort), "%s", port);
         snprintf(fName, sizeof(fName), "%s", name);
         fMotorCRC.setVersion(version);
-        fd = open(port, O_RDWR | O_NOCTTY);
+        fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
         if (fd <= 0) {
             fprintf(stderr, "Error opening serial port %s: %s\n", port, strerror(errno));
             return;
@@ -62,85 +66,148 @@ public:
         tty.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
         tty.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
 
-        tty.c_cc[VTIME] = 2;   // Dont wait return immediately
+        tty.c_cc[VTIME] = 0;   // Reply deadlines are handled by the reactor
         tty.c_cc[VMIN] = 0;
 
         if (tcsetattr(fd, TCSANOW, &tty) != 0) {
             perror("tcsetattr fd");
         }
         tcflush(fd, TCIFLUSH);
+        if (!fReactor.open(fd)) {
+            close(fd);
+            fd = -1;
+        }
     }
 
-    ~PDGoMotorBus() {
-        if (fd != -1) {
+    // Adopt an already open descriptor such as one end of a socketpair.
+    // No terminal settings are applied. The bus closes it when destroyed.
+    PDGoMotorBus(const char* name, int descriptor, int version = 1) {
+        snprintf(fPort, sizeof(fPort), "fd:%d", descriptor);
+        snprintf(fName, sizeof(fName), "%s", name);
+        fMotorCRC.setVersion(version);
+        fd = descriptor;
+        if (fd < 0) {
+            fd = -1;
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (!fReactor.open(fd)) {
             close(fd);
             fd = -1;
         }
     }
 
-    void setReadTimeout(uint32_t centiseconds, int minAvailable = 0) {
-        struct termios tty;
-        if(tcgetattr(fd, &tty) != 0) {
-            fprintf(stderr, "Error %i from tcgetattr: %s\n", errno, strerror(errno));
+    ~PDGoMotorBus() {
+        fReactor.close();
+        if (fd != -1) {
             close(fd);
             fd = -1;
-            return;
-        }
-        tty.c_cc[VTIME] = centiseconds;
-        tty.c_cc[VMIN] = minAvailable;
-        if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-            perror("tcsetattr fd");
         }
     }
 
+    // Timeout and minimum byte count used by read(). Same units as termios VTIME/VMIN.
+    void setReadTimeout(uint32_t deciseconds, int minAvailable = 0) {
+        fReadTimeout = uint64_t(deciseconds) * 100000000;
+        fReadMinimum = minAvailable;
+    }
+
+    // How long to wait for each motor's reply before counting it as missing
+    void setReplyTimeout(uint32_t microseconds) {
+        fReplyTimeout = uint64_t(microseconds) * 1000;
+    }
+
+    uint32_t getReplyTimeout() const {
+        return fReplyTimeout / 1000;
+    }
+
     bool send(PDGoMotorCmd* cmd) {
         if (fd == -1) {
             return false;
         }
-        if (!cmd->write(fd, fMotorCRC)) {
+        const uint8_t* frame = cmd->getFrame(fMotorCRC);
+        if (PDLog::isVerboseMotor()) {
+            PDTrace::frame(PDTrace::kTxFrame, frame, PDGoMotorCmd::kFrameSize);
+        }
+        if (!writeAll(frame, PDGoMotorCmd::kFrameSize, currentTimeNanos() + kWriteTimeout)) {
             fprintf(stderr, "FAILED TO WRITE MOTOR COMMAND TO %s\n", fPort);
             return false;
         }
+        fStats.fTxBytes.add(PDGoMotorCmd::kFrameSize);
         return true;
     }
 
     bool sendRecv(PDGoMotorCmd* cmd, PDGoMotorFeedback* feedback) {
-        feedback->init();
-        if (!cmd->isValid()) {
-            return true;
-        }
-        if (fd == -1) {
-            return false;
-        }
-        if (!cmd->write(fd, fMotorCRC)) {
-            fprintf(stderr, "FAILED TO WRITE MOTOR COMMAND TO %s\n", fPort);
-            return false;
-        }
-        if (!feedback->read(fd, fMotorCRC)) {
-            return false;
-        }
-        return true;
+        const uint8_t* frame = cmd->isValid() ? cmd->getFrame(fMotorCRC) : nullptr;
+        return (sendRecvBatch(1, &frame, feedback) == 1);
     }
 
+    // Send each command and collect its reply. feedback[i] holds the reply
+    // for cmd[i] and is left invalid if that motor did not answer.
     unsigned sendRecv(unsigned count, PDGoMotorCmd* cmd, PDGoMotorFeedback* feedback) {
         unsigned successCount = 0;
-        for (unsigned i = 0; i < count; i++) {
-            if (sendRecv(&cmd[i], &feedback[successCount])) {
-                successCount++;
+        for (unsigned i = 0; i < count; i += kMaxBatch) {
+            const uint8_t* frames[kMaxBatch];
+            unsigned batch = std::min(count - i, kMaxBatch);
+            for (unsigned j = 0; j < batch; j++) {
+                frames[j] = cmd[i + j].isValid() ? cmd[i + j].getFrame(fMotorCRC) : nullptr;
             }
+            successCount += sendRecv(batch, frames, &feedback[i]);
+        }
+        return successCount;
+    }
+
+    // Same for frames that are already encoded for this bus' CRC version,
+    // such as commands rendered ahead of time. A nullptr frame is skipped.
+    unsigned sendRecv(unsigned count, const uint8_t* const* frames, PDGoMotorFeedback* feedback) {
+        unsigned batchSize = fPipelined ? kMaxBatch : 1;
+        unsigned successCount = 0;
+        for (unsigned i = 0; i < count; i += batchSize) {
+            successCount += sendRecvBatch(std::min(count - i, batchSize), &frames[i], &feedback[i]);
         }
         return successCount;
     }
 
+    // Pipelined mode writes all command frames of a batch back to back and
+    // then collects the replies as they arrive instead of waiting for each
+    // reply before sending the next command.
+    void setPipelined(bool pipelined) {
+        fPipelined = pipelined;
+    }
+
+    bool isPipelined() const {
+        return fPipelined;
+    }
+
+    // Read up to bufferSize bytes. Returns once the read minimum has arrived
+    // or the read timeout passes (see setReadTimeout).
     ssize_t read(void* buffer, size_t bufferSize) {
-        return ::read(fd, buffer, bufferSize);
+        uint64_t deadline = currentTimeNanos() + fReadTimeout;
+        size_t minimum = std::min(bufferSize, size_t(std::max(fReadMinimum, 1)));
+        size_t len = 0;
+        while (len < bufferSize) {
+            ssize_t got = ::read(fd, (uint8_t*)buffer + len, bufferSize - len);
+            if (got > 0) {
+                len += got;
+                continue;
+            }
+            if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return (len != 0) ? ssize_t(len) : -1;
+            }
+            if (len >= minimum || fReactor.waitReadable(deadline) != PDBusReactor::kReady) {
+                break;
+            }
+        }
+        return len;
     }
 
     ssize_t write(const void* buffer, size_t bufferSize) {
-        return ::write(fd, buffer, bufferSize);
+        if (!writeAll(buffer, bufferSize, currentTimeNanos() + kWriteTimeout)) {
+            return -1;
+        }
+        return bufferSize;
     }
 
-    const char* getName() {
+    const char* getName() const {
         return fName;
     }
 
@@ -148,9 +215,152 @@ public:
         return fd;
     }
 
+    const PDGoMotorCRC& getCRC() const {
+        return fMotorCRC;
+    }
+
+    // Latency histograms and error counts, updated by every batch
+    const PDBusStats& getStats() const {
+        return fStats;
+    }
+
 private:
+    // One frame per motor ID on the bus
+    static constexpr unsigned kMaxBatch = 16;
+
+    static constexpr uint64_t kWriteTimeout = 100000000;
+
+    bool writeAll(const void* buffer, size_t bufferSize, uint64_t deadline) {
+        size_t len = 0;
+        while (len < bufferSize) {
+            ssize_t wrote = ::write(fd, (const uint8_t*)buffer + len, bufferSize - len);
+            if (wrote > 0) {
+                len += wrote;
+            } else if (wrote < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            } else if (fReactor.waitWritable(deadline) != PDBusReactor::kReady) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned sendRecvBatch(unsigned count, const uint8_t* const* frames, PDGoMotorFeedback* feedback) {
+        uint8_t txBuffer[kMaxBatch * PDGoMotorCmd::kFrameSize];
+        unsigned successCount = 0;
+        unsigned expected = 0;
+        size_t txLen = 0;
+        for (unsigned i = 0; i < count; i++) {
+            feedback[i].init();
+            if (frames[i] == nullptr) {
+                successCount++;
+                continue;
+            }
+            memcpy(&txBuffer[txLen], frames[i], PDGoMotorCmd::kFrameSize);
+            txLen += PDGoMotorCmd::kFrameSize;
+            expected++;
+        }
+        if (expected == 0) {
+            return successCount;
+        }
+        if (fd == -1) {
+            return successCount;
+        }
+        if (fLateReplies) {
+            // Drop replies that arrived after their deadline last time
+            tcflush(fd, TCIFLUSH);
+            fStream.clear();
+            fLateReplies = false;
+        }
+        if (PDLog::isVerboseMotor()) {
+            for (size_t i = 0; i < txLen; i += PDGoMotorCmd::kFrameSize) {
+                PDTrace::frame(PDTrace::kTxFrame, &txBuffer[i], PDGoMotorCmd::kFrameSize);
+            }
+        }
+        uint64_t start = currentTimeNanos();
+        if (!writeAll(txBuffer, txLen, start + kWriteTimeout)) {
+            fprintf(stderr, "FAILED TO WRITE MOTOR COMMAND TO %s\n", fPort);
+            return successCount;
+        }
+        if (fStats.fStartTime.get() == 0) {
+            fStats.fStartTime.set(start);
+        }
+        fStats.fBatches.add();
+        fStats.fFrames.add(expected);
+        fStats.fTxBytes.add(txLen);
+
+        // Every reply gets its own deadline counted from the previous reply so
+        // a missing motor costs one reply timeout rather than stalling the batch.
+        uint64_t sent = currentTimeNanos();
+        uint64_t deadline = sent + fReplyTimeout;
+        unsigned received = 0;
+        while (received < expected) {
+            PDGoMotorFeedback replies[kMaxBatch];
+            unsigned numReplies = fStream.nextBatch(replies, expected - received, fMotorCRC);
+            if (numReplies != 0) {
+                uint64_t now = currentTimeNanos();
+                deadline = now + fReplyTimeout;
+                for (unsigned r = 0; r < numReplies; r++) {
+                    unsigned i = 0;
+                    for (; i < count; i++) {
+                        if (frames[i] != nullptr && !feedback[i].isValid() &&
+                            PDGoMotorCmd::getMotorID(frames[i]) == replies[r].getMotorID())
+                        {
+                            feedback[i] = replies[r];
+                            successCount++;
+                            received++;
+                            fStats.fReplies.add();
+                            fStats.fRoundTrip[replies[r].getMotorID() & 0xF].record(now - sent);
+                            break;
+                        }
+                    }
+                    if (i == count) {
+                        // A late reply from an earlier batch, keep waiting for ours
+                        fStats.fWrongID.add();
+                    }
+                }
+                continue;
+            }
+            ssize_t len = fStream.fill(fd);
+            if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                break;
+            }
+            if (len > 0) {
+                fStats.fRxBytes.add(len);
+            } else {
+                PDBusReactor::Event event = fReactor.waitReadable(deadline);
+                if (event == PDBusReactor::kTimeout) {
+                    // Give up on one reply and move on to the next
+                    received++;
+                    fLateReplies = true;
+                    fStats.fTimeouts.add();
+                    if (fStream.available() != 0) {
+                        fStats.fShortReads.add();
+                    }
+                    deadline = currentTimeNanos() + fReplyTimeout;
+                } else if (event == PDBusReactor::kError) {
+                    break;
+                }
+            }
+        }
+        uint64_t elapsed = currentTimeNanos() - start;
+        fStats.fTransfer.record(elapsed);
+        fStats.fBusyTime.add(elapsed);
+        fStats.fCRCErrors.set(fStream.getCRCErrors());
+        fStats.fDroppedBytes.set(fStream.getDroppedBytes());
+        return successCount;
+    }
+
     char fName[16];
     char fPort[16];
     int fd = -1;
+    bool fPipelined = false;
+    bool fLateReplies = false;
+    int fReadMinimum = 0;
+    uint64_t fReadTimeout = 200000000;
+    uint64_t fReplyTimeout = 2000000;
+    PDBusReactor fReactor;
+    PDGoMotorStream fStream;
     PDGoMotorCRC fMotorCRC;
+    PDBusStats fStats;
 };
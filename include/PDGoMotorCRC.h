@@ -1,65 +1,156 @@
 #pragma once
 
-struct PDGoMotorCRC {
-    PDGoMotorCRC() {
-        assert(sizeof(fHighCRC)/sizeof(fHighCRC[0]) == sizeof(fLowCRC)/sizeof(fLowCRC[0]));
+/*
+ * Lookup tables for CRC-CCITT, generated at compile time. Table 0 is the
+ * CRC of each possible byte. The polynomial can be seen in entry 128, 0x8408.
+ * This corresponds to x^0 + x^5 + x^12. Add the implicit x^16, and you have
+ * the standard CRC-CCITT.
+ * https://github.com/torvalds/linux/blob/5bfc75d92efd494db37f5c4c173d3639d4772966/lib/crc-ccitt.c
+ *
+ * Table k is the CRC of a byte followed by k zero bytes. That lets several
+ * input bytes be folded with independent lookups (slicing-by-N) instead of
+ * one lookup that depends on the previous one per byte. Because a zero seeded
+ * CRC is linear, table k is also how much a byte with k bytes after it
+ * contributes to the CRC of a frame, which PDGoMotorCmd uses to update its
+ * CRC when a single field changes.
+ */
+struct PDGoMotorCRCTables {
+    static constexpr uint16_t kPolynomial = 0x8408;
+    static constexpr unsigned kNumTables = 16;
+
+    constexpr PDGoMotorCRCTables() : fTable() {
+        for (unsigned b = 0; b < 256; b++) {
+            uint16_t crc = b;
+            for (unsigned bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ kPolynomial : (crc >> 1);
+            }
+            fTable[0][b] = crc;
+        }
+        for (unsigned k = 1; k < kNumTables; k++) {
+            for (unsigned b = 0; b < 256; b++) {
+                uint16_t crc = fTable[k - 1][b];
+                fTable[k][b] = (crc >> 8) ^ fTable[0][crc & 0xFF];
+            }
+        }
     }
 
+    uint16_t fTable[kNumTables][256];
+};
+
+struct PDGoMotorCRC {
+    static constexpr unsigned kNumVersions = 2;
+    static constexpr uint8_t kHighCRC[kNumVersions] = { 0xF1, 0x85 };
+    static constexpr uint8_t kLowCRC[kNumVersions] = { 0x1E, 0x15 };
+
     void setVersion(unsigned version) {
         fVersion = version - 1;
-        assert(fVersion < sizeof(fHighCRC)/sizeof(fHighCRC[0]));
+        assert(fVersion < kNumVersions);
+    }
+
+    // Initial CRC value. Command frames mix a lock byte and a version
+    // specific seed in, feedback frames start from zero.
+    static constexpr uint16_t seed(unsigned versionIndex, uint8_t lockMask) {
+        return (lockMask != 0) ? kTables.fTable[0][lockMask ^ kHighCRC[versionIndex]] ^ kLowCRC[versionIndex] : 0;
+    }
+
+    inline uint16_t seed(uint8_t lockMask = 0) const {
+        return seed(fVersion, lockMask);
+    }
+
+    // Run crc over len zero bytes. XORed with the zero seeded CRC of a len
+    // byte payload this gives the CRC of the payload starting from crc.
+    static constexpr uint16_t advance(uint16_t crc, size_t len) {
+        for (; len > 0; len--) {
+            crc = (crc >> 8) ^ kTables.fTable[0][crc & 0xFF];
+        }
+        return crc;
+    }
+
+    uint16_t crc(const void* bytes, size_t len, uint8_t lockMask = 0) const {
+        return update(seed(lockMask), (const uint8_t*)bytes, len);
+    }
+
+    // Checksum count frames of len bytes each, stride bytes apart. Frames are
+    // done two at a time so their lookup chains overlap.
+    void crc(const void* frames, size_t stride, size_t count, size_t len,
+             uint16_t* result, uint8_t lockMask = 0) const
+    {
+        const uint8_t* base = (const uint8_t*)frames;
+        uint16_t initial = seed(lockMask);
+        size_t i = 0;
+        for (; i + 1 < count; i += 2) {
+            const uint8_t* a = base + i * stride;
+            const uint8_t* b = a + stride;
+            uint16_t crcA = initial;
+            uint16_t crcB = initial;
+            size_t n = len;
+            for (; n >= 8; n -= 8, a += 8, b += 8) {
+                crcA = slice8(crcA, a);
+                crcB = slice8(crcB, b);
+            }
+            if (n >= 4) {
+                crcA = slice4(crcA, a);
+                crcB = slice4(crcB, b);
+                n -= 4, a += 4, b += 4;
+            }
+            for (; n > 0; n--) {
+                crcA = (crcA >> 8) ^ kTables.fTable[0][(crcA ^ *a++) & 0xFF];
+                crcB = (crcB >> 8) ^ kTables.fTable[0][(crcB ^ *b++) & 0xFF];
+            }
+            result[i] = crcA;
+            result[i + 1] = crcB;
+        }
+        if (i < count) {
+            result[i] = update(initial, base + i * stride, len);
+        }
     }
 
-    uint16_t crc(void* bytes, size_t len, uint8_t lockMask = 0) const {
-        /*
-         * This mysterious table is just the CRC of each possible byte. It can be
-         * computed using the standard bit-at-a-time methods. The polynomial can
-         * be seen in entry 128, 0x8408. This corresponds to x^0 + x^5 + x^12.
-         * Add the implicit x^16, and you have the standard CRC-CCITT.
-         * https://github.com/torvalds/linux/blob/5bfc75d92efd494db37f5c4c173d3639d4772966/lib/crc-ccitt.c
-         */
-        static uint16_t const sTable[256] = {
-            0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-            0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-            0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-            0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-            0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-            0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-            0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-            0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-            0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-            0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-            0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-            0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-            0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-            0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-            0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-            0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-            0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-            0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-            0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-            0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-            0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-            0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-            0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-            0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-            0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-            0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-            0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-            0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-            0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-            0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-            0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-            0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-        };
-        uint16_t crc = (lockMask != 0) ? sTable[lockMask ^ fHighCRC[fVersion]] ^ fLowCRC[fVersion] : 0;
+    // Reference implementation, one table lookup per byte
+    uint16_t crcBytewise(const void* bytes, size_t len, uint8_t lockMask = 0) const {
+        uint16_t crc = seed(lockMask);
         for (size_t i = 0; i < len; i++) {
-            crc = (crc >> 8) ^ sTable[(crc ^ ((uint8_t*)bytes)[i]) & 0xFF];
+            crc = (crc >> 8) ^ kTables.fTable[0][(crc ^ ((const uint8_t*)bytes)[i]) & 0xFF];
         }
         return crc;
     }
 
+    static inline uint16_t update(uint16_t crc, const uint8_t* p, size_t len) {
+        for (; len >= 8; len -= 8, p += 8) {
+            crc = slice8(crc, p);
+        }
+        if (len >= 4) {
+            crc = slice4(crc, p);
+            len -= 4, p += 4;
+        }
+        for (; len > 0; len--) {
+            crc = (crc >> 8) ^ kTables.fTable[0][(crc ^ *p++) & 0xFF];
+        }
+        return crc;
+    }
+
+    static inline uint16_t slice4(uint16_t crc, const uint8_t* p) {
+        return kTables.fTable[3][(p[0] ^ crc) & 0xFF] ^
+               kTables.fTable[2][(p[1] ^ (crc >> 8)) & 0xFF] ^
+               kTables.fTable[1][p[2]] ^
+               kTables.fTable[0][p[3]];
+    }
+
+    static inline uint16_t slice8(uint16_t crc, const uint8_t* p) {
+        return kTables.fTable[7][(p[0] ^ crc) & 0xFF] ^
+               kTables.fTable[6][(p[1] ^ (crc >> 8)) & 0xFF] ^
+               kTables.fTable[5][p[2]] ^
+               kTables.fTable[4][p[3]] ^
+               kTables.fTable[3][p[4]] ^
+               kTables.fTable[2][p[5]] ^
+               kTables.fTable[1][p[6]] ^
+               kTables.fTable[0][p[7]];
+    }
+
+    static constexpr PDGoMotorCRCTables kTables {};
+
     uint8_t fVersion = 0;
-    uint8_t fHighCRC[2] = { 0xF1, 0x85 };
-    uint8_t fLowCRC[2] = { 0x1E, 0x15 };
 };
+
+static_assert(PDGoMotorCRC::kTables.fTable[0][1] == 0x1189, "CRC table mismatch");
+static_assert(PDGoMotorCRC::kTables.fTable[0][128] == 0x8408, "CRC table mismatch");
+static_assert(PDGoMotorCRC::kTables.fTable[0][255] == 0x0f78, "CRC table mismatch");
@@ -1,8 +1,15 @@
 #pragma once
 
 #include "PDLog.h"
+#include "PDTrace.h"
 #include "PDGoMotorCRC.h"
 
+// A command frame that is kept encoded between cycles. Setters skip the
+// quantization when the value did not change and fold only the bytes that
+// did change into a running CRC of the payload, so encode() is O(1) and
+// reusing the same PDGoMotorCmd every cycle costs very little when only the
+// position moves. The payload is private so it can only change through the
+// setters, or setBytes() for a frame that arrived whole.
 struct PDGoMotorCmd {
     enum Mode {
         BRAKE = 0,
@@ -16,18 +23,19 @@ struct PDGoMotorCmd {
     }
 
     static constexpr float GEAR_RATIO = 6.33;
+    static constexpr size_t kFrameSize = 17;
+    static constexpr size_t kPayloadSize = kFrameSize - 4;
 
     inline Mode getMode() const {
         return Mode((cmd.fModeID>>4)&0xF);
     }
 
     inline void setMode(Mode mode) {
-        cmd.fModeID = ((cmd.fModeID&0x0F) | ((uint8_t(mode)&0xF) << 4));
+        setModeID((cmd.fModeID&0x0F) | ((uint8_t(mode)&0xF) << 4));
     }
 
     inline void setBootMode() {
-        cmd.fModeID = 0x7F;
-
+        setModeID(0x7F);
     }
 
     inline void setBrakeMode() {
@@ -43,38 +51,44 @@ struct PDGoMotorCmd {
     }
 
     inline void setMotorID(uint8_t motorID) {
-        cmd.fModeID = ((cmd.fModeID&0xF0) | (motorID&0xF));
+        store<1>(&cmd.fModeID, ((cmd.fModeID&0xF0) | (motorID&0xF)));
         fValid = true;
     }
 
     inline void setTau(float tau) {
+        if (tau == fLastTau) {
+            return;
+        }
+        fLastTau = tau;
         int16_t tau_int = int16_t(tau*256);
-        cmd.fTau[0] = uint8_t((tau_int>>0)&0xFF);
-        cmd.fTau[1] = uint8_t((tau_int>>8)&0xFF);
+        store<2>(cmd.fTau, uint16_t(tau_int));
     }
 
     inline void setDQ(float dq) {
+        if (dq == fLastDQ) {
+            return;
+        }
+        fLastDQ = dq;
         if (getMode() == FOC) {
             int16_t dq_int = int16_t(dq/25.6*32768.0);
-            cmd.fDQ[0] = uint8_t((dq_int>>0)&0xFF);
-            cmd.fDQ[1] = uint8_t((dq_int>>8)&0xFF);
+            store<2>(cmd.fDQ, uint16_t(dq_int));
         } else {
-            cmd.fDQ[0] = 0;
-            cmd.fDQ[1] = 0;
+            store<2>(cmd.fDQ, 0);
         }
     }
 
     inline void setQ(float q) {
+        if (q == fLastQ) {
+            return;
+        }
         if (q >= 411774) {
 
         } else if (q <= -411774) {
 
         } else {
+            fLastQ = q;
             int32_t q_int = int32_t(q/6.2832*32768.0);
-            cmd.fQ[0] = uint8_t((q_int>>0)&0xFF);
-            cmd.fQ[1] = uint8_t((q_int>>8)&0xFF);
-            cmd.fQ[2] = uint8_t((q_int>>16)&0xFF);
-            cmd.fQ[3] = uint8_t((q_int>>24)&0xFF);
+            store<4>(cmd.fQ, uint32_t(q_int));
         }
     }
 
@@ -87,42 +101,109 @@ struct PDGoMotorCmd {
     }
 
     inline void setKP(float kp) {
+        if (kp == fLastKP) {
+            return;
+        }
+        fLastKP = kp;
         int16_t kp_int = int16_t(kp/25.6*32768);
-        cmd.fKP[0] = uint8_t((kp_int>>0)&0xFF);
-        cmd.fKP[1] = uint8_t((kp_int>>8)&0xFF);
+        store<2>(cmd.fKP, uint16_t(kp_int));
     }
 
     inline void setKD(float kd) {
+        if (kd == fLastKD) {
+            return;
+        }
+        fLastKD = kd;
         int16_t kd_int = int16_t(kd/25.6*32768);
-        cmd.fKD[0] = uint8_t((kd_int>>0)&0xFF);
-        cmd.fKD[1] = uint8_t((kd_int>>8)&0xFF);
+        store<2>(cmd.fKD, uint16_t(kd_int));
+    }
+
+    inline float getTau() const {
+        return float(int16_t((cmd.fTau[1]<<8)|cmd.fTau[0]))/256;
+    }
+
+    inline float getDQ() const {
+        return float(int16_t((cmd.fDQ[1]<<8)|cmd.fDQ[0]))*25.6/32768.0;
+    }
+
+    inline float getQ() const {
+        return float(int32_t((cmd.fQ[3]<<24)|(cmd.fQ[2]<<16)|(cmd.fQ[1]<<8)|cmd.fQ[0])*6.2832/32768.0);
+    }
+
+    inline float getKP() const {
+        return float(int16_t((cmd.fKP[1]<<8)|cmd.fKP[0]))*25.6/32768.0;
+    }
+
+    inline float getKD() const {
+        return float(int16_t((cmd.fKD[1]<<8)|cmd.fKD[0]))*25.6/32768.0;
+    }
+
+    inline bool hasValidHeader() const {
+        return (fHeader[0] == 0xFE && fHeader[1] == 0xEE);
+    }
+
+    // An encoded frame as returned by getFrame(), e.g. one rendered ahead of time
+    static inline bool isFrame(const uint8_t* frame) {
+        return (frame[0] == 0xFE && frame[1] == 0xEE);
+    }
+
+    static inline uint8_t getMotorID(const uint8_t* frame) {
+        return (frame[2]&0xF);
+    }
+
+    inline bool hasValidCRC(const PDGoMotorCRC& motorCRC) const {
+        uint16_t crc = motorCRC.crc((void*)&cmd, sizeof(cmd), fHeader[1]);
+        return (fCRC[0] == uint8_t(crc & 0xFF) && fCRC[1] == uint8_t(crc >> 8));
     }
 
     inline bool isValid() {
         return fValid;
     }
 
+    // Take over a whole frame, e.g. one read off the wire. The running CRC is
+    // recomputed from the payload, so encode() still gives the right CRC.
+    inline void setBytes(const uint8_t* frame) {
+        memcpy(fBytes, frame, sizeof(fBytes));
+        fPayloadCRC = PDGoMotorCRC::update(0, &cmd.fModeID, kPayloadSize);
+        // Every setter stores its next value
+        fLastTau = fLastDQ = fLastQ = fLastKP = fLastKD = NAN;
+        fValid = true;
+    }
+
+    // The frame as it is, without filling in the CRC
+    inline const uint8_t* getBytes() const {
+        return fBytes;
+    }
+
     inline void setInvalid() {
         fValid = false;
     }
 
-    bool write(int fd, const PDGoMotorCRC& motorCRC) {
-        uint16_t crc = motorCRC.crc(&cmd, sizeof(cmd), fHeader[1]);
+    // Fill in the CRC so fBytes is ready to be sent as is
+    inline void encode(const PDGoMotorCRC& motorCRC) {
+        uint16_t crc = kSeed[motorCRC.fVersion] ^ fPayloadCRC;
         fCRC[0] = uint8_t(crc & 0xFF);
         fCRC[1] = uint8_t(crc >> 8);
+    }
+
+    // Encoded frame ready to be written to the bus
+    inline const uint8_t* getFrame(const PDGoMotorCRC& motorCRC) {
+        encode(motorCRC);
+        return fBytes;
+    }
+
+    bool write(int fd, const PDGoMotorCRC& motorCRC) {
+        encode(motorCRC);
         if (::write(fd, fBytes, sizeof(fBytes)) == sizeof(fBytes)) {
             if (PDLog::isVerboseMotor()) {
-                printf("[W] ");
-                for (unsigned i = 0; i < sizeof(fBytes); i++) {
-                    printf("%02X ", fBytes[i]);
-                }
-                printf("\n");
+                PDTrace::frame(PDTrace::kTxFrame, fBytes, sizeof(fBytes));
             }
             return true;
         }
         return false;
     }
 
+private:
     union {
         struct {
             uint8_t  fHeader[2];
@@ -138,12 +219,66 @@ struct PDGoMotorCmd {
         };
         uint8_t fBytes[17];
     };
+    static_assert(sizeof(cmd) == kPayloadSize, "Unexpected command payload size");
     bool fValid = false;
+
+    // CRC of an all zero payload after the version seed. XORed with
+    // fPayloadCRC it gives the frame CRC.
+    static constexpr uint16_t kSeed[PDGoMotorCRC::kNumVersions] = {
+        PDGoMotorCRC::advance(PDGoMotorCRC::seed(0, 0xEE), kPayloadSize),
+        PDGoMotorCRC::advance(PDGoMotorCRC::seed(1, 0xEE), kPayloadSize)
+    };
+
+    inline void setModeID(uint8_t modeID) {
+        if (modeID != cmd.fModeID) {
+            store<1>(&cmd.fModeID, modeID);
+            // setDQ depends on the mode
+            fLastDQ = NAN;
+        }
+    }
+
+    // Write a little endian field and fold the changed bits into fPayloadCRC.
+    // Unchanged bytes contribute fTable[k][0] == 0.
+    template <size_t kLen>
+    inline void store(uint8_t* field, uint32_t value) {
+        static_assert(kLen == 1 || kLen == 2 || kLen == 4, "Unsupported field size");
+        const auto& table = PDGoMotorCRC::kTables.fTable;
+        size_t bytesAfter = kPayloadSize - 1 - (field - &cmd.fModeID);
+        uint32_t delta = value ^ field[0];
+        if constexpr (kLen >= 2) {
+            delta ^= uint32_t(field[1]) << 8;
+        }
+        if constexpr (kLen == 4) {
+            delta ^= (uint32_t(field[2]) << 16) | (uint32_t(field[3]) << 24);
+        }
+        uint16_t crc = table[bytesAfter][delta & 0xFF];
+        field[0] = uint8_t(value);
+        if constexpr (kLen >= 2) {
+            crc ^= table[bytesAfter - 1][(delta >> 8) & 0xFF];
+            field[1] = uint8_t(value >> 8);
+        }
+        if constexpr (kLen == 4) {
+            crc ^= table[bytesAfter - 2][(delta >> 16) & 0xFF] ^ table[bytesAfter - 3][delta >> 24];
+            field[2] = uint8_t(value >> 16);
+            field[3] = uint8_t(value >> 24);
+        }
+        fPayloadCRC ^= crc;
+    }
+
+    // Zero seeded CRC of the payload (cmd)
+    uint16_t fPayloadCRC = 0;
+    float fLastTau = 0;
+    float fLastDQ = 0;
+    float fLastQ = 0;
+    float fLastKP = 0;
+    float fLastKD = 0;
 };
 
+
 struct PDGoMotorFeedback {
 
     static constexpr float GEAR_RATIO = 6.33;
+    static constexpr size_t kFrameSize = 16;
 
     inline void init() {
         invalid();
@@ -165,6 +300,51 @@ struct PDGoMotorFeedback {
         return float(int32_t((cmd.fQ[3]<<24)|(cmd.fQ[2]<<16)|(cmd.fQ[1]<<8)|cmd.fQ[0])*6.2832/32768.0);
     }
 
+    // Setters are used to produce replies (see PDGoMotorSim)
+    inline void setModeID(uint8_t mode, uint8_t motorID) {
+        cmd.fHeader[0] = 0xFD;
+        cmd.fHeader[1] = 0xEE;
+        cmd.fModeID = ((mode&0xF) << 4) | (motorID&0xF);
+    }
+
+    inline void setTau(float tau) {
+        int16_t tau_int = int16_t(tau*256);
+        cmd.fTau[0] = uint8_t((tau_int>>0)&0xFF);
+        cmd.fTau[1] = uint8_t((tau_int>>8)&0xFF);
+    }
+
+    inline void setDQ(float dq) {
+        int16_t dq_int = int16_t(dq/25.6*32768.0);
+        cmd.fDQ[0] = uint8_t((dq_int>>0)&0xFF);
+        cmd.fDQ[1] = uint8_t((dq_int>>8)&0xFF);
+    }
+
+    inline void setQ(float q) {
+        int32_t q_int = int32_t(q/6.2832*32768.0);
+        cmd.fQ[0] = uint8_t((q_int>>0)&0xFF);
+        cmd.fQ[1] = uint8_t((q_int>>8)&0xFF);
+        cmd.fQ[2] = uint8_t((q_int>>16)&0xFF);
+        cmd.fQ[3] = uint8_t((q_int>>24)&0xFF);
+    }
+
+    inline void setTemperature(int temp) {
+        cmd.fTemp = int8_t(std::min(std::max(temp, -128), 127));
+    }
+
+    inline void setError(int error) {
+        cmd.fErrorFlag = error;
+    }
+
+    inline void setFootForce(int force) {
+        cmd.fForce = force;
+    }
+
+    inline void encode(const PDGoMotorCRC& motorCRC) {
+        uint16_t crc = motorCRC.crc(&cmd, sizeof(cmd));
+        fCRC[0] = uint8_t(crc & 0xFF);
+        fCRC[1] = uint8_t(crc >> 8);
+    }
+
     inline float getCurrentAngle() const {
         return radiansToDegrees(getQ() / GEAR_RATIO);
     }
@@ -182,28 +362,42 @@ struct PDGoMotorFeedback {
     }
 
     inline bool isValid() const {
-        return cmd.fModeID != ~0;
+        return cmd.fModeID != uint8_t(~0);
     }
 
     inline void invalid() {
         cmd.fModeID = ~0;
     }
 
-    bool read(int fd, const PDGoMotorCRC& motorCRC) {
-        if (::read(fd, fBytes, sizeof(fBytes)) == sizeof(fBytes)) {
-            if (PDLog::isVerboseMotor()) {
-                printf("[R] ");
-                for (unsigned i = 0; i < sizeof(fBytes); i++) {
-                    printf("%02X ", fBytes[i]);
-                }
-                printf("\n");
-            }
+    inline bool hasValidHeader() const {
+        return (cmd.fHeader[0] == 0xFD && cmd.fHeader[1] == 0xEE);
+    }
+
+    inline bool hasValidCRC(const PDGoMotorCRC& motorCRC) const {
+        uint16_t crc = motorCRC.crc((void*)&cmd, sizeof(cmd));
+        return (fCRC[0] == uint8_t(crc & 0xFF) && fCRC[1] == uint8_t(crc >> 8));
+    }
+
+    // Decode a complete reply frame that has already been read from the bus
+    bool decode(const uint8_t* bytes, const PDGoMotorCRC& motorCRC) {
+        memcpy(fBytes, bytes, sizeof(fBytes));
+        if (PDLog::isVerboseMotor()) {
+            PDTrace::frame(PDTrace::kRxFrame, fBytes, sizeof(fBytes));
+        }
+        if (hasValidCRC(motorCRC)) {
+            return true;
+        } else {
             uint16_t crc = motorCRC.crc(&cmd, sizeof(cmd));
-            if (fCRC[0] == uint8_t(crc & 0xFF) && fCRC[1] == uint8_t(crc >> 8)) {
-                return true;
-            } else {
-                fprintf(stderr, "BAD CRC EXPECTED %02X:%02X GOT %02X:%02X\n", fCRC[0], fCRC[1], uint8_t(crc & 0xFF), uint8_t(crc >> 8));
-            }
+            fprintf(stderr, "BAD CRC EXPECTED %02X:%02X GOT %02X:%02X\n", fCRC[0], fCRC[1], uint8_t(crc & 0xFF), uint8_t(crc >> 8));
+        }
+        invalid();
+        return false;
+    }
+
+    bool read(int fd, const PDGoMotorCRC& motorCRC) {
+        uint8_t bytes[kFrameSize];
+        if (::read(fd, bytes, sizeof(bytes)) == sizeof(bytes)) {
+            return decode(bytes, motorCRC);
         }
         invalid();
         return false;
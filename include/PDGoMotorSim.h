@@ -0,0 +1,397 @@
+#pragma once
+
+#include <string>
+#include <random>
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include "PDUtils.h"
+#include "PDGoMotorCmd.h"
+
+// Emulates a chain of Go motors on one RS-485 bus. Command frames are read
+// from a file descriptor, every motor runs a simple PD dynamics model and
+// replies with a feedback frame after a configurable latency and jitter.
+// open() creates a pseudo-terminal so PDGoMotorBus can use the slave side
+// as its adapter without any changes.
+//
+// A boot mode frame puts motors in boot mode. Until a broadcast frame in any
+// other mode returns them to motor mode they only take change ID frames and
+// do not answer commands addressed to them.
+class PDGoMotorSim {
+public:
+    static constexpr unsigned kMaxMotors = 16;
+    static constexpr uint8_t kBroadcastID = 15;
+
+    struct Motor {
+        bool        fPresent = false;
+        uint8_t     fMode = PDGoMotorCmd::BRAKE;
+        double      fQ = 0;         // Rotor position (rad)
+        double      fDQ = 0;        // Rotor velocity (rad/s)
+        double      fTau = 0;       // Output torque (Nm)
+        double      fTargetQ = 0;
+        double      fTargetDQ = 0;
+        double      fTargetTau = 0;
+        double      fKP = 0;
+        double      fKD = 0;
+        double      fTemp = 25;
+        uint64_t    fLastUpdate = 0;
+        uint64_t    fLastModeChange = 0;
+        unsigned    fCommandCount = 0;
+        bool        fBoot = false;
+    };
+
+    PDGoMotorSim(int version = 1) {
+        fMotorCRC.setVersion(version);
+    }
+
+    PDGoMotorSim(const PDGoMotorSim&) = delete;
+    PDGoMotorSim& operator=(const PDGoMotorSim&) = delete;
+
+    ~PDGoMotorSim() {
+        close();
+    }
+
+    void addMotor(uint8_t id, double degrees = 0) {
+        if (id < kMaxMotors && id != kBroadcastID) {
+            Motor& motor = fMotor[id];
+            motor = Motor();
+            motor.fPresent = true;
+            motor.fQ = motor.fTargetQ = degreesToRadians(degrees) * PDGoMotorCmd::GEAR_RATIO;
+        }
+    }
+
+    void removeMotor(uint8_t id) {
+        if (id < kMaxMotors) {
+            fMotor[id].fPresent = false;
+        }
+    }
+
+    const Motor& getMotor(uint8_t id) const {
+        return fMotor[id & 0xF];
+    }
+
+    // Reply delay after a command frame has been received
+    void setLatency(uint32_t microseconds, uint32_t jitterMicroseconds = 0) {
+        fLatency = uint64_t(microseconds) * 1000;
+        fJitter = uint64_t(jitterMicroseconds) * 1000;
+    }
+
+    // Skip a whole frame on a CRC error instead of looking for the next
+    // header from the following byte, like a motor that only resyncs once
+    // it has read a full frame. A torn frame then also takes out the start
+    // of the frame that follows it.
+    void setStrictFraming(bool strict) {
+        fStrictFraming = strict;
+    }
+
+    // Rotor inertia (kg m^2) and viscous friction (Nm s/rad)
+    void setDynamics(double inertia, double friction) {
+        fInertia = inertia;
+        fFriction = friction;
+    }
+
+    // Create a pseudo-terminal and optionally symlink its slave side to linkPath
+    bool open(const char* linkPath = nullptr) {
+        close();
+        fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fd == -1 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+            fprintf(stderr, "Error creating pseudo-terminal: %s\n", strerror(errno));
+            close();
+            return false;
+        }
+        snprintf(fPort, sizeof(fPort), "%s", ptsname(fd));
+
+        // Keep the slave open so the master does not see EIO between clients
+        fSlaveFD = ::open(fPort, O_RDWR | O_NOCTTY);
+        if (fSlaveFD == -1) {
+            fprintf(stderr, "Error opening %s: %s\n", fPort, strerror(errno));
+            close();
+            return false;
+        }
+        struct termios tty;
+        if (tcgetattr(fSlaveFD, &tty) == 0) {
+            cfmakeraw(&tty);
+            tcsetattr(fSlaveFD, TCSANOW, &tty);
+        }
+        if (linkPath != nullptr) {
+            unlink(linkPath);
+            if (symlink(fPort, linkPath) != 0) {
+                fprintf(stderr, "Error linking %s to %s: %s\n", linkPath, fPort, strerror(errno));
+                close();
+                return false;
+            }
+            snprintf(fLink, sizeof(fLink), "%s", linkPath);
+        }
+        return true;
+    }
+
+    // Serve an existing descriptor such as one end of a socketpair
+    bool attach(int descriptor) {
+        close();
+        fd = descriptor;
+        fOwnsFD = false;
+        return true;
+    }
+
+    void close() {
+        if (fLink[0] != '\0') {
+            unlink(fLink);
+            fLink[0] = '\0';
+        }
+        if (fSlaveFD != -1) {
+            ::close(fSlaveFD);
+            fSlaveFD = -1;
+        }
+        if (fd != -1 && fOwnsFD) {
+            ::close(fd);
+        }
+        fd = -1;
+        fOwnsFD = true;
+        fPort[0] = '\0';
+    }
+
+    const char* getPortName() const {
+        return fPort;
+    }
+
+    int getFD() const {
+        return fd;
+    }
+
+    // Wait up to timeoutMS for commands and reply to them. Returns false on error.
+    bool poll(int timeoutMS) {
+        struct pollfd pfd = {};
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int ret = ::poll(&pfd, 1, timeoutMS);
+        if (ret < 0) {
+            return (errno == EINTR);
+        }
+        if (ret == 0) {
+            return true;
+        }
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            return false;
+        }
+        if (pfd.revents & POLLHUP) {
+            // Client side closed
+            usleep(1000);
+            return true;
+        }
+        return process();
+    }
+
+    // Handle every command currently buffered on the descriptor
+    bool process() {
+        uint8_t buffer[256];
+        ssize_t len = ::read(fd, buffer, sizeof(buffer));
+        if (len < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EIO);
+        }
+        for (ssize_t i = 0; i < len; i++) {
+            if (fRxLen == sizeof(fRx)) {
+                memmove(fRx, fRx + 1, --fRxLen);
+                fDroppedBytes++;
+            }
+            fRx[fRxLen++] = buffer[i];
+        }
+        size_t pos = 0;
+        while (fRxLen - pos >= kChangeIDSize) {
+            if (fRx[pos] == 0xFB && fRx[pos + 1] == 0x01 && fRx[pos + 3] == 0xBB) {
+                changeID(&fRx[pos]);
+                pos += kChangeIDSize;
+                continue;
+            }
+            if (fRx[pos] != 0xFE || fRx[pos + 1] != 0xEE) {
+                pos++;
+                fDroppedBytes++;
+                continue;
+            }
+            if (fRxLen - pos < PDGoMotorCmd::kFrameSize) {
+                break;
+            }
+            PDGoMotorCmd cmd;
+            cmd.setBytes(&fRx[pos]);
+            if (!cmd.hasValidCRC(fMotorCRC)) {
+                pos += fStrictFraming ? PDGoMotorCmd::kFrameSize : 1;
+                fCRCErrors++;
+                continue;
+            }
+            pos += PDGoMotorCmd::kFrameSize;
+            handle(cmd);
+        }
+        memmove(fRx, fRx + pos, fRxLen - pos);
+        fRxLen -= pos;
+        return true;
+    }
+
+    unsigned getCommandCount() const {
+        return fCommandCount;
+    }
+
+    unsigned getReplyCount() const {
+        return fReplyCount;
+    }
+
+    unsigned getCRCErrors() const {
+        return fCRCErrors;
+    }
+
+    unsigned getDroppedBytes() const {
+        return fDroppedBytes;
+    }
+
+private:
+    // FB 01 (new << 4 | old) BB moves a motor to a new ID and is echoed back
+    static constexpr size_t kChangeIDSize = 4;
+
+    void changeID(const uint8_t* frame) {
+        uint8_t oldID = frame[2] & 0xF;
+        uint8_t newID = frame[2] >> 4;
+        fCommandCount++;
+        if (newID == kBroadcastID) {
+            return;
+        }
+        bool changed = false;
+        for (unsigned id = 0; id < kMaxMotors; id++) {
+            if (fMotor[id].fPresent && fMotor[id].fBoot && (id == oldID || oldID == kBroadcastID) && id != newID) {
+                fMotor[newID] = fMotor[id];
+                fMotor[id].fPresent = false;
+                changed = true;
+                break;
+            }
+        }
+        if (changed || fMotor[newID].fPresent) {
+            if (::write(fd, frame, kChangeIDSize) == ssize_t(kChangeIDSize)) {
+                fReplyCount++;
+            }
+        }
+    }
+
+    void handle(const PDGoMotorCmd& cmd) {
+        uint64_t now = currentTimeNanos();
+        uint8_t id = cmd.getMotorID();
+        fCommandCount++;
+        if (id == kBroadcastID) {
+            // Broadcast frames are applied to every motor and never answered
+            for (unsigned i = 0; i < kMaxMotors; i++) {
+                if (fMotor[i].fPresent) {
+                    apply(fMotor[i], cmd, now);
+                }
+            }
+            return;
+        }
+        Motor& motor = fMotor[id];
+        if (!motor.fPresent || motor.fBoot) {
+            return;
+        }
+        apply(motor, cmd, now);
+        if (motor.fBoot) {
+            return;
+        }
+        uint64_t delay = fLatency;
+        if (fJitter != 0) {
+            delay += std::uniform_int_distribution<uint64_t>(0, fJitter)(fRandom);
+        }
+        if (delay != 0) {
+            uint64_t replyTime = now + delay;
+            struct timespec ts;
+            ts.tv_sec = replyTime / 1000000000;
+            ts.tv_nsec = replyTime % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+            }
+        }
+        reply(id, motor);
+    }
+
+    void apply(Motor& motor, const PDGoMotorCmd& cmd, uint64_t now) {
+        step(motor, now);
+        uint8_t mode = cmd.getMode();
+        motor.fBoot = (mode == kBootMode);
+        if (motor.fBoot) {
+            // The boot loader does not drive the motor
+            mode = PDGoMotorCmd::BRAKE;
+        }
+        if (mode != motor.fMode) {
+            motor.fLastModeChange = now;
+        }
+        motor.fMode = mode;
+        motor.fTargetQ = cmd.getQ();
+        motor.fTargetDQ = cmd.getDQ();
+        motor.fTargetTau = cmd.getTau();
+        motor.fKP = cmd.getKP();
+        motor.fKD = cmd.getKD();
+        motor.fCommandCount++;
+    }
+
+    // Advance the motor model up to now in small fixed steps
+    void step(Motor& motor, uint64_t now) {
+        constexpr double kStep = 0.0001;
+        if (motor.fLastUpdate == 0) {
+            motor.fLastUpdate = now;
+            return;
+        }
+        double elapsed = std::min(double(now - motor.fLastUpdate) / 1e9, 0.1);
+        motor.fLastUpdate = now;
+        while (elapsed > 0) {
+            double dt = std::min(elapsed, kStep);
+            double tau;
+            if (motor.fMode == PDGoMotorCmd::FOC) {
+                tau = motor.fTargetTau +
+                      motor.fKP * (motor.fTargetQ - motor.fQ) +
+                      motor.fKD * (motor.fTargetDQ - motor.fDQ);
+            } else {
+                // Brake shorts the windings which only resists motion
+                tau = -kBrakeDamping * motor.fDQ;
+            }
+            motor.fTau = tau;
+            motor.fDQ += (tau - fFriction * motor.fDQ) / fInertia * dt;
+            motor.fQ += motor.fDQ * dt;
+            motor.fTemp += (25 + std::abs(tau) * 2 - motor.fTemp) * dt * 0.01;
+            elapsed -= dt;
+        }
+    }
+
+    void reply(uint8_t id, const Motor& motor) {
+        PDGoMotorFeedback feedback;
+        memset(feedback.fBytes, '\0', sizeof(feedback.fBytes));
+        feedback.setModeID(motor.fMode, id);
+        feedback.setTau(motor.fTau);
+        feedback.setDQ(motor.fDQ);
+        feedback.setQ(motor.fQ);
+        feedback.setTemperature(int(motor.fTemp));
+        feedback.setError(PDGoMotorFeedback::kNone);
+        feedback.setFootForce(0);
+        feedback.encode(fMotorCRC);
+        if (::write(fd, feedback.fBytes, sizeof(feedback.fBytes)) == sizeof(feedback.fBytes)) {
+            fReplyCount++;
+        }
+    }
+
+    static constexpr double kBrakeDamping = 0.5;
+    // Mode of PDGoMotorCmd::setBootMode()
+    static constexpr uint8_t kBootMode = 7;
+
+    int             fd = -1;
+    int             fSlaveFD = -1;
+    bool            fOwnsFD = true;
+    char            fPort[64] = {};
+    char            fLink[256] = {};
+    PDGoMotorCRC    fMotorCRC;
+    Motor           fMotor[kMaxMotors];
+    uint64_t        fLatency = 50000;
+    uint64_t        fJitter = 0;
+    bool            fStrictFraming = false;
+    double          fInertia = 0.001;
+    double          fFriction = 0.01;
+    std::mt19937_64 fRandom;
+    uint8_t         fRx[PDGoMotorCmd::kFrameSize * 32];
+    size_t          fRxLen = 0;
+    unsigned        fCommandCount = 0;
+    unsigned        fReplyCount = 0;
+    unsigned        fCRCErrors = 0;
+    unsigned        fDroppedBytes = 0;
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "PDUtils.h"
+#include "PDGoMotorCmd.h"
+
+// Reassembles PDGoMotorFeedback frames from a byte stream. Reads are
+// accumulated in a ring buffer so a single read can deliver several frames
+// or a partial one. Frames are located by their 0xFD 0xEE header and
+// verified by CRC. On a CRC failure only the first header byte is dropped
+// so the decoder resynchronizes on a header inside the damaged frame.
+class PDGoMotorStream {
+public:
+    // Must be a power of two
+    static constexpr size_t kBufferSize = 512;
+    // Most frames nextBatch() will verify at once
+    static constexpr unsigned kMaxBatch = 16;
+
+    void clear() {
+        fHead = fTail = 0;
+    }
+
+    inline size_t available() const {
+        return fHead - fTail;
+    }
+
+    // Read whatever the fd has buffered using one syscall. Returns the byte
+    // count or the ::read result if nothing was read.
+    ssize_t fill(int fd) {
+        size_t space = kBufferSize - available();
+        if (space == 0) {
+            // Full of garbage drop the oldest half
+            fTail += kBufferSize / 2;
+            fDroppedBytes += kBufferSize / 2;
+            space = kBufferSize / 2;
+        }
+        size_t head = fHead & kMask;
+        struct iovec iov[2];
+        int iovcnt = 1;
+        iov[0].iov_base = &fBuffer[head];
+        iov[0].iov_len = std::min(space, kBufferSize - head);
+        if (iov[0].iov_len < space) {
+            iov[1].iov_base = &fBuffer[0];
+            iov[1].iov_len = space - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        ssize_t len = ::readv(fd, iov, iovcnt);
+        if (len > 0) {
+            fHead += len;
+        }
+        return len;
+    }
+
+    // Append bytes that were read elsewhere
+    void push(const uint8_t* bytes, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            if (available() == kBufferSize) {
+                fTail++;
+                fDroppedBytes++;
+            }
+            fBuffer[fHead++ & kMask] = bytes[i];
+        }
+    }
+
+    // Extract the next frame with a valid CRC. Returns false once less than
+    // a full frame is buffered.
+    bool next(PDGoMotorFeedback& feedback, const PDGoMotorCRC& motorCRC) {
+        constexpr size_t kFrameSize = PDGoMotorFeedback::kFrameSize;
+        while (available() >= kFrameSize) {
+            if (at(0) != 0xFD || at(1) != 0xEE) {
+                fTail++;
+                fDroppedBytes++;
+                continue;
+            }
+            for (size_t i = 0; i < kFrameSize; i++) {
+                feedback.fBytes[i] = at(i);
+            }
+            if (!feedback.hasValidCRC(motorCRC)) {
+                fTail++;
+                fDroppedBytes++;
+                fCRCErrors++;
+                if (PDLog::isVerboseMotor()) {
+                    PDTrace::frame(PDTrace::kBadFrame, feedback.fBytes, kFrameSize);
+                }
+                continue;
+            }
+            fTail += kFrameSize;
+            if (PDLog::isVerboseMotor()) {
+                PDTrace::frame(PDTrace::kRxFrame, feedback.fBytes, kFrameSize);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Extract up to maxCount frames that are buffered back to back and check
+    // their CRCs in one pass. Anything out of place is left to next() to
+    // resynchronize. Returns the number of frames extracted.
+    unsigned nextBatch(PDGoMotorFeedback* feedback, unsigned maxCount, const PDGoMotorCRC& motorCRC) {
+        constexpr size_t kFrameSize = PDGoMotorFeedback::kFrameSize;
+        uint16_t crc[kMaxBatch];
+        unsigned count = 0;
+        maxCount = std::min<unsigned>(maxCount, kMaxBatch);
+        while (count < maxCount && available() >= (count + 1) * kFrameSize &&
+               at(count * kFrameSize) == 0xFD && at(count * kFrameSize + 1) == 0xEE)
+        {
+            for (size_t i = 0; i < kFrameSize; i++) {
+                feedback[count].fBytes[i] = at(count * kFrameSize + i);
+            }
+            count++;
+        }
+        motorCRC.crc(&feedback[0].cmd, sizeof(PDGoMotorFeedback), count, sizeof(feedback[0].cmd), crc);
+        unsigned valid = 0;
+        while (valid < count &&
+               feedback[valid].fCRC[0] == uint8_t(crc[valid] & 0xFF) &&
+               feedback[valid].fCRC[1] == uint8_t(crc[valid] >> 8))
+        {
+            if (PDLog::isVerboseMotor()) {
+                PDTrace::frame(PDTrace::kRxFrame, feedback[valid].fBytes, kFrameSize);
+            }
+            valid++;
+        }
+        fTail += valid * kFrameSize;
+        if (valid == 0 && maxCount > 0) {
+            return next(feedback[0], motorCRC) ? 1 : 0;
+        }
+        return valid;
+    }
+
+    unsigned getCRCErrors() const {
+        return fCRCErrors;
+    }
+
+    unsigned getDroppedBytes() const {
+        return fDroppedBytes;
+    }
+
+private:
+    static constexpr size_t kMask = kBufferSize - 1;
+    static_assert((kBufferSize & kMask) == 0, "kBufferSize must be a power of two");
+
+    inline uint8_t at(size_t offset) const {
+        return fBuffer[(fTail + offset) & kMask];
+    }
+
+    uint8_t     fBuffer[kBufferSize];
+    size_t      fHead = 0;
+    size_t      fTail = 0;
+    unsigned    fCRCErrors = 0;
+    unsigned    fDroppedBytes = 0;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+
+// Counter with one writer thread. Readers on other threads see a recent
+// value without the writer paying for an atomic read-modify-write.
+class PDCounter {
+public:
+    inline void add(uint64_t n = 1) {
+        fValue.store(fValue.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    inline void set(uint64_t value) {
+        fValue.store(value, std::memory_order_relaxed);
+    }
+
+    inline uint64_t get() const {
+        return fValue.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> fValue { 0 };
+};
+
+// Log-linear histogram in the style of HdrHistogram. Every power of two is
+// split into kSubBuckets linear buckets so any recorded value is known to
+// within 1/kSubBuckets (12.5%) from a fixed table of kNumBuckets 32 bit
+// counts. Like PDCounter it expects a single writer and may be read from any
+// thread.
+class PDHistogram {
+public:
+    static constexpr unsigned kSubBits = 3;
+    static constexpr unsigned kSubBuckets = 1 << kSubBits;
+    // Values at or above 2^kMaxBits land in the last bucket
+    static constexpr unsigned kMaxBits = 40;
+    static constexpr unsigned kNumBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+    static inline unsigned bucketOf(uint64_t value) {
+        if (value < kSubBuckets) {
+            return value;
+        }
+        unsigned msb = 63 - __builtin_clzll(value);
+        if (msb >= kMaxBits) {
+            return kNumBuckets - 1;
+        }
+        unsigned shift = msb - kSubBits;
+        return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+    }
+
+    // Smallest value that lands in bucket
+    static inline uint64_t lowestOf(unsigned bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        unsigned shift = bucket / kSubBuckets - 1;
+        return uint64_t(kSubBuckets + bucket % kSubBuckets) << shift;
+    }
+
+    // Largest value that lands in bucket
+    static inline uint64_t highestOf(unsigned bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        unsigned shift = bucket / kSubBuckets - 1;
+        return lowestOf(bucket) + (uint64_t(1) << shift) - 1;
+    }
+
+    inline void record(uint64_t value) {
+        std::atomic<uint32_t>& bucket = fBuckets[bucketOf(value)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        fCount.store(fCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        fSum.store(fSum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if (value > fMax.load(std::memory_order_relaxed)) {
+            fMax.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t getCount() const {
+        return fCount.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getMax() const {
+        return fMax.load(std::memory_order_relaxed);
+    }
+
+    double getMean() const {
+        uint64_t count = getCount();
+        return (count != 0) ? double(fSum.load(std::memory_order_relaxed)) / count : 0;
+    }
+
+    // Value below which fraction (0-1) of the recorded values fall, reported
+    // as the top of its bucket
+    uint64_t getPercentile(double fraction) const {
+        uint64_t total = 0;
+        for (unsigned i = 0; i < kNumBuckets; i++) {
+            total += fBuckets[i].load(std::memory_order_relaxed);
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = uint64_t(fraction * total + 0.5);
+        target = (target == 0) ? 1 : target;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < kNumBuckets; i++) {
+            seen += fBuckets[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(highestOf(i), getMax());
+            }
+        }
+        return getMax();
+    }
+
+    // One line summary. Values are divided by scale, e.g. 1000 for ns to us.
+    void print(FILE* out, const char* label, double scale = 1000, const char* unit = "us") const {
+        uint64_t count = getCount();
+        if (count == 0) {
+            fprintf(out, "%-24s %10s\n", label, "-");
+            return;
+        }
+        fprintf(out, "%-24s %10llu  mean %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f %s\n",
+            label, (unsigned long long)count, getMean() / scale,
+            getPercentile(0.5) / scale, getPercentile(0.9) / scale,
+            getPercentile(0.99) / scale, getPercentile(0.999) / scale,
+            getMax() / scale, unit);
+    }
+
+private:
+    std::atomic<uint32_t>   fBuckets[kNumBuckets] = {};
+    std::atomic<uint64_t>   fCount { 0 };
+    std::atomic<uint64_t>   fSum { 0 };
+    std::atomic<uint64_t>   fMax { 0 };
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "PDLog.h"
+#include "PDTrace.h"
+#include "PDGoMotorBus.h"
+#include "PDGoActuator.h"
+#include "PDBusScheduler.h"
+
+// Every actuator on one bus. Commands and feedback live in flat arrays so a
+// cycle is a single batched transfer no matter which limb a joint belongs to.
+class PDJointGroup {
+public:
+    PDJointGroup(PDGoMotorBus* bus = nullptr) :
+        fBus(bus)
+    {
+    }
+
+    PDJointGroup(const PDJointGroup&) = delete;
+    PDJointGroup& operator=(const PDJointGroup&) = delete;
+
+    void setBus(PDGoMotorBus* bus) {
+        fBus = bus;
+    }
+
+    PDGoMotorBus* getBus() const {
+        return fBus;
+    }
+
+    // prefix names the limb in traces and messages, e.g. "left"
+    unsigned add(PDGoActuator& actuator, const char* prefix = nullptr) {
+        fJoints.push_back({ &actuator, prefix });
+        fCommands.emplace_back();
+        fFeedback.emplace_back();
+        fFrames.push_back(nullptr);
+        fBaked.push_back(-1);
+        fScheduler.addSlot(actuator.getRate());
+        return fJoints.size() - 1;
+    }
+
+    unsigned numberOfActuators() const {
+        return fJoints.size();
+    }
+
+    PDGoActuator& getActuator(unsigned index) const {
+        return *fJoints[index].fActuator;
+    }
+
+    const char* getPrefix(unsigned index) const {
+        return fJoints[index].fPrefix;
+    }
+
+    // Plan which joints are commanded in each cycle from their rates
+    void setControlRate(unsigned rate) {
+        for (unsigned i = 0; i < fJoints.size(); i++) {
+            fScheduler.setRate(i, fJoints[i].fActuator->getRate());
+        }
+        fScheduler.setControlRate(rate);
+    }
+
+    const PDBusScheduler& getScheduler() const {
+        return fScheduler;
+    }
+
+    // Send joint's commands from a slice of frames rendered ahead of time
+    // (see PDBakedClip) instead of asking its actuator, offset bytes into
+    // the slice. -1 returns the joint to its actuator.
+    void setBaked(unsigned joint, int offset) {
+        fBaked[joint] = offset;
+    }
+
+    bool isBaked(unsigned joint) const {
+        return (fBaked[joint] != -1);
+    }
+
+    // Frames for the baked joints of the next cycle, nullptr while they are
+    // left alone. A baked joint whose frame has no header is not sent.
+    void setSlice(const uint8_t* slice) {
+        fSlice = slice;
+    }
+
+    const uint8_t* getSlice() const {
+        return fSlice;
+    }
+
+    // Fill in this cycle's frame of every joint that is due, or of all of
+    // them. update() calls this before it sends them.
+    void prepare(uint64_t now, bool allJoints = false) {
+        unsigned numActuators = fJoints.size();
+        const PDGoMotorCRC& crc = fBus->getCRC();
+        fScheduler.next();
+        for (unsigned i = 0; i < numActuators; i++) {
+            if (fSlice != nullptr && fBaked[i] != -1) {
+                const uint8_t* frame = fSlice + fBaked[i];
+                fFrames[i] = PDGoMotorCmd::isFrame(frame) ? frame : nullptr;
+            } else if (allJoints || fScheduler.isDue(i)) {
+                fJoints[i].fActuator->update(fCommands[i], fFeedback[i], now);
+                fFrames[i] = fCommands[i].isValid() ? fCommands[i].getFrame(crc) : nullptr;
+            } else {
+                // Not this joint's turn, it keeps its last command
+                fFrames[i] = nullptr;
+            }
+        }
+    }
+
+    // Command the joints that are due this cycle, or all of them
+    bool update(uint64_t now, bool allJoints = false) {
+        if (fBus == nullptr) {
+            fprintf(stderr, "UNRESOLVED JOINT BUS\n");
+            return false;
+        }
+        unsigned numActuators = fJoints.size();
+        prepare(now, allJoints);
+        unsigned numSent = fBus->sendRecv(numActuators, fFrames.data(), fFeedback.data());
+        bool success = (numActuators == numSent);
+        for (unsigned i = 0; i < numActuators; i++) {
+            if (fFeedback[i].isValid()) {
+                fJoints[i].fActuator->update(fFeedback[i], now);
+            } else if (fFrames[i] != nullptr) {
+                fJoints[i].fActuator->noResponse();
+            }
+        }
+        if (PDLog::isVerbosePosition()) {
+            trace();
+        }
+        return success;
+    }
+
+    void trace() {
+        for (auto& joint : fJoints) {
+            auto pos = joint.fActuator->getPosition();
+            if (!std::isnan(pos)) {
+                PDTrace::value(PDTrace::kPosition, joint.fPrefix, joint.fActuator->getName(), pos);
+            }
+        }
+    }
+
+private:
+    struct Joint {
+        PDGoActuator*   fActuator;
+        const char*     fPrefix;
+    };
+
+    PDGoMotorBus*                   fBus = nullptr;
+    std::vector<Joint>              fJoints;
+    std::vector<PDGoMotorCmd>       fCommands;
+    std::vector<PDGoMotorFeedback>  fFeedback;
+    std::vector<const uint8_t*>     fFrames;    // Sent this cycle, nullptr if not
+    std::vector<int>                fBaked;     // Offset into fSlice, -1 if not baked
+    const uint8_t*                  fSlice = nullptr;
+    PDBusScheduler                  fScheduler;
+};
+
+// Groups every configured actuator by the bus it is on
+class PDJointRegistry {
+public:
+    // Returns the group the actuator was added to, or nullptr without a bus
+    PDJointGroup* add(PDGoActuator& actuator, PDGoMotorBus* bus, const char* prefix = nullptr) {
+        if (bus == nullptr) {
+            return nullptr;
+        }
+        PDJointGroup* group = nullptr;
+        for (auto& it : fGroups) {
+            if (it->getBus() == bus) {
+                group = it.get();
+                break;
+            }
+        }
+        if (group == nullptr) {
+            fGroups.emplace_back(new PDJointGroup(bus));
+            group = fGroups.back().get();
+        }
+        group->add(actuator, prefix);
+        return group;
+    }
+
+    unsigned numberOfGroups() const {
+        return fGroups.size();
+    }
+
+    PDJointGroup& getGroup(unsigned index) const {
+        return *fGroups[index];
+    }
+
+    void setControlRate(unsigned rate) {
+        for (auto& group : fGroups) {
+            group->setControlRate(rate);
+        }
+    }
+
+    // Return every baked joint to its actuator
+    void clearSlices() {
+        for (auto& group : fGroups) {
+            group->setSlice(nullptr);
+        }
+    }
+
+    // Counts every relax of the robot's joints. Players note the count when
+    // they start and end once it changes, so they never re-arm relaxed joints.
+    void relaxed() {
+        fRelaxCount++;
+    }
+
+    uint64_t getRelaxCount() const {
+        return fRelaxCount;
+    }
+
+private:
+    std::vector<std::unique_ptr<PDJointGroup>> fGroups;
+    uint64_t fRelaxCount = 0;
+};
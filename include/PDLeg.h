@@ -3,6 +3,7 @@
 #include "PDDefaults.h"
 #include "PDGoMotorBus.h"
 #include "PDGoActuator.h"
+#include "PDJointRegistry.h"
 
 struct PDLeg {
     struct Pose {
@@ -55,30 +56,36 @@ struct PDLeg {
         fHipYaw.setKP(leg.hip.yaw.kp);
         fHipYaw.setKD(leg.hip.yaw.kd);
         fHipYaw.setTau(leg.hip.yaw.tau);
+        fHipYaw.setRate(leg.hip.yaw.rate);
 
         fHipRoll.setMotorID(leg.hip.roll.id, "hip.roll");
         fHipRoll.setRange(leg.hip.roll.range.value[0], leg.hip.roll.range.value[1]);
         fHipRoll.setKP(leg.hip.roll.kp);
         fHipRoll.setKD(leg.hip.roll.kd);
         fHipRoll.setTau(leg.hip.roll.tau);
+        fHipRoll.setRate(leg.hip.roll.rate);
 
         fHipPitch.setMotorID(leg.hip.pitch.id, "hip.pitch");
         fHipPitch.setRange(leg.hip.pitch.range.value[0], leg.hip.pitch.range.value[1]);
         fHipPitch.setKP(leg.hip.pitch.kp);
         fHipPitch.setKD(leg.hip.pitch.kd);
         fHipPitch.setTau(leg.hip.pitch.tau);
+        fHipPitch.setRate(leg.hip.pitch.rate);
 
         fKneePitch.setMotorID(leg.knee.pitch.id, "knee.pitch");
         fKneePitch.setRange(leg.knee.pitch.range.value[0], leg.knee.pitch.range.value[1]);
         fKneePitch.setKP(leg.knee.pitch.kp);
         fKneePitch.setKD(leg.knee.pitch.kd);
         fKneePitch.setTau(leg.knee.pitch.tau);
+        fKneePitch.setRate(leg.knee.pitch.rate);
 
         fAnklePitch.setMotorID(leg.ankle.pitch.id, "ankle.pitch");
         fAnklePitch.setRange(leg.ankle.pitch.range.value[0], leg.ankle.pitch.range.value[1]);
         fAnklePitch.setKP(leg.ankle.pitch.kp);
         fAnklePitch.setKD(leg.ankle.pitch.kd);
         fAnklePitch.setTau(leg.ankle.pitch.tau);
+        fAnklePitch.setRate(leg.ankle.pitch.rate);
+        addJoints();
     }
 
     PDLeg(const char* name, const char* bus) :
@@ -94,6 +101,7 @@ struct PDLeg {
         fHipPitch.setMotorID(MOTOR_ID_HIP_PITCH, "hip.pitch");
         fKneePitch.setMotorID(MOTOR_ID_KNEE_PITCH, "knee.pitch");
         fAnklePitch.setMotorID(MOTOR_ID_ANKLE_PITCH, "ankle.pitch");
+        addJoints();
     }
 
     constexpr unsigned numberOfActuators() const {
@@ -106,13 +114,22 @@ struct PDLeg {
 
     void setBus(PDGoMotorBus* bus) {
         fBus = bus;
+        fJoints.setBus(bus);
+    }
+
+    // Plan which joints are commanded in each cycle from their rates
+    void setControlRate(unsigned rate) {
+        fJoints.setControlRate(rate);
+    }
+
+    const PDBusScheduler& getScheduler() const {
+        return fJoints.getScheduler();
     }
 
     char                fLeg[16];
     PDGoMotorBus*       fBus = nullptr;
     PDGoActuator        fActuator[5];
-    PDGoMotorCmd        fMotorCommand[sizeof(fActuator)/sizeof(fActuator[0])];
-    PDGoMotorFeedback   fMotorFeedback[sizeof(fActuator)/sizeof(fActuator[0])];
+    PDJointGroup        fJoints;    // Used when the leg runs on its own
 
     PDGoActuator&       fHipYaw;
     PDGoActuator&       fHipRoll;
@@ -123,23 +140,6 @@ struct PDLeg {
 
     static constexpr size_t kNumActuators = sizeof(fActuator)/sizeof(fActuator[0]);
 
-    void report() {
-        bool needBrackets = true;
-        for (int i = 0; i < kNumActuators; i++) {
-            auto pos = fActuator[i].getPosition();
-            if (!std::isnan(pos)) {
-                if (needBrackets)
-                    printf("[");
-                printf("%s%s.%s:%f",
-                    (needBrackets ? "" : " "),
-                    fLeg, fActuator[i].getName(), pos);
-                needBrackets = false;
-            }
-        }
-        if (!needBrackets)
-            printf("]\n");
-    }
-
     void getPose(Pose& pose) {
         for (unsigned i = 0; i < numberOfActuators(); i++) {
             pose.fPositions[i] = fActuator[i].getPosition();
@@ -154,35 +154,13 @@ struct PDLeg {
         }
     }
 
-    bool update() {
+    // Command the joints that are due this cycle, or all of them
+    bool update(uint64_t now, bool allJoints = false) {
         if (fBus == nullptr) {
             fprintf(stderr, "[%s] UNRESOLVED LEG BUS\n", fLeg);
             return false;
         }
-        unsigned numActuators = numberOfActuators();
-        for (unsigned i = 0; i < numActuators; i++) {
-            fActuator[i].update(fMotorCommand[i], fMotorFeedback[i]);
-        }
-        uint64_t stopTime = currentTimeMillis();
-        unsigned numSent = fBus->sendRecv(numActuators, fMotorCommand, fMotorFeedback);
-        bool success = (numActuators == numSent);
-        for (unsigned fi = 0; fi < numSent; fi++) {
-            PDGoMotorFeedback* feedback = &fMotorFeedback[fi];
-            if (feedback->isValid()) {
-                for (unsigned mi = 0; mi < numActuators; mi++) {
-                    if (feedback->getMotorID() == fActuator[mi].getID()) {
-                        fActuator[mi].update(*feedback);
-                        break;
-                    }
-                }
-            } else {
-                success = false;
-            }
-        }
-        if (PDLog::isVerbosePosition()) {
-            report();
-        }
-        return success;
+        return fJoints.update(now, allJoints);
     }
 
     void relax() {
@@ -201,6 +179,12 @@ struct PDLeg {
         fAnklePitch.stiff();
     }
 
+    void addJoints() {
+        for (unsigned i = 0; i < numberOfActuators(); i++) {
+            fJoints.add(fActuator[i], fLeg);
+        }
+    }
+
     void setKnee(double pos, uint32_t moveTime = 2000) {
         fKneePitch.moveToDegrees(0, moveTime, pos);
         // fKneePitch.stiff();
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Wait-free single producer / single consumer latest-value mailbox. The
+// producer fills getWriteBuffer() and calls publish(). The consumer calls
+// read() to get the most recently published value. Neither side ever
+// blocks or waits for the other; values published faster than they are
+// read are simply replaced.
+template <typename T>
+class PDTripleBuffer {
+public:
+    PDTripleBuffer() {}
+
+    PDTripleBuffer(const PDTripleBuffer&) = delete;
+    PDTripleBuffer& operator=(const PDTripleBuffer&) = delete;
+
+    // Producer side
+    T& getWriteBuffer() {
+        return fBuffer[fBack];
+    }
+
+    void publish() {
+        fBack = fShared.exchange(fBack | kDirty, std::memory_order_acq_rel) & kIndexMask;
+    }
+
+    void publish(const T& value) {
+        getWriteBuffer() = value;
+        publish();
+    }
+
+    // Consumer side. Returns true if a new value was published since the last read.
+    bool update() {
+        if ((fShared.load(std::memory_order_relaxed) & kDirty) == 0) {
+            return false;
+        }
+        fFront = fShared.exchange(fFront, std::memory_order_acq_rel) & kIndexMask;
+        return true;
+    }
+
+    const T& read() {
+        update();
+        return fBuffer[fFront];
+    }
+
+private:
+    static constexpr uint8_t kIndexMask = 0x3;
+    static constexpr uint8_t kDirty = 0x4;
+
+    T                       fBuffer[3] = {};
+    uint8_t                 fBack = 0;
+    uint8_t                 fFront = 1;
+    std::atomic<uint8_t>    fShared { 2 };
+};
+
+// Wait-free single producer / single consumer bounded queue.
+// Size must be a power of two.
+template <typename T, size_t Size>
+class PDCommandQueue {
+public:
+    PDCommandQueue() {}
+
+    PDCommandQueue(const PDCommandQueue&) = delete;
+    PDCommandQueue& operator=(const PDCommandQueue&) = delete;
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T& value) {
+        size_t head = fHead.load(std::memory_order_relaxed);
+        if (head - fTail.load(std::memory_order_acquire) == Size) {
+            return false;
+        }
+        fBuffer[head & kMask] = value;
+        fHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T& value) {
+        size_t tail = fTail.load(std::memory_order_relaxed);
+        if (tail == fHead.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = fBuffer[tail & kMask];
+        fTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool isEmpty() const {
+        return fTail.load(std::memory_order_acquire) == fHead.load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr size_t kMask = Size - 1;
+    static_assert((Size & kMask) == 0, "Size must be a power of two");
+
+    T                   fBuffer[Size];
+    // Keep producer and consumer indexes on separate cache lines
+    alignas(64) std::atomic<size_t> fHead { 0 };
+    alignas(64) std::atomic<size_t> fTail { 0 };
+};
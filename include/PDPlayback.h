@@ -1,24 +1,102 @@
 #pragma once
 
-#include "PDRecording.h"
+#include "PDClip.h"
+#include "PDJointRegistry.h"
 
+// Plays a clip on the joints of the robot. The clip is memory mapped so only the samples
+// around the playback position are resident, whatever the clip length.
+//
+// Every control cycle the clip time is computed from the cycle time against
+// a fixed start, so late cycles never push the rest of the clip back, and
+// each joint is interpolated between the two samples around that time.
+// Samples are decoded in order as playback reaches them, so delta encoded
+// clips cost one sample decode per sample played. Playback ends when the
+// robot relaxes, e.g. after a watchdog trip.
 class PDPlayback {
 public:
+    // Samples to ask the kernel to read ahead at a time
+    static constexpr uint64_t kPrefetchSamples = 4096;
+    // Time to move from the current pose to the first sample (ms)
+    static constexpr uint32_t kLeadIn = 2000;
+    // Samples further apart than this were a hold followed by a movement.
+    // The earlier pose is held and only the last kMaxBlend ms are blended.
+    // Keyframes of a reduced clip are blended all the way.
+    static constexpr double kMaxBlend = 100;
+    static constexpr double kMinSpeed = 0.5;
+    static constexpr double kMaxSpeed = 2.0;
+
     PDPlayback() {}
 
-    void loadSamples(const PDRecording& recording) {
-        fLeg = recording.getLeg();
-        fSamples = recording.getSamples();
+    // Match the clip joints to the robot's joints by name. Joints that are
+    // not in the clip are left alone. Call while not playing.
+    bool load(const PDClip& clip, const PDJointRegistry& joints) {
+        fClip = nullptr;
+        fNumActuators = 0;
+        if (!clip.isOpen()) {
+            return false;
+        }
+        fJoints = &joints;
+        for (unsigned g = 0; g < joints.numberOfGroups(); g++) {
+            PDJointGroup& group = joints.getGroup(g);
+            for (unsigned i = 0; i < group.numberOfActuators() && fNumActuators < PDClip::kMaxJoints; i++) {
+                char name[sizeof(PDClip::Joint::fName)];
+                snprintf(name, sizeof(name), "%s%s%s",
+                    group.getPrefix(i) ? group.getPrefix(i) : "",
+                    group.getPrefix(i) ? "." : "", group.getActuator(i).getName());
+                int joint = clip.findJoint(name);
+                if (joint != -1) {
+                    fActuators[fNumActuators] = &group.getActuator(i);
+                    fJoint[fNumActuators++] = joint;
+                }
+            }
+        }
+        if (fNumActuators == 0) {
+            fprintf(stderr, "Clip has none of the robot's joints\n");
+            return false;
+        }
+        fClip = &clip;
+        return true;
+    }
+
+    // Playback rate, 1 for recorded speed. May be changed while playing.
+    void setSpeed(double speed) {
+        speed = std::min(std::max(speed, kMinSpeed), kMaxSpeed);
+        uint64_t now = PDCycleClock::now();
+        if (fPlaying && now > fAnchorTime) {
+            // Continue from the current clip time at the new rate
+            fAnchorClipTime = getClipTime(now);
+            fAnchorTime = now;
+        }
+        fSpeed = speed;
+    }
+
+    double getSpeed() const {
+        return fSpeed;
+    }
+
+    // Command each pose this many ms of clip time early to make up for the
+    // time the motors take to follow
+    void setLookahead(uint32_t millis) {
+        fLookahead = millis;
+    }
+
+    uint32_t getLookahead() const {
+        return fLookahead;
     }
 
     bool start() {
         fIndex = 0;
-        fNextTime = 0;
         fPlaying = false;
-        if (fLeg != nullptr && fSamples.size() != 0) {
-            uint64_t now = currentTimeMillis();
-            fLeg->setPose(fSamples[0].fPose, 2000);
-            fNextTime = now + 2000;
+        if (fClip != nullptr && fClip->numberOfSamples() != 0) {
+            uint64_t now = PDCycleClock::now();
+            moveTo(0);
+            getPositions();
+            setPositions(kLeadIn);
+            fAnchorTime = now + PDCycleClock::fromMillis(kLeadIn);
+            fAnchorClipTime = fFromTime;
+            fPrefetched = 0;
+            prefetch();
+            fRelaxCount = fJoints->getRelaxCount();
             fPlaying = true;
             return true;
         }
@@ -27,38 +105,60 @@ public:
 
     bool stop() {
         if (fPlaying) {
-            fNextTime = 0;
             fIndex = 0;
             fPlaying = false;
-            if (fLeg != nullptr)
-                fLeg->relax();
+            relax();
             return true;
         }
         return false;
     }
 
     bool update() {
-        if (!fPlaying || fLeg == nullptr)
+        if (!fPlaying)
             return false;
-        uint64_t now = currentTimeMillis();
-        if (fNextTime < now) {
-            if (fIndex < fSamples.size()) {
-                PDLeg::Pose pose = fSamples[fIndex].fPose;
-                if (PDLog::isVerbose()) {
-                    printf("play pose: %f, %f, %f, %f, %f\n", pose.fPositions[0], pose.fPositions[1], pose.fPositions[2], pose.fPositions[3], pose.fPositions[4]);
-                }
-                fLeg->setPose(pose, 0);
-                if (fIndex + 1 < fSamples.size()) {
-                    fNextTime = now + fSamples[fIndex + 1].fElapsed;
+        if (fJoints->getRelaxCount() != fRelaxCount) {
+            // Leave the joints relaxed rather than carry on with the clip
+            fIndex = 0;
+            fPlaying = false;
+            return false;
+        }
+        uint64_t now = PDCycleClock::now();
+        if (now < fAnchorTime) {
+            // Still moving to the first pose
+            return true;
+        }
+        double time = getClipTime(now);
+        uint64_t last = fClip->numberOfSamples() - 1;
+        if (time >= fClip->getDuration()) {
+            moveTo(last);
+            getPositions();
+            setPositions(0);
+            fIndex = 0;
+            fPlaying = false;
+            relax();
+            return true;
+        }
+        double target = std::min(time + fLookahead, double(fClip->getDuration()));
+        if (fIndex < last && fNext.getTime() <= target) {
+            // Decoding forward is cheaper than a seek for up to a keyframe
+            // interval of samples, a raw clip seeks after the first one
+            uint64_t steps = 0;
+            while (fIndex < last && fNext.getTime() <= target) {
+                if (++steps > fClip->getKeyInterval()) {
+                    moveTo(std::max(fIndex, fClip->seek(uint32_t(target))));
+                    break;
                 }
-                fIndex++;
-            } else {
-                fNextTime = 0;
-                fIndex = 0;
-                fPlaying = false;
-                fLeg->relax();
+                advance();
+            }
+            prefetch();
+        }
+        interpolate(target);
+        if (PDLog::isVerbosePosition()) {
+            for (unsigned i = 0; i < fNumActuators; i++) {
+                PDTrace::value(PDTrace::kPosition, nullptr, fActuators[i]->getName(), fPositions[i]);
             }
         }
+        setPositions(0);
         return true;
     }
 
@@ -66,10 +166,101 @@ public:
         return fPlaying;
     }
 
+    // How far time is from a sample at t0 to the next one at t1, 0-1
+    static inline double blend(const PDClip& clip, double t0, double t1, double time) {
+        if ((clip.getFlags() & PDClip::kKeyframes) == 0) {
+            t0 = std::max(t0, t1 - kMaxBlend);
+        }
+        return (t1 > t0) ? std::min(std::max((time - t0) / (t1 - t0), 0.0), 1.0) : 1.0;
+    }
+
+    // Position fraction of the way from p0 to p1, either one if the other
+    // was not recorded
+    static inline double mix(double p0, double p1, double fraction) {
+        if (std::isnan(p0) || std::isnan(p1)) {
+            return std::isnan(p0) ? p1 : p0;
+        }
+        return p0 + (p1 - p0) * fraction;
+    }
+
 private:
-    PDLeg* fLeg;
-    std::vector<PDRecording::Sample> fSamples;
-    uint64_t fNextTime = 0;
-    unsigned fIndex = 0;
+    // Clip time in ms at cycle time now
+    inline double getClipTime(uint64_t now) const {
+        return fAnchorClipTime + double(now - fAnchorTime) / PDCycleClock::fromMillis(1) * fSpeed;
+    }
+
+    // Make sample the current one, with fNext on the sample after it
+    void moveTo(uint64_t sample) {
+        fNext.seek(*fClip, sample);
+        fIndex = sample;
+        fFromTime = fNext.getTime();
+        memcpy(fFrom, fNext.getValues(), sizeof(fFrom[0]) * fClip->numberOfJoints());
+        fNext.next();
+    }
+
+    inline void advance() {
+        fIndex++;
+        fFromTime = fNext.getTime();
+        memcpy(fFrom, fNext.getValues(), sizeof(fFrom[0]) * fClip->numberOfJoints());
+        fNext.next();
+    }
+
+    // Positions of the current sample
+    void getPositions() {
+        for (unsigned i = 0; i < fNumActuators; i++) {
+            fPositions[i] = PDClip::dequantize(fFrom[fJoint[i]]);
+        }
+    }
+
+    void setPositions(uint32_t moveTime) {
+        for (unsigned i = 0; i < fNumActuators; i++) {
+            if (!std::isnan(fPositions[i])) {
+                fActuators[i]->moveToPosition(0, moveTime, fPositions[i]);
+            }
+        }
+    }
+
+    void relax() {
+        for (unsigned i = 0; i < fNumActuators; i++) {
+            fActuators[i]->relax();
+        }
+    }
+
+    // Positions at time, between the current sample and the one after it
+    void interpolate(double time) {
+        if (fIndex + 1 >= fClip->numberOfSamples()) {
+            getPositions();
+            return;
+        }
+        double fraction = blend(*fClip, fFromTime, fNext.getTime(), time);
+        for (unsigned i = 0; i < fNumActuators; i++) {
+            fPositions[i] = mix(PDClip::dequantize(fFrom[fJoint[i]]), fNext.getPosition(fJoint[i]), fraction);
+        }
+    }
+
+    // Keep the kernel reading one window ahead of the playback position
+    void prefetch() {
+        if (fIndex + kPrefetchSamples > fPrefetched) {
+            fClip->prefetch(fPrefetched, kPrefetchSamples);
+            fPrefetched += kPrefetchSamples;
+        }
+    }
+
+    const PDClip* fClip = nullptr;
+    const PDJointRegistry* fJoints = nullptr;
+    PDGoActuator* fActuators[PDClip::kMaxJoints];
+    unsigned fJoint[PDClip::kMaxJoints];    // Clip joint of each actuator
+    double fPositions[PDClip::kMaxJoints];
+    PDClip::Cursor fNext;                   // Sample after fIndex
+    int16_t fFrom[PDClip::kMaxJoints];      // Positions of sample fIndex
+    uint32_t fFromTime = 0;
+    unsigned fNumActuators = 0;
+    double fSpeed = 1.0;
+    uint32_t fLookahead = 0;
+    uint64_t fAnchorTime = 0;       // Cycle time at which the clip reaches fAnchorClipTime
+    double fAnchorClipTime = 0;     // ms
+    uint64_t fIndex = 0;
+    uint64_t fPrefetched = 0;
+    uint64_t fRelaxCount = 0;       // Of fJoints when playback started
     bool fPlaying = false;
 };
@@ -1,26 +1,88 @@
 #pragma once
 
 #include "PDLog.h"
-#include <vector>
+#include "PDClip.h"
+#include "PDJointRegistry.h"
 
+// Records every joint of the robot to a clip at a fixed rate, optionally
+// with torque, velocity, temperature and foot force. open() and close() do
+// the file work on the application thread. start(), stop() and update() run
+// on the control thread and only fill a slot in the writer's preallocated
+// ring, so a long capture costs the control loop the same as a short one.
 class PDRecording {
 public:
-    PDRecording(PDLeg& leg) :
-        fLeg(leg)
+    static constexpr unsigned kDefaultRate = 100;
+    static constexpr unsigned kMaxRate = 1000;
+
+    PDRecording(const PDJointRegistry& joints) :
+        fJoints(joints)
     {
     }
 
-    struct Sample {
-        uint32_t    fElapsed;
-        PDLeg::Pose fPose;
-    };
-    typedef std::vector<Sample> SampleRecording;
+    // Samples per second, 1-1000. Call while not recording.
+    void setRate(unsigned rate) {
+        fRate = std::min(std::max(rate, 1u), kMaxRate);
+    }
+
+    unsigned getRate() const {
+        return fRate;
+    }
+
+    // PDClip::Channel bits to record next to the positions
+    void setChannels(uint16_t channels) {
+        fChannels = channels & PDClip::kAllChannels;
+    }
+
+    // PDClip::kDelta stores clips in a fraction of the space. Call while not recording.
+    void setEncoding(PDClip::Encoding encoding) {
+        fWriter.setEncoding(encoding);
+    }
+
+    // Keep only keyframes within tolerance (positions 0-1) of the recorded
+    // motion, 0 for every sample. Call while not recording.
+    void setTolerance(double tolerance) {
+        fWriter.setTolerance(tolerance);
+    }
+
+    bool open(const char* path) {
+        char names[PDClip::kMaxJoints][sizeof(PDClip::Joint::fName)];
+        const char* labels[PDClip::kMaxJoints];
+        uint8_t ids[PDClip::kMaxJoints];
+        fNumActuators = 0;
+        for (unsigned g = 0; g < fJoints.numberOfGroups(); g++) {
+            PDJointGroup& group = fJoints.getGroup(g);
+            for (unsigned i = 0; i < group.numberOfActuators() && fNumActuators < PDClip::kMaxJoints; i++) {
+                PDGoActuator& actuator = group.getActuator(i);
+                snprintf(names[fNumActuators], sizeof(names[fNumActuators]), "%s%s%s",
+                    group.getPrefix(i) ? group.getPrefix(i) : "",
+                    group.getPrefix(i) ? "." : "", actuator.getName());
+                labels[fNumActuators] = names[fNumActuators];
+                ids[fNumActuators] = actuator.getID();
+                fActuators[fNumActuators++] = &actuator;
+            }
+        }
+        return fWriter.open(path, fNumActuators, labels, ids, fChannels);
+    }
+
+    // Finish the clip. Call after stop() has run on the control thread.
+    bool close() {
+        return fWriter.close();
+    }
 
     bool start() {
-        clear();
-        fPoseSample.fElapsed = 0;
-        fLeg.getPose(fPoseSample.fPose);
-        fTimeStamp = currentTimeMillis();
+        if (!fWriter.isOpen() || fWriter.getAdded() != 0) {
+            // Every recording starts a new clip
+            return false;
+        }
+        // Positions are (degrees - origin) * scale. Ranges do not change
+        // while recording so the division is done once here.
+        for (unsigned i = 0; i < fNumActuators; i++) {
+            PDGoActuator& actuator = *fActuators[i];
+            fOrigin[i] = actuator.scaleToPos(0);
+            fScale[i] = actuator.isRangeValid() ? 1.0 / (actuator.scaleToPos(1) - fOrigin[i]) : NAN;
+        }
+        fStartTime = PDCycleClock::now();
+        fNextSample = fStartTime;
         fRecording = true;
         return true;
     }
@@ -33,57 +95,80 @@ public:
         return false;
     }
 
-    void clear() {
-        stop();
-        fSamples.clear();
-        fPoseSample = Sample();
-    }
-
     bool isRecording() const {
         return fRecording;
     }
 
-    PDLeg* getLeg() const {
-        return &fLeg;
-    }
-
-    const SampleRecording& getSamples() const {
-        return fSamples;
+    uint64_t numberOfSamples() const {
+        return fWriter.getAdded();
     }
 
     bool update() {
         if (!fRecording)
             return false;
-        PDLeg::Pose pose;
-        fLeg.getPose(pose);
-        if (pose != fPoseSample.fPose) {
-            uint64_t now = currentTimeMillis();
-            if (fSamples.size() == 0) {
-                fPoseSample.fElapsed = 0;
-            } else {
-                fPoseSample.fElapsed = now - fTimeStamp;
-            }
-            fPoseSample.fPose = pose;
-            fTimeStamp = now;
-            fSamples.push_back(fPoseSample);
-            if (PDLog::isVerbose()) {
-                printf("add pose: %f, %f, %f, %f, %f\n", pose.fPositions[0], pose.fPositions[1], pose.fPositions[2], pose.fPositions[3], pose.fPositions[4]);
-            }
+        uint64_t now = PDCycleClock::now();
+        uint64_t period = 1000000000ull / fRate;
+        // Half a period early still counts so a rate equal to the control
+        // loop rate gets a sample every cycle despite wake-up jitter
+        if (now + period / 2 < fNextSample) {
+            return true;
+        }
+        fNextSample += period;
+        if (fNextSample + period / 2 <= now) {
+            // Fell a whole period behind, skip rather than record a burst
+            fNextSample = now + period;
         }
+        capture(PDCycleClock::toMillis(now - fStartTime));
         return true;
     }
 
-    void dump() {
-        for (auto sample : fSamples) {
-            PDLeg::Pose& pose = sample.fPose;
-            printf("[%u]: %f, %f, %f, %f, %f\n", sample.fElapsed, pose.fPositions[0], pose.fPositions[1], pose.fPositions[2], pose.fPositions[3], pose.fPositions[4]);
+private:
+    void capture(uint32_t time) {
+        int16_t* values = fWriter.beginSample(time);
+        if (values == nullptr) {
+            return;
+        }
+        for (unsigned i = 0; i < fNumActuators; i++) {
+            double position = (fActuators[i]->getDegrees() - fOrigin[i]) * fScale[i];
+            // Same alignment limits as PDGoActuator::toPosition
+            values[i] = (position >= -0.5 && position <= 1.5) ? PDClip::quantize(position) : PDClip::kNoPosition;
         }
+        values += fNumActuators;
+        if (fChannels & PDClip::kTau) {
+            for (unsigned i = 0; i < fNumActuators; i++) {
+                values[i] = PDClip::quantize(fActuators[i]->getFeedback().getTau(), PDClip::kTau);
+            }
+            values += fNumActuators;
+        }
+        if (fChannels & PDClip::kDQ) {
+            for (unsigned i = 0; i < fNumActuators; i++) {
+                values[i] = PDClip::quantize(fActuators[i]->getFeedback().getDQ(), PDClip::kDQ);
+            }
+            values += fNumActuators;
+        }
+        if (fChannels & PDClip::kTemperature) {
+            for (unsigned i = 0; i < fNumActuators; i++) {
+                values[i] = fActuators[i]->getFeedback().getTemperature();
+            }
+            values += fNumActuators;
+        }
+        if (fChannels & PDClip::kFootForce) {
+            for (unsigned i = 0; i < fNumActuators; i++) {
+                values[i] = fActuators[i]->getFeedback().getFootForce();
+            }
+        }
+        fWriter.endSample();
     }
 
-private:
-    PDLeg& fLeg;
+    const PDJointRegistry& fJoints;
+    PDGoActuator* fActuators[PDClip::kMaxJoints];
+    double fOrigin[PDClip::kMaxJoints];
+    double fScale[PDClip::kMaxJoints];
+    unsigned fNumActuators = 0;
+    unsigned fRate = kDefaultRate;
+    uint16_t fChannels = 0;
     bool fRecording = false;
-    uint64_t fTimeStamp = 0;
-    Sample fPoseSample;
-    SampleRecording fSamples;
+    uint64_t fStartTime = 0;
+    uint64_t fNextSample = 0;
+    PDClipWriter fWriter;
 };
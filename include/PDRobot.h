@@ -4,9 +4,103 @@
 #include "PDGoMotorBus.h"
 #include "PDGoActuator.h"
 #include "PDLeg.h"
+#include "PDJointRegistry.h"
+#include "PDBusDiscovery.h"
+#include "PDWatchdog.h"
+#include "PDStateExport.h"
+#include "PDBusExecutor.h"
+#include "PDMailbox.h"
 
 class PDRobot {
 public:
+	// Motion request from the application. Commands are queued with post()
+	// and applied by the control thread at the start of its next cycle.
+	struct Command {
+		enum Type {
+			kMoveToPosition,
+			kMoveToDegrees,
+			kSetPose,
+			kRelax,
+			kStand,
+			kCall,
+			kSync
+		};
+		Type			fType = kSync;
+		PDGoActuator*	fActuator = nullptr;
+		PDLeg*			fLeg = nullptr;
+		uint32_t		fStartDelay = 0;
+		uint32_t		fMoveTime = 0;
+		double			fValue = 0;
+		PDLeg::Pose		fPose;
+		void			(*fCallback)(void* arg) = nullptr;
+		void*			fArg = nullptr;
+
+		static Command moveToPosition(PDGoActuator& actuator, uint32_t startDelay, uint32_t moveTime, double scale) {
+			Command cmd;
+			cmd.fType = kMoveToPosition;
+			cmd.fActuator = &actuator;
+			cmd.fStartDelay = startDelay;
+			cmd.fMoveTime = moveTime;
+			cmd.fValue = scale;
+			return cmd;
+		}
+
+		static Command moveToDegrees(PDGoActuator& actuator, uint32_t startDelay, uint32_t moveTime, double degrees) {
+			Command cmd = moveToPosition(actuator, startDelay, moveTime, degrees);
+			cmd.fType = kMoveToDegrees;
+			return cmd;
+		}
+
+		static Command setPose(PDLeg& leg, const PDLeg::Pose& pose, uint32_t moveTime) {
+			Command cmd;
+			cmd.fType = kSetPose;
+			cmd.fLeg = &leg;
+			cmd.fPose = pose;
+			cmd.fMoveTime = moveTime;
+			return cmd;
+		}
+
+		// Whole robot unless a leg is given
+		static Command relax(PDLeg* leg = nullptr) {
+			Command cmd;
+			cmd.fType = kRelax;
+			cmd.fLeg = leg;
+			return cmd;
+		}
+
+		static Command stand(PDLeg* leg = nullptr) {
+			Command cmd;
+			cmd.fType = kStand;
+			cmd.fLeg = leg;
+			return cmd;
+		}
+
+		// Run callback on the control thread between cycles
+		static Command call(void (*callback)(void* arg), void* arg) {
+			Command cmd;
+			cmd.fType = kCall;
+			cmd.fCallback = callback;
+			cmd.fArg = arg;
+			return cmd;
+		}
+	};
+
+	// Snapshot published by the control thread after every cycle
+	struct State {
+		uint64_t			fTime = 0;
+		uint64_t			fCycle = 0;
+		uint64_t			fWatchdogTrips = 0;
+		PDGoActuator::State	fNeck;
+		PDGoActuator::State	fLeft[PDLeg::kNumActuators];
+		PDGoActuator::State	fRight[PDLeg::kNumActuators];
+
+		static void getPose(const PDGoActuator::State* leg, PDLeg::Pose& pose) {
+			for (unsigned i = 0; i < PDLeg::kNumActuators; i++) {
+				pose.fPositions[i] = leg[i].fPosition;
+			}
+		}
+	};
+
 	PDGoMotorBus* buses[MAX_NUM_BUS] = {};
 	PDGoActuator neck;
 	PDLeg left;
@@ -25,11 +119,103 @@ public:
 										config.bus[i].name,
 										config.bus[i].adapter,
 										config.bus[i].version);
+				buses[busCount-1]->setPipelined(config.bus[i].pipelined);
+				if (config.bus[i].timeout > 0) {
+					buses[busCount-1]->setReplyTimeout(config.bus[i].timeout);
+				}
 			}
 		}
-		neck.setBus(getBus("neck", config.neck.bus));
+		PDGoMotorBus* neckBus = getBus("neck", config.neck.bus);
+		neck.setBus(neckBus);
+		neck.setRate(config.neck.rate);
 		left.setBus(getBus("left", config.leg.left.bus));
 		right.setBus(getBus("right", config.leg.right.bus));
+
+		// Every joint on a bus shares one batched transfer per cycle
+		fJoints.add(neck, neckBus);
+		for (unsigned i = 0; i < PDLeg::kNumActuators; i++) {
+			fJoints.add(left.fActuator[i], left.fBus, left.getName());
+			fJoints.add(right.fActuator[i], right.fBus, right.getName());
+		}
+
+		// One I/O thread per bus
+		for (unsigned i = 0; i < fJoints.numberOfGroups(); i++) {
+			PDJointGroup* group = &fJoints.getGroup(i);
+			executor.addTask(group->getBus(), [this, group]() { return group->update(fCycleTime); });
+			fWatchdog.addBus(group->getBus());
+		}
+		executor.start();
+	}
+
+	// Rate of the control loop, used to plan joints that run slower than it
+	void setControlRate(unsigned rate) {
+		fJoints.setControlRate(rate);
+	}
+
+	const PDJointRegistry& getJoints() const {
+		return fJoints;
+	}
+
+	// Watchdog trips seen by update(). Control thread only.
+	uint64_t getWatchdogTrips() const {
+		return fWatchdogTrips;
+	}
+
+	// Brake every motor if update() is not called for timeoutMS. The watchdog
+	// is armed by the first update() after this.
+	void startWatchdog(uint32_t timeoutMS, int priority = 0) {
+		fWatchdog.setTimeout(timeoutMS);
+		fWatchdog.setPriority(priority);
+		fWatchdog.start();
+	}
+
+	void stopWatchdog() {
+		fWatchdog.stop();
+	}
+
+	PDWatchdog& getWatchdog() {
+		return fWatchdog;
+	}
+
+	// Publish the state of every joint to shared memory after each cycle.
+	// Call before the control loop starts.
+	bool exportState(const char* name = PDStateExport::kDefaultName) {
+		if (!fExport.create(name)) {
+			return false;
+		}
+		unsigned index = 0;
+		for (unsigned g = 0; g < fJoints.numberOfGroups(); g++) {
+			PDJointGroup& group = fJoints.getGroup(g);
+			for (unsigned i = 0; i < group.numberOfActuators() && index < PDStateExport::kMaxJoints; i++) {
+				PDGoActuator& actuator = group.getActuator(i);
+				fExport.setJoint(index++, group.getPrefix(i), actuator.getName(), actuator.getID());
+			}
+		}
+		return true;
+	}
+
+	// Motors found by the last discover()
+	const PDBusDiscovery& getDiscovery() const {
+		return fDiscovery;
+	}
+
+	// Round trip histograms and error counts of every bus, safe to call
+	// while the control loop runs
+	void printBusStats(FILE* out) const {
+		for (unsigned g = 0; g < fJoints.numberOfGroups(); g++) {
+			const PDJointGroup& group = fJoints.getGroup(g);
+			char names[PDBusStats::kNumIDs][32] = {};
+			const char* labels[PDBusStats::kNumIDs] = {};
+			for (unsigned i = 0; i < group.numberOfActuators(); i++) {
+				const PDGoActuator& actuator = group.getActuator(i);
+				unsigned id = actuator.getID() & 0xF;
+				snprintf(names[id], sizeof(names[id]), "%s%s%s",
+					group.getPrefix(i) ? group.getPrefix(i) : "",
+					group.getPrefix(i) ? "." : "", actuator.getName());
+				labels[id] = names[id];
+			}
+			group.getBus()->getStats().print(out, group.getBus()->getName(), labels);
+		}
 	}
 
 	PDGoMotorBus* getBus(PDString group, PDString name) {
@@ -70,9 +256,12 @@ public:
 	}
 
 	void relax() {
+		// Joints playing a baked clip go back to their actuators first
+		fJoints.clearSlices();
 		neck.relax();
 		left.relax();
 		right.relax();
+		fJoints.relaxed();
 	}
 
 	void stand() {
@@ -145,46 +334,187 @@ public:
         }
 	}
 
-	bool init(bool forceContinue) {
-	    if (!left.update()) {
-    	    fprintf(stderr, "Missing left motors\n");
-        	for (int i = 0; i < left.numberOfActuators(); i++) {
-	            if (!left.fActuator[i].isResponding()) {
-    	            fprintf(stderr, "  [%d] %s\n", left.fActuator[i].getID(), left.fActuator[i].getName());
-        	        if (forceContinue) {
-            	        left.fActuator[i].setIgnore();
-                	}
-            	}
-        	}
-        	if (!forceContinue) {
-	        	return false;
-        	}
-        }
-	    if (!right.update()) {
-    	    fprintf(stderr, "Missing right motors\n");
-        	for (int i = 0; i < right.numberOfActuators(); i++) {
-	            if (!right.fActuator[i].isResponding()) {
-    	            fprintf(stderr, "  [%d] %s\n", right.fActuator[i].getID(), right.fActuator[i].getName());
-        	        if (forceContinue) {
-            	        right.fActuator[i].setIgnore();
-                	}
-            	}
-        	}
-        	if (!forceContinue) {
-	        	return false;
-        	}
-        }
-        return true;
-    }
+	// Probe the motor of every joint on all buses at once. With scanAll
+	// every ID is probed so motors missing from the configuration show up.
+	const PDBusDiscovery& discover(bool scanAll = false) {
+		fDiscovery.setScanAll(scanAll);
+		for (unsigned g = 0; g < fJoints.numberOfGroups(); g++) {
+			PDJointGroup& group = fJoints.getGroup(g);
+			fDiscovery.addBus(group.getBus());
+			for (unsigned i = 0; i < group.numberOfActuators(); i++) {
+				fDiscovery.addID(group.getBus(), group.getActuator(i).getID());
+			}
+		}
+		fDiscovery.run();
+		return fDiscovery;
+	}
+
+	bool init(bool forceContinue, bool scanAll = false) {
+		discover(scanAll);
+		uint64_t now = PDCycleClock::tick();
+		bool complete = true;
+		for (unsigned g = 0; g < fJoints.numberOfGroups(); g++) {
+			PDJointGroup& group = fJoints.getGroup(g);
+			PDGoMotorBus* bus = group.getBus();
+			for (unsigned i = 0; i < group.numberOfActuators(); i++) {
+				PDGoActuator& actuator = group.getActuator(i);
+				if (fDiscovery.isPresent(bus, actuator.getID())) {
+					actuator.update(fDiscovery.getFeedback(bus, actuator.getID()), now);
+					continue;
+				}
+				if (complete) {
+					fprintf(stderr, "Missing motors\n");
+					complete = false;
+				}
+				fprintf(stderr, "  [%d] %s%s%s on %s\n", actuator.getID(),
+					group.getPrefix(i) ? group.getPrefix(i) : "",
+					group.getPrefix(i) ? "." : "", actuator.getName(), bus->getName());
+				if (forceContinue) {
+					actuator.setIgnore();
+				}
+			}
+		}
+		if (!complete) {
+			if (!forceContinue) {
+				return false;
+			}
+			fprintf(stderr, "FORCE CONTINUE EVEN THOUGH MOTORS ARE MISSING\n");
+		}
+		return true;
+	}
+
+	// now is the cycle time from PDCycleClock::tick()
+	bool update(uint64_t now) {
+		fCycleTime = now;
+		uint64_t trips = fWatchdog.getTripCount();
+		if (trips != fWatchdogTrips) {
+			// The motors were braked while we stalled, do not pick up where we left off
+			fWatchdogTrips = trips;
+			relax();
+		}
+		processCommands();
+		bool success = executor.run();
+		fWatchdog.feed();
+		publishState();
+		return success;
+	}
 
 	bool update() {
-		bool success = true;
-	    if (!left.update()) {
-	    	success = false;
-	    }
-	    if (!right.update()) {
-	    	success = false;
-	    }
-	    return success;
+		return update(PDCycleClock::tick());
+	}
+
+	// Application side. Returns false if the command queue is full.
+	bool post(const Command& cmd) {
+		if (!fCommands.push(cmd)) {
+			return false;
+		}
+		fCommandsPosted++;
+		return true;
 	}
+
+	// Application side. Wait until the control thread has applied every posted command.
+	bool sync(uint32_t timeoutMS = 1000) {
+		if (!post(Command())) {
+			return false;
+		}
+		uint64_t deadline = currentTimeNanos() + PDCycleClock::fromMillis(timeoutMS);
+		while (fCommandsProcessed.load(std::memory_order_acquire) < fCommandsPosted) {
+			if (currentTimeNanos() > deadline) {
+				return false;
+			}
+			usleep(100);
+		}
+		return true;
+	}
+
+	// Application side. Latest state published by the control thread.
+	const State& getState() {
+		return fState.read();
+	}
+
+private:
+	void apply(const Command& cmd) {
+		switch (cmd.fType) {
+			case Command::kMoveToPosition:
+				cmd.fActuator->moveToPosition(cmd.fStartDelay, cmd.fMoveTime, cmd.fValue);
+				break;
+			case Command::kMoveToDegrees:
+				cmd.fActuator->moveToDegrees(cmd.fStartDelay, cmd.fMoveTime, cmd.fValue);
+				break;
+			case Command::kSetPose: {
+				PDLeg::Pose pose = cmd.fPose;
+				cmd.fLeg->setPose(pose, cmd.fMoveTime);
+				break;
+			}
+			case Command::kRelax:
+				if (cmd.fLeg != nullptr) {
+					cmd.fLeg->relax();
+					fJoints.relaxed();
+				} else {
+					relax();
+				}
+				break;
+			case Command::kStand:
+				if (cmd.fLeg != nullptr) {
+					cmd.fLeg->stand();
+				} else {
+					stand();
+				}
+				break;
+			case Command::kCall:
+				cmd.fCallback(cmd.fArg);
+				break;
+			case Command::kSync:
+				break;
+		}
+	}
+
+	void processCommands() {
+		Command cmd;
+		uint64_t processed = fCommandsProcessed.load(std::memory_order_relaxed);
+		while (fCommands.pop(cmd)) {
+			apply(cmd);
+			processed++;
+		}
+		fCommandsProcessed.store(processed, std::memory_order_release);
+	}
+
+	void publishState() {
+		State& state = fState.getWriteBuffer();
+		state.fTime = fCycleTime;
+		state.fCycle = ++fCycleCount;
+		state.fWatchdogTrips = fWatchdogTrips;
+		neck.getState(state.fNeck);
+		for (unsigned i = 0; i < PDLeg::kNumActuators; i++) {
+			left.fActuator[i].getState(state.fLeft[i]);
+			right.fActuator[i].getState(state.fRight[i]);
+		}
+		fState.publish();
+		if (fExport.isOpen()) {
+			PDGoActuator::State joint;
+			unsigned index = 0;
+			fExport.begin(fCycleTime, fCycleCount);
+			for (unsigned g = 0; g < fJoints.numberOfGroups(); g++) {
+				PDJointGroup& group = fJoints.getGroup(g);
+				for (unsigned i = 0; i < group.numberOfActuators() && index < PDStateExport::kMaxJoints; i++) {
+					group.getActuator(i).getState(joint);
+					fExport.write(index++, joint);
+				}
+			}
+			fExport.end();
+		}
+	}
+
+	uint64_t fCycleTime = 0;
+	uint64_t fCycleCount = 0;
+	uint64_t fWatchdogTrips = 0;
+	PDJointRegistry fJoints;
+	PDBusDiscovery fDiscovery;
+	PDWatchdog fWatchdog;
+	PDStateExport fExport;
+	PDBusExecutor executor;
+	PDCommandQueue<Command, 64> fCommands;
+	uint64_t fCommandsPosted = 0;
+	std::atomic<uint64_t> fCommandsProcessed { 0 };
+	PDTripleBuffer<State> fState;
 };
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "PDGoActuator.h"
+
+// Publishes the state of every joint to a POSIX shared memory segment once
+// per control cycle so monitors can follow the robot without touching the
+// control thread. The segment is mapped once at startup and every update is
+// plain stores guarded by a sequence lock: the sequence number is odd while
+// the control thread writes, and readers retry until they see the same even
+// number before and after their copy.
+class PDStateExport {
+public:
+    static constexpr char kMagic[8] = { 'P', 'D', 'S', 'T', 'A', 'T', 'E', '1' };
+    static constexpr const char* kDefaultName = "/puddle.state";
+    static constexpr unsigned kMaxJoints = 32;
+
+    struct Joint {
+        char        fName[24];      // limb.joint
+        double      fCommanded;     // Commanded position (degrees)
+        double      fDegrees;       // Measured position (degrees)
+        double      fPosition;      // Measured position within range [0-1]
+        float       fDQ;            // Velocity (rad/s)
+        float       fTau;           // Torque (Nm)
+        int32_t     fTemperature;
+        int32_t     fError;
+        int32_t     fFootForce;
+        uint32_t    fMissCount;
+        uint32_t    fErrorCount;
+        uint8_t     fID;
+        uint8_t     fActive;
+        uint8_t     fMoving;
+        uint8_t     fIgnore;
+    };
+
+    struct Snapshot {
+        uint64_t    fTime;          // Cycle time (CLOCK_MONOTONIC nanoseconds)
+        uint64_t    fCycle;
+        uint32_t    fNumJoints;
+        uint32_t    fReserved;
+        Joint       fJoints[kMaxJoints];
+    };
+
+    struct Segment {
+        char                    fMagic[8];
+        std::atomic<uint64_t>   fSequence;
+        Snapshot                fSnapshot;
+    };
+
+    PDStateExport() {}
+
+    PDStateExport(const PDStateExport&) = delete;
+    PDStateExport& operator=(const PDStateExport&) = delete;
+
+    ~PDStateExport() {
+        close();
+    }
+
+    // Create the segment. Called by the control side.
+    bool create(const char* name = kDefaultName) {
+        close();
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error creating shared memory %s: %s\n", name, strerror(errno));
+            return false;
+        }
+        if (ftruncate(fd, sizeof(Segment)) != 0) {
+            fprintf(stderr, "Error sizing shared memory %s: %s\n", name, strerror(errno));
+            ::close(fd);
+            shm_unlink(name);
+            return false;
+        }
+        void* mem = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Error mapping shared memory %s: %s\n", name, strerror(errno));
+            shm_unlink(name);
+            return false;
+        }
+        fSegment = (Segment*)mem;
+        memset(&fSegment->fSnapshot, '\0', sizeof(fSegment->fSnapshot));
+        fSegment->fSequence.store(0, std::memory_order_relaxed);
+        memcpy(fSegment->fMagic, kMagic, sizeof(kMagic));
+        snprintf(fName, sizeof(fName), "%s", name);
+        fOwner = true;
+        return true;
+    }
+
+    // Map an existing segment read only. Called by monitors.
+    bool attach(const char* name = kDefaultName) {
+        close();
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening shared memory %s: %s\n", name, strerror(errno));
+            return false;
+        }
+        off_t size = lseek(fd, 0, SEEK_END);
+        void* mem = (size >= off_t(sizeof(Segment))) ?
+            mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mem == MAP_FAILED || memcmp(((Segment*)mem)->fMagic, kMagic, sizeof(kMagic)) != 0) {
+            fprintf(stderr, "Not a puddle state segment: %s\n", name);
+            if (mem != MAP_FAILED) {
+                munmap(mem, sizeof(Segment));
+            }
+            return false;
+        }
+        fSegment = (Segment*)mem;
+        snprintf(fName, sizeof(fName), "%s", name);
+        fOwner = false;
+        return true;
+    }
+
+    void close() {
+        if (fSegment == nullptr) {
+            return;
+        }
+        munmap(fSegment, sizeof(Segment));
+        fSegment = nullptr;
+        if (fOwner) {
+            shm_unlink(fName);
+        }
+    }
+
+    bool isOpen() const {
+        return (fSegment != nullptr);
+    }
+
+    // Name a joint once before publishing. prefix may be nullptr.
+    void setJoint(unsigned index, const char* prefix, const char* name, uint8_t id) {
+        if (fSegment == nullptr || index >= kMaxJoints) {
+            return;
+        }
+        Joint& joint = fSegment->fSnapshot.fJoints[index];
+        snprintf(joint.fName, sizeof(joint.fName), "%s%s%s",
+            prefix ? prefix : "", prefix ? "." : "", name);
+        joint.fID = id;
+        if (index >= fSegment->fSnapshot.fNumJoints) {
+            fSegment->fSnapshot.fNumJoints = index + 1;
+        }
+    }
+
+    // Control side. Bracket the writes of one cycle with begin() and end().
+    inline void begin(uint64_t time, uint64_t cycle) {
+        uint64_t sequence = fSegment->fSequence.load(std::memory_order_relaxed);
+        fSegment->fSequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        fSegment->fSnapshot.fTime = time;
+        fSegment->fSnapshot.fCycle = cycle;
+    }
+
+    inline void write(unsigned index, const PDGoActuator::State& state) {
+        Joint& joint = fSegment->fSnapshot.fJoints[index];
+        joint.fCommanded = state.fCommanded;
+        joint.fDegrees = state.fDegrees;
+        joint.fPosition = state.fPosition;
+        joint.fDQ = state.fDQ;
+        joint.fTau = state.fTau;
+        joint.fTemperature = state.fTemperature;
+        joint.fError = state.fError;
+        joint.fFootForce = state.fFootForce;
+        joint.fMissCount = state.fMissCount;
+        joint.fErrorCount = state.fErrorCount;
+        joint.fActive = state.fActive;
+        joint.fMoving = state.fMoving;
+        joint.fIgnore = state.fIgnore;
+    }
+
+    inline void end() {
+        uint64_t sequence = fSegment->fSequence.load(std::memory_order_relaxed);
+        fSegment->fSequence.store(sequence + 1, std::memory_order_release);
+    }
+
+    // Monitor side. Copy a consistent snapshot. Returns false if the control
+    // side kept writing for every attempt.
+    bool read(Snapshot& snapshot, unsigned attempts = 1000) const {
+        for (unsigned i = 0; i < attempts; i++) {
+            uint64_t before = fSegment->fSequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            memcpy(&snapshot, (const void*)&fSegment->fSnapshot, sizeof(snapshot));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (fSegment->fSequence.load(std::memory_order_relaxed) == before) {
+                snapshot.fNumJoints = std::min(snapshot.fNumJoints, uint32_t(kMaxJoints));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Number of completed updates, increases by one per cycle
+    uint64_t getUpdateCount() const {
+        return fSegment->fSequence.load(std::memory_order_acquire) / 2;
+    }
+
+private:
+    Segment*    fSegment = nullptr;
+    char        fName[64] = {};
+    bool        fOwner = false;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "PDUtils.h"
+
+// Binary trace of hot path events. Every thread that emits an event claims
+// its own ring in a fixed size memory mapping and writes fixed size records
+// without locks or syscalls. Formatting is left to drain(), which is meant
+// to run on a separate thread, or to the pdtrace tool when the mapping is
+// backed by a file. Rings wrap around so only the most recent events of
+// each thread are kept.
+class PDTrace {
+public:
+    enum Type : uint16_t {
+        kNone = 0,
+        kTxFrame = 1,       // Command frame written to a bus
+        kRxFrame = 2,       // Feedback frame read from a bus
+        kMove = 3,          // Commanded position of an actuator (degrees)
+        kPosition = 4,      // Measured position of an actuator (0-1)
+        kBadFrame = 5       // Feedback frame dropped on a bad CRC
+    };
+
+    struct Record {
+        uint64_t    fTime;
+        uint16_t    fType;
+        uint8_t     fLength;
+        uint8_t     fRing;
+        uint32_t    fReserved;
+        union {
+            uint8_t fBytes[48];
+            struct {
+                double  fValue;
+                char    fName[40];
+            };
+        };
+    };
+    static_assert(sizeof(Record) == 64, "Record must be one cache line");
+
+    static constexpr char kMagic[8] = { 'P', 'D', 'T', 'R', 'A', 'C', 'E', '1' };
+    static constexpr unsigned kMaxRings = 16;
+
+    struct Header {
+        char                    fMagic[8];
+        uint32_t                fNumRings;
+        uint32_t                fRingSize;      // Records per ring (power of two)
+        std::atomic<uint32_t>   fRingsUsed;
+        uint8_t                 fReserved[64 - 20];
+    };
+
+    struct alignas(64) RingHeader {
+        std::atomic<uint64_t>   fHead;
+        uint8_t                 fReserved[64 - 8];
+    };
+
+    static PDTrace& trace() {
+        static PDTrace sTrace;
+        return sTrace;
+    }
+
+    // Map the trace buffer. With a path the buffer is a file that pdtrace
+    // can decode later, otherwise it is anonymous memory for drain().
+    bool open(const char* path = nullptr, uint32_t ringSize = 8192, uint32_t numRings = 8) {
+        if (fHeader != nullptr) {
+            return true;
+        }
+        if ((ringSize & (ringSize - 1)) != 0 || numRings == 0 || numRings > kMaxRings) {
+            fprintf(stderr, "Invalid trace size\n");
+            return false;
+        }
+        size_t size = mappingSize(ringSize, numRings);
+        void* mem;
+        if (path != nullptr) {
+            int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "Error opening trace file %s: %s\n", path, strerror(errno));
+                return false;
+            }
+            if (ftruncate(fd, size) != 0) {
+                fprintf(stderr, "Error sizing trace file %s: %s\n", path, strerror(errno));
+                ::close(fd);
+                return false;
+            }
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+        } else {
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        }
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Error mapping trace buffer: %s\n", strerror(errno));
+            return false;
+        }
+        Header* header = (Header*)mem;
+        header->fNumRings = numRings;
+        header->fRingSize = ringSize;
+        header->fRingsUsed.store(0, std::memory_order_relaxed);
+        memcpy(header->fMagic, kMagic, sizeof(kMagic));
+        fSize = size;
+        fHeader.store(header, std::memory_order_release);
+        return true;
+    }
+
+    // Map an existing trace file for decoding
+    bool load(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening trace file %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        off_t size = lseek(fd, 0, SEEK_END);
+        void* mem = (size >= off_t(sizeof(Header))) ?
+            mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Error mapping trace file %s\n", path);
+            return false;
+        }
+        Header* header = (Header*)mem;
+        if (memcmp(header->fMagic, kMagic, sizeof(kMagic)) != 0 ||
+            header->fNumRings > kMaxRings ||
+            mappingSize(header->fRingSize, header->fNumRings) > size_t(size))
+        {
+            fprintf(stderr, "Not a trace file: %s\n", path);
+            munmap(mem, size);
+            return false;
+        }
+        fSize = size;
+        fHeader.store(header, std::memory_order_release);
+        return true;
+    }
+
+    bool isOpen() const {
+        return (fHeader.load(std::memory_order_relaxed) != nullptr);
+    }
+
+    static inline void frame(Type type, const uint8_t* bytes, size_t len) {
+        Record* record = trace().begin(type);
+        if (record != nullptr) {
+            len = std::min(len, sizeof(record->fBytes));
+            memcpy(record->fBytes, bytes, len);
+            record->fLength = len;
+            trace().commit();
+        }
+    }
+
+    // Value of a named joint. The name is prefix.name when prefix is given.
+    static inline void value(Type type, const char* prefix, const char* name, double value) {
+        Record* record = trace().begin(type);
+        if (record != nullptr) {
+            size_t len = 0;
+            if (prefix != nullptr) {
+                while (*prefix != '\0' && len < sizeof(record->fName) - 2) {
+                    record->fName[len++] = *prefix++;
+                }
+                record->fName[len++] = '.';
+            }
+            while (*name != '\0' && len < sizeof(record->fName) - 1) {
+                record->fName[len++] = *name++;
+            }
+            record->fName[len] = '\0';
+            record->fValue = value;
+            record->fLength = sizeof(record->fValue) + len;
+            trace().commit();
+        }
+    }
+
+    // Format every record written since the last drain, oldest first.
+    // Returns the number of records printed.
+    unsigned drain(FILE* out) {
+        Header* header = fHeader.load(std::memory_order_acquire);
+        if (header == nullptr) {
+            return 0;
+        }
+        std::vector<Record> records;
+        uint32_t rings = std::min(header->fRingsUsed.load(std::memory_order_acquire), header->fNumRings);
+        for (uint32_t r = 0; r < rings; r++) {
+            RingHeader* ring = getRing(header, r);
+            Record* base = getRecords(header, r);
+            uint64_t size = header->fRingSize;
+            uint64_t head = ring->fHead.load(std::memory_order_acquire);
+            uint64_t start = fTail[r];
+            if (head - start > size) {
+                start = head - size;
+            }
+            size_t first = records.size();
+            for (uint64_t i = start; i < head; i++) {
+                records.push_back(base[i & (size - 1)]);
+            }
+            // The writer may have lapped the oldest records while we copied them
+            uint64_t now = ring->fHead.load(std::memory_order_acquire);
+            uint64_t stale = 0;
+            if (now + 1 > start + size) {
+                stale = std::min(now + 1 - size - start, head - start);
+                records.erase(records.begin() + first, records.begin() + first + stale);
+            }
+            fLost += (start - fTail[r]) + stale;
+            fTail[r] = head;
+        }
+        std::stable_sort(records.begin(), records.end(),
+            [](const Record& a, const Record& b) { return a.fTime < b.fTime; });
+        for (auto& record : records) {
+            print(out, record);
+        }
+        return records.size();
+    }
+
+    uint64_t getLost() const {
+        return fLost;
+    }
+
+    static void print(FILE* out, const Record& record) {
+        fprintf(out, "%llu.%09llu ",
+            (unsigned long long)(record.fTime / 1000000000),
+            (unsigned long long)(record.fTime % 1000000000));
+        switch (record.fType) {
+            case kTxFrame:
+            case kRxFrame:
+            case kBadFrame:
+                fprintf(out, "%s", (record.fType == kTxFrame) ? "[W] " :
+                    (record.fType == kRxFrame) ? "[R] " : "[BAD CRC] ");
+                for (unsigned i = 0; i < record.fLength && i < sizeof(record.fBytes); i++) {
+                    fprintf(out, "%02X ", record.fBytes[i]);
+                }
+                fprintf(out, "\n");
+                break;
+            case kMove:
+                fprintf(out, "[%.*s]: %f\n", int(sizeof(record.fName)), record.fName, record.fValue);
+                break;
+            case kPosition:
+                fprintf(out, "[%.*s:%f]\n", int(sizeof(record.fName)), record.fName, record.fValue);
+                break;
+            default:
+                fprintf(out, "[?%u]\n", record.fType);
+                break;
+        }
+    }
+
+private:
+    PDTrace() {}
+
+    static size_t mappingSize(uint32_t ringSize, uint32_t numRings) {
+        return sizeof(Header) + size_t(numRings) * (sizeof(RingHeader) + size_t(ringSize) * sizeof(Record));
+    }
+
+    static RingHeader* getRing(Header* header, uint32_t index) {
+        uint8_t* base = (uint8_t*)(header + 1);
+        return (RingHeader*)(base + size_t(index) * (sizeof(RingHeader) + size_t(header->fRingSize) * sizeof(Record)));
+    }
+
+    static Record* getRecords(Header* header, uint32_t index) {
+        return (Record*)(getRing(header, index) + 1);
+    }
+
+    struct ThreadRing {
+        RingHeader* fRing = nullptr;
+        Record*     fRecords = nullptr;
+        uint32_t    fMask = 0;
+        uint32_t    fIndex = 0;
+        bool        fClaimed = false;
+    };
+
+    static ThreadRing& threadRing() {
+        static thread_local ThreadRing sThreadRing;
+        return sThreadRing;
+    }
+
+    inline Record* begin(Type type) {
+        ThreadRing& tr = threadRing();
+        if (tr.fRing == nullptr) {
+            Header* header = fHeader.load(std::memory_order_acquire);
+            if (header == nullptr || tr.fClaimed) {
+                return nullptr;
+            }
+            // First event from this thread claims a ring
+            tr.fClaimed = true;
+            uint32_t index = header->fRingsUsed.fetch_add(1, std::memory_order_acq_rel);
+            if (index >= header->fNumRings) {
+                return nullptr;
+            }
+            tr.fIndex = index;
+            tr.fRing = getRing(header, index);
+            tr.fRecords = getRecords(header, index);
+            tr.fMask = header->fRingSize - 1;
+        }
+        uint64_t head = tr.fRing->fHead.load(std::memory_order_relaxed);
+        Record* record = &tr.fRecords[head & tr.fMask];
+        record->fTime = currentTimeNanos();
+        record->fType = type;
+        record->fRing = tr.fIndex;
+        return record;
+    }
+
+    inline void commit() {
+        ThreadRing& tr = threadRing();
+        uint64_t head = tr.fRing->fHead.load(std::memory_order_relaxed);
+        tr.fRing->fHead.store(head + 1, std::memory_order_release);
+    }
+
+    std::atomic<Header*>    fHeader { nullptr };
+    size_t                  fSize = 0;
+    uint64_t                fTail[kMaxRings] = {};
+    uint64_t                fLost = 0;
+};
@@ -77,6 +77,31 @@ uint64_t currentTimeMillis()
     return millis;
 }
 
+uint64_t currentTimeNanos()
+{
+    uint64_t nanos;
+#if defined(HAVE_CLOCK_MONOTONIC)
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    nanos = (uint64_t)tm.tv_sec * (uint64_t)1000000000 + (uint64_t)tm.tv_nsec;
+#elif defined(HAVE_CLOCK_REALTIME)
+    timespec tm;
+    clock_gettime(CLOCK_REALTIME, &tm);
+    nanos = (uint64_t)tm.tv_sec * (uint64_t)1000000000 + (uint64_t)tm.tv_nsec;
+#elif defined(HAVE_GETTIMEOFDAY)
+    struct timeval tm;
+    gettimeofday(&tm, 0);
+    nanos = (uint64_t)tm.tv_sec * (uint64_t)1000000000 + (uint64_t)tm.tv_usec * (uint64_t)1000;
+#elif defined(HAVE_FTIME)
+    struct timeb tm;
+    ftime(&tm);
+    nanos = (uint64_t)tm.time * (uint64_t)1000000000 + (uint64_t)tm.millitm * (uint64_t)1000000;
+#else
+    #error No timing function defined
+#endif
+    return nanos;
+}
+
 double degreesToRadians(double degrees) {
     return degrees * (M_PI / 180.0);
 }
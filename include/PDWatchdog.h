@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <termios.h>
+#include "PDUtils.h"
+#include "PDGoMotorBus.h"
+
+// Brakes every motor when the control loop stops calling feed(). The check
+// runs on its own thread every tenth of the timeout (at most 1 ms) and, on a
+// missed deadline, writes a brake frame addressed to the broadcast ID straight
+// to each bus descriptor. Frames are encoded up front so tripping needs nothing
+// but tcflush() and write(), which also makes brake() safe to call from a
+// signal handler.
+//
+// A bus thread may be part way through writing a command frame when the
+// brake goes out. Whatever it has queued but not yet transmitted is flushed,
+// but a motor that already started reading the torn frame will fail its CRC
+// and can swallow the first brake frame with it, so every brake is sent
+// twice back to back. Worst case reaction is the timeout plus one check
+// period plus the time to write two frames (34 bytes).
+class PDWatchdog {
+public:
+    static constexpr uint32_t kDefaultTimeout = 50;     // Milliseconds
+    static constexpr unsigned kMaxBuses = 8;
+    static constexpr uint8_t kBroadcastID = 15;
+
+    PDWatchdog() {}
+
+    PDWatchdog(const PDWatchdog&) = delete;
+    PDWatchdog& operator=(const PDWatchdog&) = delete;
+
+    ~PDWatchdog() {
+        stop();
+    }
+
+    // Encode the brake frame for bus. Call before start().
+    bool addBus(PDGoMotorBus* bus) {
+        if (bus == nullptr || bus->getFD() == -1 || fNumTargets == kMaxBuses) {
+            return false;
+        }
+        PDGoMotorCmd cmd;
+        cmd.setMotorID(kBroadcastID);
+        cmd.setBrakeMode();
+        Target& target = fTargets[fNumTargets++];
+        target.fd = bus->getFD();
+        memcpy(target.fFrame, cmd.getFrame(bus->getCRC()), sizeof(target.fFrame));
+        return true;
+    }
+
+    void setTimeout(uint32_t milliseconds) {
+        fTimeout = uint64_t(milliseconds) * 1000000;
+        fPeriod = std::min(fTimeout / 10, kMaxPeriod);
+    }
+
+    uint32_t getTimeout() const {
+        return fTimeout / 1000000;
+    }
+
+    // SCHED_FIFO priority of the watchdog thread, 0 for the default policy.
+    // It should be above the control loop so a spinning loop cannot starve it.
+    void setPriority(int priority) {
+        fPriority = priority;
+    }
+
+    bool start() {
+        if (fRunning.load()) {
+            return true;
+        }
+        fHeartbeat.store(0, std::memory_order_relaxed);
+        fRunning = true;
+        fThread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void stop() {
+        if (fRunning.exchange(false) && fThread.joinable()) {
+            fThread.join();
+        }
+    }
+
+    // Called by the control loop every cycle. The first call arms the watchdog.
+    inline void feed(uint64_t now = currentTimeNanos()) {
+        fHeartbeat.store(now, std::memory_order_release);
+    }
+
+    // Send the brake frames now. Async signal safe.
+    void brake() {
+        for (unsigned i = 0; i < fNumTargets; i++) {
+            const Target& target = fTargets[i];
+            // Drop commands still queued for the adapter. Fails harmlessly
+            // if the descriptor is not a terminal.
+            tcflush(target.fd, TCOFLUSH);
+            // The second frame resyncs a motor that was reading a torn one
+            if (writeFrame(target)) {
+                writeFrame(target);
+            }
+        }
+    }
+
+    // Number of times the deadline was missed
+    uint64_t getTripCount() const {
+        return fTripCount.load(std::memory_order_acquire);
+    }
+
+    // Time from the missed deadline until the brake frames were written, in nanoseconds
+    uint64_t getLastLatency() const {
+        return fLastLatency.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getWorstLatency() const {
+        return fWorstLatency.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr uint64_t kMaxPeriod = 1000000;
+
+    struct Target {
+        int     fd = -1;
+        uint8_t fFrame[PDGoMotorCmd::kFrameSize];
+    };
+
+    static bool writeFrame(const Target& target) {
+        size_t len = 0;
+        while (len < sizeof(target.fFrame)) {
+            ssize_t wrote = ::write(target.fd, target.fFrame + len, sizeof(target.fFrame) - len);
+            if (wrote > 0) {
+                len += wrote;
+            } else if (wrote < 0 && errno == EINTR) {
+                continue;
+            } else {
+                // Give up on a full or broken descriptor rather than block
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void run() {
+        if (fPriority > 0) {
+            struct sched_param param = {};
+            param.sched_priority = fPriority;
+            int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (err != 0) {
+                fprintf(stderr, "Failed to set watchdog priority %d: %s\n", fPriority, strerror(err));
+            }
+        }
+        uint64_t wake = currentTimeNanos();
+        uint64_t trippedAt = 0;
+        while (fRunning.load(std::memory_order_relaxed)) {
+            wake += fPeriod;
+            struct timespec ts;
+            ts.tv_sec = wake / 1000000000;
+            ts.tv_nsec = wake % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+            }
+            uint64_t heartbeat = fHeartbeat.load(std::memory_order_acquire);
+            if (heartbeat == 0) {
+                continue;
+            }
+            uint64_t deadline = heartbeat + fTimeout;
+            uint64_t now = currentTimeNanos();
+            if (now < deadline) {
+                trippedAt = 0;
+                continue;
+            }
+            if (trippedAt == 0) {
+                brake();
+                uint64_t latency = currentTimeNanos() - deadline;
+                fLastLatency.store(latency, std::memory_order_relaxed);
+                if (latency > fWorstLatency.load(std::memory_order_relaxed)) {
+                    fWorstLatency.store(latency, std::memory_order_relaxed);
+                }
+                fTripCount.fetch_add(1, std::memory_order_acq_rel);
+                trippedAt = now;
+            } else if (now - trippedAt >= fTimeout) {
+                // Keep braking while stalled in case a frame was lost
+                brake();
+                trippedAt = now;
+            }
+            if (now > wake + fPeriod) {
+                // Overslept, do not try to catch up
+                wake = now;
+            }
+        }
+    }
+
+    Target                  fTargets[kMaxBuses];
+    unsigned                fNumTargets = 0;
+    uint64_t                fTimeout = uint64_t(kDefaultTimeout) * 1000000;
+    uint64_t                fPeriod = std::min(uint64_t(kDefaultTimeout) * 100000, kMaxPeriod);
+    int                     fPriority = 0;
+    std::atomic<uint64_t>   fHeartbeat { 0 };
+    std::atomic<uint64_t>   fTripCount { 0 };
+    std::atomic<uint64_t>   fLastLatency { 0 };
+    std::atomic<uint64_t>   fWorstLatency { 0 };
+    std::atomic<bool>       fRunning { false };
+    std::thread             fThread;
+};
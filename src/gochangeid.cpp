@@ -1,5 +1,13 @@
 #include <stdio.h>
+#include <map>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include "yaml-cpp/yaml.h"
 #include "PDGoMotorBus.h"
+#include "PDBusDiscovery.h"
+
+static constexpr uint8_t kBroadcastID = 15;
 
 static int getVersion(const char* argv0) {
     return (argv0[strlen(argv0)-1] == '2') ? 2 : 1;
@@ -11,20 +19,36 @@ static void usage(const char* argv0) {
     printf("Motor broadcast ID:15\n");
     printf("Notice: There cannot be motors with the same ID on a RS-485 bus!!!\n\n");
     printf("usage: %s [tty device] [id] [target_id]\n", argv0);
+    printf("       %s -scan [tty device]\n", argv0);
+    printf("       %s -map [file.yaml] [tty device]\n", argv0);
     printf("ex:    %s /dev/ttyUSB0 0 1  :Set motor 0 to id 1 [id] [target_id]\n", argv0);
     printf("ex:    %s /dev/ttyUSB0 15 1 :Set All motor to id 1 (Use with caution)\n", argv0);
+    printf("ex:    %s -scan /dev/ttyUSB0 :List the IDs of every motor that answers\n", argv0);
+    printf("ex:    %s -map leg.yaml     :Apply an ID map and verify it\n\n", argv0);
+    printf("ID map file:\n");
+    printf("  adapter: /dev/ttyUSB0     # optional when given on the command line\n");
+    printf("  ids: { 1: 6, 2: 7, 3: 8 } # old id: new id\n");
 }
 
-int main(int argc, const char* argv[])
-{
-    if (argc < 4) {
-        usage(argv[0]);
-        return 0;
+static uint16_t scan(PDGoMotorBus& bus) {
+    PDBusDiscovery discovery;
+    discovery.addBus(&bus);
+    discovery.setScanAll(true);
+    discovery.run();
+    return discovery.getPresent(&bus);
+}
+
+static void printIDs(const char* label, uint16_t ids) {
+    printf("%s", label);
+    for (unsigned id = 0; id < PDBusDiscovery::kNumIDs; id++) {
+        if (ids & (1u << id)) {
+            printf(" %u", id);
+        }
     }
-    int version = getVersion(argv[0]);
-    const char* serialPort = argv[1];
-    int oldid = atoi(argv[2]);
-    int newid = atoi(argv[3]);
+    printf("\n");
+}
+
+static bool changeID(PDGoMotorBus& bus, int oldid, int newid) {
     uint8_t buffer[] = {
         0xFB,
         1,
@@ -32,27 +56,232 @@ int main(int argc, const char* argv[])
         0xBB
     };
 
-    if (!PDLog::log().parse("-v:motor")) {
-        printf("WTF\n");
-    }
-
-    PDGoMotorBus bus(argv[1], argv[1], version);
-    bus.setReadTimeout(20, sizeof(buffer));
-
     PDGoMotorCmd cmd;
     cmd.setBootMode();
-    if (!bus.send(&cmd)) {
-        return 1;
+    bool sent = bus.send(&cmd);
+    PDTrace::trace().drain(stdout);
+    if (!sent) {
+        return false;
     }
 
+    // Drop anything left over from earlier probes before reading the echo
+    tcflush(bus.getFD(), TCIFLUSH);
+    bool changed = false;
     if (bus.write(buffer, sizeof(buffer)) != sizeof(buffer)) {
         fprintf(stderr, "Failed to send changeid command\n");
-        return 1;
-    }
-    if (bus.read(buffer, sizeof(buffer)) != sizeof(buffer)) {
+    } else if (bus.read(buffer, sizeof(buffer)) != sizeof(buffer)) {
         fprintf(stderr, "[ERROR] Modify id %d to %d failure, No motor be found.\n", oldid, newid);
+    } else {
+        changed = true;
+    }
+    // Motors in boot mode do not answer commands. A broadcast brake frame
+    // returns every motor on the bus to motor mode.
+    PDGoMotorCmd brake;
+    brake.setMotorID(kBroadcastID);
+    brake.setBrakeMode();
+    if (!bus.send(&brake)) {
+        fprintf(stderr, "Failed to return the motors to motor mode\n");
+        return false;
+    }
+    PDTrace::trace().drain(stdout);
+    return changed;
+}
+
+// Change the ID and check that the motor answers on the new ID only
+static bool changeAndVerify(PDGoMotorBus& bus, int oldid, int newid) {
+    if (!changeID(bus, oldid, newid)) {
+        return false;
+    }
+    PDBusDiscovery discovery;
+    discovery.addID(&bus, oldid);
+    discovery.addID(&bus, newid);
+    discovery.run();
+    if (!discovery.isPresent(&bus, newid) || discovery.isPresent(&bus, oldid)) {
+        fprintf(stderr, "[ERROR] Motor %d did not move to id %d\n", oldid, newid);
+        return false;
+    }
+    printf("%d -> %d OK\n", oldid, newid);
+    return true;
+}
+
+// Show where a map stopped. Verification may have failed after the motor
+// moved, so the bus is scanned again rather than trusting the moves made.
+static void printAbort(PDGoMotorBus& bus, const std::vector<std::pair<int, int>>& moved, int oldid, int newid) {
+    fprintf(stderr, "Stopped part way, %zu move(s) done:\n", moved.size());
+    for (auto& it : moved) {
+        fprintf(stderr, "  %d -> %d\n", it.first, it.second);
+    }
+    if (oldid != -1) {
+        fprintf(stderr, "  %d -> %d failed\n", oldid, newid);
+    }
+    printIDs("Now:", scan(bus));
+}
+
+// Apply every old -> new pair. Moves whose target is still taken wait for it
+// to be freed, and cycles such as 1 -> 2 -> 1 go through a spare ID.
+static bool applyMap(PDGoMotorBus& bus, std::map<int, int> pending) {
+    const unsigned kNumIDs = PDBusDiscovery::kNumIDs;
+    uint16_t present = scan(bus);
+    printIDs("Found:", present);
+
+    uint16_t sources = 0;
+    uint16_t targets = 0;
+    for (auto it = pending.begin(); it != pending.end();) {
+        int oldid = it->first;
+        int newid = it->second;
+        if (oldid < 0 || oldid >= int(kNumIDs) || newid < 0 || newid >= int(kNumIDs)) {
+            fprintf(stderr, "Invalid mapping %d -> %d, IDs are 0-%u\n", oldid, newid, kNumIDs - 1);
+            return false;
+        }
+        if (!(present & (1u << oldid))) {
+            fprintf(stderr, "Motor %d is not on the bus\n", oldid);
+            return false;
+        }
+        if (targets & (1u << newid)) {
+            fprintf(stderr, "More than one motor maps to id %d\n", newid);
+            return false;
+        }
+        targets |= (1u << newid);
+        if (oldid == newid) {
+            it = pending.erase(it);
+            continue;
+        }
+        sources |= (1u << oldid);
+        it++;
+    }
+    uint16_t staying = present & ~sources;
+    for (auto& it : pending) {
+        if (staying & (1u << it.second)) {
+            fprintf(stderr, "Motor %d would clash with motor %d which is not being moved\n", it.first, it.second);
+            return false;
+        }
+    }
+
+    std::vector<std::pair<int, int>> moved;
+    uint16_t occupied = present;
+    while (!pending.empty()) {
+        auto next = pending.end();
+        for (auto it = pending.begin(); it != pending.end(); it++) {
+            if (!(occupied & (1u << it->second))) {
+                next = it;
+                break;
+            }
+        }
+        if (next != pending.end()) {
+            if (!changeAndVerify(bus, next->first, next->second)) {
+                printAbort(bus, moved, next->first, next->second);
+                return false;
+            }
+            moved.push_back(*next);
+            occupied = (occupied & ~(1u << next->first)) | (1u << next->second);
+            pending.erase(next);
+            continue;
+        }
+        // Every target is taken, park one motor on a spare ID
+        int spare = -1;
+        for (unsigned id = 0; id < kNumIDs; id++) {
+            if (!(occupied & (1u << id)) && !(targets & (1u << id))) {
+                spare = id;
+                break;
+            }
+        }
+        if (spare == -1) {
+            fprintf(stderr, "No spare id to break the cycle\n");
+            printAbort(bus, moved, -1, -1);
+            return false;
+        }
+        auto first = pending.begin();
+        int oldid = first->first;
+        int newid = first->second;
+        if (!changeAndVerify(bus, oldid, spare)) {
+            printAbort(bus, moved, oldid, spare);
+            return false;
+        }
+        moved.push_back(std::make_pair(oldid, spare));
+        occupied = (occupied & ~(1u << oldid)) | (1u << spare);
+        pending.erase(first);
+        pending[spare] = newid;
+    }
+
+    printIDs("Now:", scan(bus));
+    return true;
+}
+
+static bool loadMap(const char* path, std::string& adapter, std::map<int, int>& ids) {
+    try {
+        YAML::Node config = YAML::LoadFile(path);
+        if (config["adapter"]) {
+            adapter = config["adapter"].as<std::string>();
+        }
+        if (!config["ids"] || !config["ids"].IsMap()) {
+            fprintf(stderr, "%s: missing ids map\n", path);
+            return false;
+        }
+        for (auto it : config["ids"]) {
+            int oldid = it.first.as<int>();
+            if (!ids.emplace(oldid, it.second.as<int>()).second) {
+                fprintf(stderr, "%s: motor %d is mapped more than once\n", path, oldid);
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Exception reading " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, const char* argv[])
+{
+    int version = getVersion(argv[0]);
+    if (argc >= 3 && strcmp(argv[1], "-scan") == 0) {
+        PDGoMotorBus bus(argv[2], argv[2], version);
+        if (bus.getFD() == -1) {
+            return 1;
+        }
+        uint16_t present = scan(bus);
+        printIDs("Found:", present);
+        return (present != 0) ? 0 : 1;
+    }
+    if (argc >= 3 && strcmp(argv[1], "-map") == 0) {
+        std::string adapter;
+        std::map<int, int> ids;
+        if (!loadMap(argv[2], adapter, ids)) {
+            return 1;
+        }
+        if (argc >= 4) {
+            adapter = argv[3];
+        }
+        if (adapter.empty()) {
+            fprintf(stderr, "No adapter given\n");
+            return 1;
+        }
+        PDGoMotorBus bus(adapter.c_str(), adapter.c_str(), version);
+        bus.setReadTimeout(2, 4);
+        if (bus.getFD() == -1 || !applyMap(bus, ids)) {
+            return 1;
+        }
+        printf("SUCCESS\n");
+        return 0;
+    }
+    if (argc < 4) {
+        usage(argv[0]);
+        return 0;
+    }
+    const char* serialPort = argv[1];
+    int oldid = atoi(argv[2]);
+    int newid = atoi(argv[3]);
+
+    if (!PDLog::log().parse("-v:motor")) {
+        printf("WTF\n");
+    }
+    PDTrace::trace().open(nullptr, 64, 1);
+
+    PDGoMotorBus bus(serialPort, serialPort, version);
+    bus.setReadTimeout(20, 4);
+    if (!changeID(bus, oldid, newid)) {
         return 1;
     }
     printf("SUCCESS\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include "PDGoMotorSim.h"
+
+static volatile sig_atomic_t sQuit = 0;
+static void Handler(int)
+{
+    sQuit = 1;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Go motor simulator on a pseudo-terminal.\n\n");
+    fprintf(stderr, "usage: %s [-link path] [-id first] [-n count] [-latency us] [-jitter us] [-version 1|2] [-missing id] [-v:motor]\n", argv0);
+    fprintf(stderr, "ex:    %s -link /tmp/ttyGO0 -id 1 -n 5   :Simulate a leg with motors 1-5\n", argv0);
+    fprintf(stderr, "Point the bus adapter in robot.yaml at the link path (or the printed pty).\n");
+}
+
+int main(int argc, const char* argv[]) {
+    const char* linkPath = nullptr;
+    int firstID = 1;
+    int count = 5;
+    int latency = 50;
+    int jitter = 0;
+    int version = 1;
+    uint16_t missing = 0;
+    for (int argi = 1; argi < argc; argi++) {
+        const char* arg = argv[argi];
+        const char* val = (argi + 1 < argc) ? argv[argi + 1] : nullptr;
+        if (strncmp(arg, "-v", 2) == 0 && PDLog::log().parse(arg)) {
+            /* Do nothing */
+        } else if (strcmp(arg, "-link") == 0 && val != nullptr) {
+            linkPath = val;
+            argi++;
+        } else if (strcmp(arg, "-id") == 0 && val != nullptr) {
+            firstID = atoi(val);
+            argi++;
+        } else if (strcmp(arg, "-n") == 0 && val != nullptr) {
+            count = atoi(val);
+            argi++;
+        } else if (strcmp(arg, "-latency") == 0 && val != nullptr) {
+            latency = atoi(val);
+            argi++;
+        } else if (strcmp(arg, "-jitter") == 0 && val != nullptr) {
+            jitter = atoi(val);
+            argi++;
+        } else if (strcmp(arg, "-version") == 0 && val != nullptr) {
+            version = atoi(val);
+            argi++;
+        } else if (strcmp(arg, "-missing") == 0 && val != nullptr) {
+            missing |= (1 << (atoi(val) & 0xF));
+            argi++;
+        } else if (strcmp(arg, "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", arg);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (version != 1 && version != 2) {
+        fprintf(stderr, "Invalid version: %d\n", version);
+        return 1;
+    }
+
+    PDGoMotorSim sim(version);
+    for (int id = firstID; id < firstID + count && id < int(PDGoMotorSim::kMaxMotors); id++) {
+        if ((missing & (1 << id)) == 0) {
+            sim.addMotor(id);
+        }
+    }
+    sim.setLatency(latency, jitter);
+    if (!sim.open(linkPath)) {
+        return 1;
+    }
+    printf("Simulating motors %d-%d on %s%s%s\n",
+        firstID, firstID + count - 1, sim.getPortName(),
+        (linkPath != nullptr) ? " -> " : "", (linkPath != nullptr) ? linkPath : "");
+
+    signal(SIGINT, Handler);
+    signal(SIGTERM, Handler);
+    while (!sQuit) {
+        if (!sim.poll(100)) {
+            fprintf(stderr, "Error reading %s: %s\n", sim.getPortName(), strerror(errno));
+            break;
+        }
+    }
+    printf("\ncommands:%u replies:%u crc errors:%u dropped bytes:%u\n",
+        sim.getCommandCount(), sim.getReplyCount(), sim.getCRCErrors(), sim.getDroppedBytes());
+    return 0;
+}
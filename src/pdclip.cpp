@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "PDClip.h"
+
+static constexpr double kDefaultTolerance = 0.001;
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Show or reduce a motion clip recorded by puddle.\n\n");
+    fprintf(stderr, "usage: %s [-samples] [-reduce out] [-tolerance x] [-joint name=x] [-raw] clip\n", argv0);
+    fprintf(stderr, "  -samples        Print the positions of every sample\n");
+    fprintf(stderr, "  -reduce out     Write the keyframes of clip to out\n");
+    fprintf(stderr, "  -tolerance x    How far playback of out may be from clip, 0-1 of each joint's range (default %g)\n", kDefaultTolerance);
+    fprintf(stderr, "  -joint name=x   Tolerance for one joint, ex: left.knee.pitch=0.0005\n");
+    fprintf(stderr, "  -raw            Write out without delta encoding\n");
+}
+
+// Write the samples of clip listed in keyframes to path
+static bool write(const PDClip& clip, const std::vector<uint64_t>& keyframes, const char* path, PDClip::Encoding encoding) {
+    const char* names[PDClip::kMaxJoints];
+    uint8_t ids[PDClip::kMaxJoints];
+    for (unsigned j = 0; j < clip.numberOfJoints(); j++) {
+        names[j] = clip.getJointName(j);
+        ids[j] = clip.getJointID(j);
+    }
+    PDClipWriter writer;
+    writer.setEncoding(encoding);
+    writer.setFlags(clip.getFlags() | PDClip::kKeyframes);
+    if (!writer.open(path, clip.numberOfJoints(), names, ids, clip.getChannels())) {
+        return false;
+    }
+    size_t size = clip.numberOfJoints() * PDClip::numberOfValues(clip.getChannels()) * sizeof(int16_t);
+    PDClip::Cursor cursor;
+    cursor.seek(clip, 0);
+    for (uint64_t sample : keyframes) {
+        while (cursor.getSample() < sample) {
+            cursor.next();
+        }
+        writer.waitForRoom();
+        int16_t* values = writer.beginSample(cursor.getTime());
+        memcpy(values, cursor.getValues(), size);
+        writer.endSample();
+    }
+    return writer.close();
+}
+
+int main(int argc, const char* argv[]) {
+    const char* path = nullptr;
+    const char* reducePath = nullptr;
+    bool samples = false;
+    double tolerance = kDefaultTolerance;
+    std::vector<std::pair<const char*, double>> joints;
+    PDClip::Encoding encoding = PDClip::kDelta;
+    for (int argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "-samples") == 0) {
+            samples = true;
+        } else if (strcmp(argv[argi], "-reduce") == 0 && argi + 1 < argc) {
+            reducePath = argv[++argi];
+        } else if (strcmp(argv[argi], "-tolerance") == 0 && argi + 1 < argc) {
+            tolerance = atof(argv[++argi]);
+        } else if (strcmp(argv[argi], "-joint") == 0 && argi + 1 < argc && strchr(argv[argi + 1], '=') != nullptr) {
+            const char* joint = argv[++argi];
+            joints.push_back({ joint, atof(strchr(joint, '=') + 1) });
+        } else if (strcmp(argv[argi], "-raw") == 0) {
+            encoding = PDClip::kRaw;
+        } else if (strcmp(argv[argi], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[argi][0] != '-' && path == nullptr) {
+            path = argv[argi];
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[argi]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (path == nullptr) {
+        usage(argv[0]);
+        return 1;
+    }
+    PDClip clip;
+    if (!clip.open(path)) {
+        return 1;
+    }
+    if (reducePath == nullptr) {
+        clip.print(stdout, samples);
+        return 0;
+    }
+    double tolerances[PDClip::kMaxJoints];
+    for (unsigned j = 0; j < clip.numberOfJoints(); j++) {
+        tolerances[j] = tolerance;
+    }
+    for (auto& joint : joints) {
+        std::string name(joint.first, strchr(joint.first, '=') - joint.first);
+        int index = clip.findJoint(name.c_str());
+        if (index == -1) {
+            fprintf(stderr, "No joint %s in %s\n", name.c_str(), path);
+            return 1;
+        }
+        tolerances[index] = joint.second;
+    }
+    std::vector<uint64_t> keyframes = PDClipReducer::reduce(clip, tolerances);
+    if (!write(clip, keyframes, reducePath, encoding)) {
+        return 1;
+    }
+    PDClip reduced;
+    if (!reduced.open(reducePath)) {
+        return 1;
+    }
+    printf("%s: %llu samples, %llu bytes\n", path,
+        (unsigned long long)clip.numberOfSamples(), (unsigned long long)clip.getSamplesSize());
+    printf("%s: %llu keyframes, %llu bytes\n", reducePath,
+        (unsigned long long)reduced.numberOfSamples(), (unsigned long long)reduced.getSamplesSize());
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "PDStateExport.h"
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Show the joint state published by puddle -export.\n\n");
+    fprintf(stderr, "usage: %s [-name segment] [-rate hz] [-csv] [-once]\n", argv0);
+    fprintf(stderr, "  -name segment  Shared memory segment (default %s)\n", PDStateExport::kDefaultName);
+    fprintf(stderr, "  -rate hz       Updates per second (default 10)\n");
+    fprintf(stderr, "  -csv           One line per joint per update for loggers\n");
+    fprintf(stderr, "  -once          Print a single snapshot and exit\n");
+}
+
+static void printTable(const PDStateExport::Snapshot& snapshot, bool clear) {
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+    printf("cycle %llu  time %.3f s\n\n",
+        (unsigned long long)snapshot.fCycle, snapshot.fTime / 1e9);
+    printf("%-3s %-18s %9s %9s %6s %8s %8s %5s %5s %6s %6s %s\n",
+        "id", "joint", "command", "degrees", "pos", "dq", "tau", "temp", "err", "force", "miss", "flags");
+    for (unsigned i = 0; i < snapshot.fNumJoints; i++) {
+        const PDStateExport::Joint& joint = snapshot.fJoints[i];
+        printf("%-3u %-18.*s %9.2f %9.2f %6.3f %8.3f %8.3f %5d %5d %6d %6u %s%s%s\n",
+            joint.fID, int(sizeof(joint.fName)), joint.fName,
+            joint.fCommanded, joint.fDegrees, joint.fPosition,
+            joint.fDQ, joint.fTau, joint.fTemperature, joint.fError, joint.fFootForce,
+            joint.fMissCount,
+            joint.fActive ? "A" : "-", joint.fMoving ? "M" : "-", joint.fIgnore ? "I" : "-");
+    }
+    fflush(stdout);
+}
+
+static void printCSV(const PDStateExport::Snapshot& snapshot) {
+    for (unsigned i = 0; i < snapshot.fNumJoints; i++) {
+        const PDStateExport::Joint& joint = snapshot.fJoints[i];
+        printf("%llu,%llu,%.*s,%u,%f,%f,%f,%f,%f,%d,%d,%d,%u,%u,%u,%u\n",
+            (unsigned long long)snapshot.fTime, (unsigned long long)snapshot.fCycle,
+            int(sizeof(joint.fName)), joint.fName, joint.fID,
+            joint.fCommanded, joint.fDegrees, joint.fPosition, joint.fDQ, joint.fTau,
+            joint.fTemperature, joint.fError, joint.fFootForce,
+            joint.fMissCount, joint.fErrorCount, joint.fActive, joint.fIgnore);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, const char* argv[]) {
+    const char* name = PDStateExport::kDefaultName;
+    unsigned rate = 10;
+    bool csv = false;
+    bool once = false;
+    for (int argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "-name") == 0 && argi + 1 < argc) {
+            name = argv[++argi];
+        } else if (strcmp(argv[argi], "-rate") == 0 && argi + 1 < argc) {
+            rate = std::max(1, atoi(argv[++argi]));
+        } else if (strcmp(argv[argi], "-csv") == 0) {
+            csv = true;
+        } else if (strcmp(argv[argi], "-once") == 0) {
+            once = true;
+        } else if (strcmp(argv[argi], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[argi]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    PDStateExport state;
+    if (!state.attach(name)) {
+        return 1;
+    }
+    if (csv) {
+        printf("time,cycle,joint,id,commanded,degrees,position,dq,tau,temperature,error,foot_force,miss,errors,active,ignore\n");
+    }
+    uint64_t lastCycle = ~0ull;
+    PDStateExport::Snapshot snapshot;
+    for (;;) {
+        if (!state.read(snapshot)) {
+            fprintf(stderr, "Could not read a consistent snapshot\n");
+        } else if (snapshot.fCycle != lastCycle) {
+            lastCycle = snapshot.fCycle;
+            if (csv) {
+                printCSV(snapshot);
+            } else {
+                printTable(snapshot, !once);
+            }
+        }
+        if (once) {
+            break;
+        }
+        usleep(1000000 / rate);
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <string>
+#include "PDTrace.h"
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Decode a trace file written by puddle -trace.\n\n");
+    fprintf(stderr, "usage: %s [trace file]\n", argv0);
+    fprintf(stderr, "ex:    %s /tmp/puddle.trace\n", argv0);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2 || strcmp(argv[1], "-h") == 0) {
+        usage(argv[0]);
+        return (argc == 2) ? 0 : 1;
+    }
+    PDTrace& trace = PDTrace::trace();
+    if (!trace.load(argv[1])) {
+        return 1;
+    }
+    unsigned count = trace.drain(stdout);
+    fprintf(stderr, "%u events, %llu lost\n", count, (unsigned long long)trace.getLost());
+    return 0;
+}
@@ -1,20 +1,27 @@
 #include "PDRobot.h"
 #include "PDPlayback.h"
+#include "PDBakedPlayback.h"
+#include "PDRecording.h"
 #include "PDRobot.h"
+#include "PDControlLoop.h"
+#include <atomic>
+#include <thread>
 
 /////////////////////////////////////////////
 
 static PDRobot* sActiveRobot;
+static volatile sig_atomic_t sStop = 0;
+
+// Only async signal safe calls in here. The motors are braked right away and
+// the keyboard loop shuts down normally once it sees sStop.
 static void Handler(int signo)
 {
-    //System Exit
-    printf("\r\nHandler:Program stop\r\n"); 
-    setNonCanonicalMode(false);
-
+    int savedErrno = errno;
     if (sActiveRobot != nullptr) {
-        sActiveRobot->relax();
+        sActiveRobot->getWatchdog().brake();
     }
-    exit(0);
+    sStop = 1;
+    errno = savedErrno;
 }
 
 bool saveConfiguration() {
@@ -40,18 +47,221 @@ bool loadConfiguration() {
     return true;
 }
 
+// Recording and playback run on the control thread. The application
+// starts and stops them with PDRobot::Command::call() and opens and closes
+// the clip file in between, while neither is running.
+struct Motion {
+    Motion(const PDJointRegistry& joints, const char* path, const char* bakePath) :
+        joints(joints),
+        recording(joints),
+        path(path),
+        bakePath(bakePath)
+    {
+    }
+
+    // Control thread, after PDRobot::update()
+    void update(uint64_t watchdogTrips) {
+        if (watchdogTrips != trips) {
+            // The motors were braked, a stall is not part of the take.
+            // The players end on their own as the robot relaxes.
+            trips = watchdogTrips;
+            recording.stop();
+        }
+        if (recording.update()) {
+            /* recording motion */
+        } else if (player.update()) {
+            /* playback */
+        } else if (bakedPlayer.update()) {
+            /* baked playback */
+        }
+    }
+
+    // Application thread
+    void record(PDRobot& robot) {
+        robot.post(PDRobot::Command::call(stopPlayback, this));
+        robot.sync();
+        recording.close();
+        clip.close();
+        success = recording.open(path);
+        if (success) {
+            robot.post(PDRobot::Command::call(startRecording, this));
+            robot.sync();
+        }
+    }
+
+    void play(PDRobot& robot) {
+        robot.post(PDRobot::Command::call(stopRecording, this));
+        robot.sync();
+        recording.close();
+        success = clip.open(path) && player.load(clip, joints);
+        if (success) {
+            robot.post(PDRobot::Command::call(startPlayback, this));
+            robot.sync();
+        }
+    }
+
+    // Render the clip to command frames with the current ranges and gains
+    // and play those
+    void bake(PDRobot& robot) {
+        robot.post(PDRobot::Command::call(stopRecording, this));
+        robot.sync();
+        recording.close();
+        baked.close();
+        uint64_t start = currentTimeNanos();
+        success = clip.open(path) &&
+            PDBakedClip::bake(bakePath, clip, joints, player.getLookahead()) &&
+            baked.open(bakePath) && bakedPlayer.load(baked, joints);
+        bakeTime = currentTimeNanos() - start;
+        if (success) {
+            robot.post(PDRobot::Command::call(startBakedPlayback, this));
+            robot.sync();
+        }
+    }
+
+    static void stopPlayback(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->stopped = motion->player.stop();
+        motion->stopped |= motion->bakedPlayer.stop();
+        motion->recording.stop();
+    }
+
+    static void startRecording(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->success = motion->recording.start();
+    }
+
+    static void stopRecording(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->stopped = motion->recording.stop();
+        motion->player.stop();
+        motion->bakedPlayer.stop();
+    }
+
+    static void startPlayback(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->success = motion->player.start();
+    }
+
+    static void startBakedPlayback(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->success = motion->bakedPlayer.start();
+    }
+
+    static void faster(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->player.setSpeed(motion->player.getSpeed() + 0.25);
+    }
+
+    static void slower(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->player.setSpeed(motion->player.getSpeed() - 0.25);
+    }
+
+    static void stop(void* arg) {
+        Motion* motion = (Motion*)arg;
+        motion->player.stop();
+        motion->bakedPlayer.stop();
+        motion->recording.stop();
+    }
+
+    const PDJointRegistry& joints;
+    PDRecording recording;
+    PDPlayback player;
+    PDBakedPlayback bakedPlayer;
+    PDClip clip;
+    PDBakedClip baked;
+    const char* path;
+    const char* bakePath;
+    uint64_t bakeTime = 0;
+    uint64_t trips = 0;
+    bool success = false;
+    bool stopped = false;
+};
+
+// Copy of the control loop statistics taken on the control thread
+struct LoopReport {
+    LoopReport(const PDControlLoop& loop) :
+        fLoop(loop)
+    {
+    }
+
+    static void copy(void* arg) {
+        LoopReport* report = (LoopReport*)arg;
+        report->fSnapshot = report->fLoop;
+    }
+
+    const PDControlLoop& fLoop;
+    PDControlLoop fSnapshot;
+};
+
+static void updateJointRange(void* arg) {
+    ((PDRobot*)arg)->updateJointRange(sRobotConfig);
+}
+
 static void usage(const char* argv0) {
-    fprintf(stderr, "Usage:\n%s: [-v] [-v:pos] [-v:move] [-v:motor] [-f] [-h]\n", argv0);
+    fprintf(stderr, "Usage:\n%s: [-v] [-v:pos] [-v:move] [-v:motor] [-trace file] [-f] [-scan] [-rate hz] [-watchdog ms] [-export name] [-clip file] [-bake file] [-samplerate hz] [-tolerance x] [-speed x] [-lookahead ms] [-rt] [-cpu n] [-h]\n", argv0);
+    fprintf(stderr, "  -trace f  Write -v:pos/-v:move/-v:motor events to trace file f (decode with pdtrace)\n");
+    fprintf(stderr, "  -scan     Probe every motor ID at startup and list the ones that answer\n");
+    fprintf(stderr, "  -rate hz  Control loop rate (default 500)\n");
+    fprintf(stderr, "  -watchdog ms  Brake all motors if the control loop stalls for ms (default 50, 0 to disable)\n");
+    fprintf(stderr, "  -export name  Publish joint state to shared memory segment name, e.g. /puddle.state (see pdmonitor)\n");
+    fprintf(stderr, "  -clip file  Motion clip written by 'r' and played by 'p' (default motion.clip)\n");
+    fprintf(stderr, "  -bake file  Command frames rendered from the clip by 'b' (default motion.bake)\n");
+    fprintf(stderr, "  -samplerate hz  Clip samples per second when recording (default 100, at most 1000)\n");
+    fprintf(stderr, "  -tolerance x  Record only keyframes within x (0-1 of each joint's range) of the motion\n");
+    fprintf(stderr, "  -speed x  Play clips at x times the recorded speed, 0.5-2 (keys + and - change it)\n");
+    fprintf(stderr, "  -lookahead ms  Command each clip pose ms early to make up for motor lag\n");
+    fprintf(stderr, "  -rt       Run the control loop SCHED_FIFO with memory locked\n");
+    fprintf(stderr, "  -cpu n    Pin the control loop to CPU n\n");
 }
 
 int main(int argc, const char* argv[]) {
     int pos = 0;
     bool forceContinue = false;
+    bool scanAll = false;
+    int watchdogTimeout = PDWatchdog::kDefaultTimeout;
+    const char* exportName = nullptr;
+    const char* clipPath = "motion.clip";
+    const char* bakePath = "motion.bake";
+    unsigned sampleRate = PDRecording::kDefaultRate;
+    double tolerance = 0;
+    double speed = 1.0;
+    int lookahead = 0;
+    bool realtime = false;
+    int cpu = -1;
+    const char* tracePath = nullptr;
+    PDControlLoop loop;
     for (int argi = 1; argi < argc; argi++) {
         if (strncmp(argv[argi], "-v", 2) == 0 && PDLog::log().parse(argv[argi])) {
             /* Do nothing */
+        } else if (strcmp(argv[argi], "-trace") == 0 && argi + 1 < argc) {
+            tracePath = argv[++argi];
         } else if (strcmp(argv[argi], "-f") == 0) {
             forceContinue = true;
+        } else if (strcmp(argv[argi], "-scan") == 0) {
+            scanAll = true;
+        } else if (strcmp(argv[argi], "-rate") == 0 && argi + 1 < argc) {
+            loop.setRate(atoi(argv[++argi]));
+        } else if (strcmp(argv[argi], "-watchdog") == 0 && argi + 1 < argc) {
+            watchdogTimeout = atoi(argv[++argi]);
+        } else if (strcmp(argv[argi], "-export") == 0 && argi + 1 < argc) {
+            exportName = argv[++argi];
+        } else if (strcmp(argv[argi], "-clip") == 0 && argi + 1 < argc) {
+            clipPath = argv[++argi];
+        } else if (strcmp(argv[argi], "-bake") == 0 && argi + 1 < argc) {
+            bakePath = argv[++argi];
+        } else if (strcmp(argv[argi], "-samplerate") == 0 && argi + 1 < argc) {
+            sampleRate = std::max(1, atoi(argv[++argi]));
+        } else if (strcmp(argv[argi], "-tolerance") == 0 && argi + 1 < argc) {
+            tolerance = atof(argv[++argi]);
+        } else if (strcmp(argv[argi], "-speed") == 0 && argi + 1 < argc) {
+            speed = atof(argv[++argi]);
+        } else if (strcmp(argv[argi], "-lookahead") == 0 && argi + 1 < argc) {
+            lookahead = atoi(argv[++argi]);
+        } else if (strcmp(argv[argi], "-rt") == 0) {
+            realtime = true;
+        } else if (strcmp(argv[argi], "-cpu") == 0 && argi + 1 < argc) {
+            cpu = atoi(argv[++argi]);
         } else if (strcmp(argv[argi], "-h") == 0) {
             usage(argv[0]);
             return 0;
@@ -61,104 +271,215 @@ int main(int argc, const char* argv[]) {
             return 1;
         }
     }
+    // Verbose motor, move and position output goes through the trace buffer.
+    // Without a trace file it is printed live from the application thread.
+    if (tracePath != nullptr) {
+        if (!PDLog::isVerboseMotor() && !PDLog::isVerboseMove() && !PDLog::isVerbosePosition()) {
+            PDLog::log().parse("-v:motor");
+            PDLog::log().parse("-v:move");
+            PDLog::log().parse("-v:pos");
+        }
+        if (!PDTrace::trace().open(tracePath, 65536)) {
+            return 1;
+        }
+    } else if (PDLog::isVerboseMotor() || PDLog::isVerboseMove() || PDLog::isVerbosePosition()) {
+        PDTrace::trace().open();
+    }
+    bool printTrace = (tracePath == nullptr && PDTrace::trace().isOpen());
+
     if (!loadConfiguration()) {
         return 1;
     }
 
     PDRobot robot(sRobotConfig);
-    if (robot.init(forceContinue)) {
-        fprintf(stderr, "FORCE CONTINUE EVEN THOUGH MOTORS ARE MISSING\n");
-    } else {
+    robot.setControlRate(loop.getRate());
+    if (PDLog::isVerbose()) {
+        for (unsigned i = 0; i < robot.getJoints().numberOfGroups(); i++) {
+            auto& group = robot.getJoints().getGroup(i);
+            auto& scheduler = group.getScheduler();
+            printf("[%s] frames per cycle: peak %u, average %.2f\n",
+                group.getBus()->getName(), scheduler.getPeakLoad(), scheduler.getAverageLoad());
+        }
+    }
+    if (!robot.init(forceContinue, scanAll)) {
         return 1;
     }
+    if (scanAll || PDLog::isVerbose()) {
+        robot.getDiscovery().print(stdout);
+        printf("Discovery took %.1f ms\n", robot.getDiscovery().getElapsed() / 1e6);
+    }
     robot.checkRanges();
 
     sActiveRobot = &robot;
-    signal(SIGINT, Handler);
+    if (exportName != nullptr && !robot.exportState(exportName)) {
+        return 1;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = Handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    if (watchdogTimeout > 0) {
+        // Above the control loop's SCHED_FIFO priority so it still runs if the loop spins
+        robot.startWatchdog(watchdogTimeout, realtime ? 90 : 0);
+    }
     setNonCanonicalMode(true);
     bool quit = false;
     bool firstTime = true;
 
     PDLeg::Pose leftPose;
     PDLeg::Pose rightPose;
-    PDPlayback player;
-    PDRecording recording(robot.left);
-    while (!quit) {
-        robot.update();
+    Motion motion(robot.getJoints(), clipPath, bakePath);
+    motion.recording.setRate(sampleRate);
+    motion.recording.setTolerance(tolerance);
+    motion.recording.setChannels(PDClip::kAllChannels);
+    motion.recording.setEncoding(PDClip::kDelta);
+    motion.player.setSpeed(speed);
+    motion.player.setLookahead(std::max(lookahead, 0));
+    LoopReport loopReport(loop);
 
-        uint64_t now = currentTimeMillis();
-        if (recording.update()) {
-            /* recording motion */
-        } else if (player.update()) {
-            /* playback */
+    // The control loop runs on its own thread. Everything below talks to it
+    // through PDRobot::post() and PDRobot::getState() and never blocks it.
+    std::atomic<bool> running(true);
+    std::thread control([&]() {
+        if (realtime) {
+            loop.setRealtime();
         }
-        switch (readKeyIfAvailable()) {
+        if (cpu >= 0) {
+            loop.setCPU(cpu);
+        }
+        loop.start();
+        while (running.load(std::memory_order_relaxed)) {
+            robot.update(PDCycleClock::tick(loop.wait()));
+            motion.update(robot.getWatchdogTrips());
+        }
+    });
+
+    uint64_t watchdogTrips = 0;
+    while (!quit) {
+        if (sStop) {
+            printf("\r\nHandler:Program stop\r\n");
+            break;
+        }
+        const PDRobot::State& state = robot.getState();
+        if (state.fWatchdogTrips != watchdogTrips) {
+            watchdogTrips = state.fWatchdogTrips;
+            printf("WATCHDOG BRAKED ALL MOTORS (%.1f ms late)\n", robot.getWatchdog().getLastLatency() / 1e6);
+        }
+        int key = readKeyIfAvailable();
+        switch (key) {
             case 'q':
                 printf("QUIT\n");
                 quit = true;
                 break;
             case 'a':
                 printf("STAND\n");
-                robot.stand();
+                robot.post(PDRobot::Command::stand());
                 break;
             case 'c':
-                robot.updateJointRange(sRobotConfig);
+                robot.post(PDRobot::Command::call(updateJointRange, &robot));
+                robot.sync();
                 saveConfiguration();
                 loadConfiguration();
                 break;
             case 'p':
-                recording.dump();
-                if (recording.stop()) {
+                motion.play(robot);
+                if (motion.stopped) {
                     printf("STOPPED RECORDING\n");
                 }
-                player.loadSamples(recording);
-                if (!player.start()) {
+                if (!motion.success) {
                     printf("NO RECORDING\n");
+                } else {
+                    printf("PLAYING %s: ", motion.path);
+                    motion.clip.print(stdout, PDLog::isVerbose());
+                }
+                break;
+            case 'b':
+                motion.bake(robot);
+                if (motion.stopped) {
+                    printf("STOPPED RECORDING\n");
+                }
+                if (!motion.success) {
+                    printf("NO BAKED RECORDING\n");
+                } else {
+                    printf("PLAYING %s baked in %.1f ms: ", motion.bakePath, motion.bakeTime / 1e6);
+                    motion.baked.print(stdout);
                 }
                 break;
             case 'r':
-                if (player.isPlaying()) {
-                    player.stop();
+                motion.record(robot);
+                if (motion.stopped) {
                     printf("STOPPED PLAYBACK\n");
                 }
-                if (recording.start()) {
+                if (motion.success) {
                     printf("RECORDING\n");
                 }
                 break;
+            case '+':
+            case '-':
+                robot.post(PDRobot::Command::call((key == '+') ? Motion::faster : Motion::slower, &motion));
+                robot.sync();
+                printf("PLAYBACK SPEED %.2fx\n", motion.player.getSpeed());
+                break;
+            case 'j':
+                robot.post(PDRobot::Command::call(LoopReport::copy, &loopReport));
+                robot.sync();
+                loopReport.fSnapshot.report();
+                break;
+            case 'm':
+                robot.printBusStats(stdout);
+                break;
             case 'z':
                 printf("MOVE ANKLE\n");
-                robot.left.fAnklePitch.moveToPosition(0, 4000, 1.0);
+                robot.post(PDRobot::Command::moveToPosition(robot.left.fAnklePitch, 0, 4000, 1.0));
                 break;
             case 'x':
                 printf("MOVE ANKLE\n");
-                robot.left.fAnklePitch.moveToPosition(0, 4000, 0);
+                robot.post(PDRobot::Command::moveToPosition(robot.left.fAnklePitch, 0, 4000, 0));
                 break;
             case 's':
                 if (firstTime) {
                     printf("STAND FOR 30 SECONDS\n");
-                    robot.left.getPose(leftPose);
-                    robot.right.getPose(rightPose);
-                    robot.left.stand();
-                    robot.right.stand();
+                    const PDRobot::State& state = robot.getState();
+                    PDRobot::State::getPose(state.fLeft, leftPose);
+                    PDRobot::State::getPose(state.fRight, rightPose);
+                    robot.post(PDRobot::Command::stand(&robot.left));
+                    robot.post(PDRobot::Command::stand(&robot.right));
                     firstTime = false;
                 } else {
                     printf("STAND FOR 30 SECONDS\n");
-                    robot.left.setPose(leftPose, 2000);
-                    robot.right.setPose(rightPose, 2000);
+                    robot.post(PDRobot::Command::setPose(robot.left, leftPose, 2000));
+                    robot.post(PDRobot::Command::setPose(robot.right, rightPose, 2000));
                 }
                 break;
             case -1:
                 break;
             default:
                 printf("RELAX\n");
-                robot.relax();
-                player.stop();
-                recording.stop();
+                robot.post(PDRobot::Command::relax());
+                robot.post(PDRobot::Command::call(Motion::stop, &motion));
                 break;
         }
+        if (printTrace) {
+            PDTrace::trace().drain(stdout);
+        }
+        // The application side runs at its own pace
+        usleep(10000);
     }
+    running = false;
+    control.join();
     robot.relax();
     robot.update();
+    robot.stopWatchdog();
+    motion.recording.close();
     setNonCanonicalMode(false);
+    if (printTrace) {
+        PDTrace::trace().drain(stdout);
+    }
+    if (PDTrace::trace().getLost() != 0) {
+        fprintf(stderr, "%llu trace events lost\n", (unsigned long long)PDTrace::trace().getLost());
+    }
+    loop.report();
+    robot.printBusStats(stdout);
     return 0;
 }
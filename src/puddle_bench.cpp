@@ -0,0 +1,779 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <atomic>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "PDRobot.h"
+#include "PDGoMotorSim.h"
+#include "PDClip.h"
+#include "PDPlayback.h"
+#include "PDBakedPlayback.h"
+
+// Microbenchmarks for the control loop hot paths. Every benchmark is run
+// with a doubling iteration count until it takes at least the minimum time
+// and reports nanoseconds and CPU cycles (TSC or virtual counter ticks) per
+// operation. Operations that produce or consume a frame are per frame.
+
+static inline uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#else
+    return 0;
+#endif
+}
+
+// Keep the compiler from optimizing away a result
+template <typename T>
+static inline void doNotOptimize(T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Bench {
+    const char* fFilter = nullptr;
+    uint64_t    fMinTime = 200000000;
+
+    // body(n) runs the operation n times
+    template <typename Body>
+    void run(const char* name, const char* unit, Body&& body) {
+        if (fFilter != nullptr && strstr(name, fFilter) == nullptr) {
+            return;
+        }
+        body(100);
+        uint64_t iterations = 1000;
+        for (;;) {
+            uint64_t startTime = currentTimeNanos();
+            uint64_t startCycles = readCycles();
+            body(iterations);
+            uint64_t cycles = readCycles() - startCycles;
+            uint64_t elapsed = currentTimeNanos() - startTime;
+            if (elapsed >= fMinTime || iterations >= (1ull << 40)) {
+                printf("%-36s %10.1f ns/%-6s %10.1f cycles/%-6s %12llu\n", name,
+                    double(elapsed) / double(iterations), unit,
+                    double(cycles) / double(iterations), unit,
+                    (unsigned long long)iterations);
+                fflush(stdout);
+                return;
+            }
+            iterations *= 2;
+        }
+    }
+};
+
+static void benchCommand(Bench& bench) {
+    PDGoMotorCmd cmd;
+    cmd.setMotorID(1);
+    cmd.setFOCMode();
+    bench.run("cmd.setQ", "op", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            cmd.setQ(float(i & 1023) * 0.001f);
+            doNotOptimize(cmd);
+        }
+    });
+    bench.run("cmd.setKP", "op", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            cmd.setKP(float(i & 1023) * 0.01f);
+            doNotOptimize(cmd);
+        }
+    });
+    bench.run("cmd.setKD", "op", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            cmd.setKD(float(i & 1023) * 0.001f);
+            doNotOptimize(cmd);
+        }
+    });
+    bench.run("cmd.setTau", "op", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            cmd.setTau(float(i & 1023) * 0.01f);
+            doNotOptimize(cmd);
+        }
+    });
+    bench.run("cmd.setDQ", "op", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            cmd.setDQ(float(i & 1023) * 0.01f);
+            doNotOptimize(cmd);
+        }
+    });
+    for (int version = 1; version <= 2; version++) {
+        PDGoMotorCRC motorCRC;
+        motorCRC.setVersion(version);
+        bench.run((version == 1) ? "cmd.encode v1" : "cmd.encode v2", "frame", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                cmd.setQ(float(i & 1023) * 0.001f);
+                cmd.encode(motorCRC);
+                doNotOptimize(cmd);
+            }
+        });
+    }
+}
+
+static void benchFeedback(Bench& bench) {
+    for (int version = 1; version <= 2; version++) {
+        PDGoMotorCRC motorCRC;
+        motorCRC.setVersion(version);
+        PDGoMotorFeedback reply;
+        reply.setModeID(1, 3);
+        reply.setQ(1.5);
+        reply.setDQ(0.25);
+        reply.setTau(0.5);
+        reply.setTemperature(30);
+        reply.encode(motorCRC);
+        PDGoMotorFeedback feedback;
+        bench.run((version == 1) ? "feedback.decode v1" : "feedback.decode v2", "frame", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                feedback.decode(reply.fBytes, motorCRC);
+                float q = feedback.getQ();
+                doNotOptimize(q);
+            }
+        });
+    }
+}
+
+static void benchCRC(Bench& bench) {
+    static const char* sNames[2][4] = {
+        { "crc v1 bytewise", "crc v1 sliced", "crc v1 batch x16", "crc v1 feedback" },
+        { "crc v2 bytewise", "crc v2 sliced", "crc v2 batch x16", "crc v2 feedback" }
+    };
+    for (int version = 1; version <= 2; version++) {
+        const char** names = sNames[version - 1];
+        PDGoMotorCRC motorCRC;
+        motorCRC.setVersion(version);
+        // Encoded frames, checksummed from the payload after the 2 byte header.
+        // The first payload byte changes every time so nothing is hoisted.
+        uint8_t frames[16][PDGoMotorCmd::kFrameSize];
+        for (uint8_t id = 0; id < 16; id++) {
+            PDGoMotorCmd cmd;
+            cmd.setMotorID(id);
+            cmd.setFOCMode();
+            memcpy(frames[id], cmd.getFrame(motorCRC), sizeof(frames[id]));
+        }
+        uint8_t* payload = &frames[0][2];
+        bench.run(names[0], "frame", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                payload[0] = uint8_t(i);
+                uint16_t crc = motorCRC.crcBytewise(payload, PDGoMotorCmd::kPayloadSize, 0xEE);
+                doNotOptimize(crc);
+            }
+        });
+        bench.run(names[1], "frame", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                payload[0] = uint8_t(i);
+                uint16_t crc = motorCRC.crc(payload, PDGoMotorCmd::kPayloadSize, 0xEE);
+                doNotOptimize(crc);
+            }
+        });
+        // One bus cycle worth of command frames per call, reported per frame
+        bench.run(names[2], "frame", [&](uint64_t n) {
+            uint16_t crc[16];
+            for (uint64_t i = 0; i < n; i += 16) {
+                payload[0] = uint8_t(i);
+                motorCRC.crc(payload, PDGoMotorCmd::kFrameSize, 16, PDGoMotorCmd::kPayloadSize, crc, 0xEE);
+                doNotOptimize(crc);
+            }
+        });
+        PDGoMotorFeedback feedback;
+        feedback.setModeID(1, 3);
+        bench.run(names[3], "frame", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                feedback.cmd.fTemp = uint8_t(i);
+                uint16_t crc = motorCRC.crc(&feedback.cmd, sizeof(feedback.cmd));
+                doNotOptimize(crc);
+            }
+        });
+    }
+}
+
+static void benchEasing(Bench& bench) {
+    static const struct {
+        const char* fName;
+        unsigned    fMethod;
+    } sMethods[] = {
+        { "easing.Linear", Easing::kLinearInterpolation },
+        { "easing.QuadraticInOut", Easing::kQuadraticEaseInOut },
+        { "easing.CubicInOut", Easing::kCubicEaseInOut },
+        { "easing.SineInOut", Easing::kSineEaseInOut },
+        { "easing.ExponentialInOut", Easing::kExponentialEaseInOut },
+        { "easing.ElasticInOut", Easing::kElasticEaseInOut },
+        { "easing.BounceInOut", Easing::kBounceEaseInOut }
+    };
+    for (auto& method : sMethods) {
+        Easing::Method easing = Easing::get(method.fMethod);
+        bench.run(method.fName, "op", [&](uint64_t n) {
+            double sum = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                sum += easing(double(i & 1023) / 1023.0);
+            }
+            doNotOptimize(sum);
+        });
+    }
+}
+
+static void benchActuator(Bench& bench) {
+    PDGoActuator actuator(1, "bench");
+    actuator.setRange(-90, 90);
+    actuator.stiff();
+    uint64_t now = PDCycleClock::fromMillis(1000);
+    bench.run("actuator.move", "op", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            if (!actuator.isMoving()) {
+                PDCycleClock::tick(now);
+                actuator.moveToDegrees(0, 1000, (i & 1) ? 45 : -45);
+            }
+            now += 2000000;
+            actuator.move(now);
+            doNotOptimize(actuator);
+        }
+    });
+    PDGoMotorCmd cmd;
+    PDGoMotorFeedback feedback;
+    bench.run("actuator.update (cmd)", "frame", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            if (!actuator.isMoving()) {
+                PDCycleClock::tick(now);
+                actuator.moveToDegrees(0, 1000, (i & 1) ? 45 : -45);
+            }
+            now += 2000000;
+            actuator.update(cmd, feedback, now);
+            doNotOptimize(cmd);
+        }
+    });
+    PDGoMotorCRC motorCRC;
+    bench.run("actuator.update + encode", "frame", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            if (!actuator.isMoving()) {
+                PDCycleClock::tick(now);
+                actuator.moveToDegrees(0, 1000, (i & 1) ? 45 : -45);
+            }
+            now += 2000000;
+            actuator.update(cmd, feedback, now);
+            cmd.encode(motorCRC);
+            doNotOptimize(cmd);
+        }
+    });
+    bench.run("actuator.update + encode (holding)", "frame", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            now += 2000000;
+            actuator.update(cmd, feedback, now);
+            cmd.encode(motorCRC);
+            doNotOptimize(cmd);
+        }
+    });
+}
+
+// One cycle of shared memory state export for a robot with eleven joints
+static void benchStateExport(Bench& bench) {
+    const unsigned kJoints = 11;
+    char name[64];
+    snprintf(name, sizeof(name), "/puddle_bench.%d", int(getpid()));
+    PDStateExport state;
+    if (!state.create(name)) {
+        return;
+    }
+    PDGoActuator actuator(1, "bench");
+    actuator.setRange(-90, 90);
+    for (unsigned i = 0; i < kJoints; i++) {
+        state.setJoint(i, "bench", actuator.getName(), i);
+    }
+    PDGoActuator::State joint;
+    bench.run("state export (11 joints)", "cycle", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            state.begin(i, i);
+            for (unsigned j = 0; j < kJoints; j++) {
+                actuator.getState(joint);
+                state.write(j, joint);
+            }
+            state.end();
+        }
+    });
+}
+
+// Cost of one latency sample as recorded by the bus thread
+static void benchHistogram(Bench& bench) {
+    static PDHistogram histogram;
+    bench.run("histogram.record", "op", [&](uint64_t n) {
+        uint64_t value = 100000;
+        for (uint64_t i = 0; i < n; i++) {
+            histogram.record(value);
+            value = (value * 1103515245 + 12345) & 0xFFFFF;
+        }
+    });
+}
+
+// Random seeks in a one minute, 1 kHz clip and decoding it in order, raw
+// and delta encoded
+static void benchClip(Bench& bench, PDClip::Encoding encoding) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/puddle_bench.%d.clip", int(getpid()));
+    const char* names[PDLeg::kNumActuators] = { "a", "b", "c", "d", "e" };
+    uint8_t ids[PDLeg::kNumActuators] = { 1, 2, 3, 4, 5 };
+    const uint32_t kSamples = 60000;
+    PDClipWriter writer;
+    writer.setEncoding(encoding);
+    if (!writer.open(path, PDLeg::kNumActuators, names, ids)) {
+        return;
+    }
+    for (uint32_t i = 0; i < kSamples; i++) {
+        double positions[PDLeg::kNumActuators] = { i / double(kSamples), 0.1, 0.2, 0.3, 0.4 };
+        writer.add(i, positions);
+    }
+    writer.close();
+    PDClip clip;
+    if (!clip.open(path)) {
+        unlink(path);
+        return;
+    }
+    unlink(path);
+    const char* name = (encoding == PDClip::kDelta) ? "delta" : "raw";
+    char label[32];
+    snprintf(label, sizeof(label), "clip.seek.%s", name);
+    uint64_t sum = 0;
+    bench.run(label, "op", [&](uint64_t n) {
+        uint32_t time = 12345;
+        for (uint64_t i = 0; i < n; i++) {
+            sum += clip.seek(time);
+            time = (time * 1103515245 + 12345) % kSamples;
+        }
+    });
+    snprintf(label, sizeof(label), "clip.next.%s", name);
+    PDClip::Cursor cursor;
+    cursor.seek(clip, 0);
+    bench.run(label, "sample", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            if (!cursor.next()) {
+                cursor.seek(clip, 0);
+            }
+            sum += cursor.getValues()[0];
+        }
+    });
+    doNotOptimize(sum);
+    snprintf(label, sizeof(label), "clip.size.%s", name);
+    if (bench.fFilter == nullptr || strstr(label, bench.fFilter) != nullptr) {
+        printf("%-36s %10.1f bytes/sample\n", label, double(clip.getSamplesSize()) / clip.numberOfSamples());
+    }
+}
+
+// Streaming keyframe reduction of a slow, slightly noisy 5 joint motion
+static void benchReducer(Bench& bench) {
+    const size_t kSampleSize = PDClip::sampleSize(PDLeg::kNumActuators);
+    const unsigned kSamples = 4096;
+    std::vector<uint8_t> samples(kSamples * kSampleSize);
+    uint32_t noise = 1;
+    for (uint32_t i = 0; i < kSamples; i++) {
+        int16_t values[PDLeg::kNumActuators];
+        for (unsigned j = 0; j < PDLeg::kNumActuators; j++) {
+            noise = noise * 1103515245 + 12345;
+            values[j] = PDClip::quantize(0.5 + 0.3 * sin(i / 500.0 * (j + 1)) + ((noise >> 16) % 16) / 32767.0);
+        }
+        memcpy(&samples[i * kSampleSize], &i, sizeof(i));
+        memcpy(&samples[i * kSampleSize + sizeof(i)], values, sizeof(values));
+    }
+    double tolerance[PDLeg::kNumActuators] = { 0.001, 0.001, 0.001, 0.001, 0.001 };
+    PDClipReducer reducer;
+    reducer.reset(PDLeg::kNumActuators, 0, tolerance);
+    uint64_t kept = 0;
+    bench.run("clip.reduce", "sample", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            if (i % kSamples == 0) {
+                reducer.reset(PDLeg::kNumActuators, 0, tolerance);
+            }
+            kept += (reducer.add(&samples[(i % kSamples) * kSampleSize]) != nullptr);
+        }
+    });
+    doNotOptimize(kept);
+}
+
+// One control cycle of clip playback for two legs on one bus, up to the
+// frames that would be sent: interpolating a one minute clip and encoding
+// every joint's command, or pointing the bus at the baked frames
+static void benchPlayback(Bench& bench) {
+    char path[64];
+    char bakePath[64];
+    snprintf(path, sizeof(path), "/tmp/puddle_bench.%d.clip", int(getpid()));
+    snprintf(bakePath, sizeof(bakePath), "/tmp/puddle_bench.%d.bake", int(getpid()));
+    PDGoMotorBus bus("bench", -1);
+    PDLeg left("left", "bench");
+    PDLeg right("right", "bench");
+    PDJointRegistry joints;
+    char names[2 * PDLeg::kNumActuators][32];
+    const char* labels[2 * PDLeg::kNumActuators];
+    uint8_t ids[2 * PDLeg::kNumActuators];
+    for (unsigned i = 0; i < 2 * PDLeg::kNumActuators; i++) {
+        PDLeg& leg = (i < PDLeg::kNumActuators) ? left : right;
+        PDGoActuator& actuator = leg.fActuator[i % PDLeg::kNumActuators];
+        actuator.setRange(-90, 90);
+        joints.add(actuator, &bus, leg.getName());
+        snprintf(names[i], sizeof(names[i]), "%s.%s", leg.getName(), actuator.getName());
+        labels[i] = names[i];
+        ids[i] = actuator.getID();
+    }
+    joints.setControlRate(500);
+    PDJointGroup& group = joints.getGroup(0);
+
+    const uint32_t kSamples = 6000;
+    PDClipWriter writer;
+    writer.setEncoding(PDClip::kDelta);
+    if (!writer.open(path, 2 * PDLeg::kNumActuators, labels, ids)) {
+        return;
+    }
+    for (uint32_t i = 0; i < kSamples; i++) {
+        double positions[2 * PDLeg::kNumActuators];
+        for (unsigned j = 0; j < 2 * PDLeg::kNumActuators; j++) {
+            positions[j] = 0.5 + 0.4 * sin(i / 300.0 * (j + 1));
+        }
+        writer.add(i * 10, positions);
+    }
+    writer.close();
+    PDClip clip;
+    PDBakedClip baked;
+    uint64_t bakeStart = currentTimeNanos();
+    bool ok = clip.open(path) && PDBakedClip::bake(bakePath, clip, joints) && baked.open(bakePath);
+    uint64_t bakeTime = currentTimeNanos() - bakeStart;
+    unlink(path);
+    unlink(bakePath);
+    if (!ok) {
+        return;
+    }
+    if (bench.fFilter == nullptr || strstr("play.bake (render)", bench.fFilter) != nullptr) {
+        printf("%-36s %10.1f ns/%-6s %10.1f bytes/cycle\n", "play.bake (render)",
+            double(bakeTime) / baked.numberOfCycles(), "cycle", double(group.numberOfActuators() * PDBakedClip::kFrameSize));
+    }
+
+    PDPlayback player;
+    PDBakedPlayback bakedPlayer;
+    player.load(clip, joints);
+    bakedPlayer.load(baked, joints);
+    auto cycles = [&](auto& playback, uint64_t n) {
+        uint64_t now = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            if (!playback.isPlaying()) {
+                // Skip the lead-in
+                now = PDCycleClock::tick(currentTimeNanos());
+                playback.start();
+                now += PDCycleClock::fromMillis(PDPlayback::kLeadIn);
+            }
+            PDCycleClock::tick(now);
+            playback.update();
+            group.prepare(now);
+            now += 2000000;
+        }
+    };
+    bench.run("play.clip (10 joints)", "cycle", [&](uint64_t n) {
+        cycles(player, n);
+    });
+    player.stop();
+    bench.run("play.baked (10 joints)", "cycle", [&](uint64_t n) {
+        cycles(bakedPlayer, n);
+    });
+    bakedPlayer.stop();
+}
+
+// Full PDLeg::update against a simulated leg on the other end of a socketpair
+static void benchLeg(Bench& bench, bool pipelined) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return;
+    }
+    PDGoMotorSim sim(1);
+    for (uint8_t id = MOTOR_ID_ANKLE_PITCH; id <= MOTOR_ID_HIP_YAW; id++) {
+        sim.addMotor(id);
+    }
+    sim.setLatency(0);
+    sim.attach(sv[1]);
+    std::atomic<bool> running(true);
+    std::thread motors([&]() {
+        while (running.load(std::memory_order_relaxed) && sim.poll(10)) {
+        }
+    });
+
+    PDGoMotorBus bus("bench", sv[0]);
+    bus.setPipelined(pipelined);
+    PDLeg leg("left", "bench");
+    leg.setBus(&bus);
+    for (unsigned i = 0; i < leg.numberOfActuators(); i++) {
+        leg.fActuator[i].setRange(-90, 90);
+    }
+    leg.stand();
+    uint64_t now = PDCycleClock::tick();
+    bench.run(pipelined ? "leg.update loopback (pipelined)" : "leg.update loopback", "cycle", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            now += 2000000;
+            leg.update(now);
+        }
+    });
+
+    running = false;
+    motors.join();
+    ::close(sv[1]);
+}
+
+// Time from a missed watchdog deadline until the simulated motors have
+// received the brake frame. The control loop is emulated by feeding the
+// watchdog and then stopping.
+static void benchWatchdog(Bench& bench) {
+    const char* name = "watchdog reaction";
+    if (bench.fFilter != nullptr && strstr(name, bench.fFilter) == nullptr) {
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        return;
+    }
+    // Motor 1 only ever sees the broadcast brake. A torn frame also takes out
+    // the start of the next one, as on a motor that does not rescan.
+    PDGoMotorSim sim(1);
+    sim.addMotor(1);
+    sim.setStrictFraming(true);
+    sim.attach(sv[1]);
+    std::atomic<bool> running(true);
+    std::atomic<uint64_t> received(0);
+    std::thread motors([&]() {
+        unsigned count = sim.getMotor(1).fCommandCount;
+        while (running.load(std::memory_order_relaxed) && sim.poll(10)) {
+            if (sim.getMotor(1).fCommandCount != count) {
+                count = sim.getMotor(1).fCommandCount;
+                uint64_t none = 0;
+                received.compare_exchange_strong(none, currentTimeNanos(), std::memory_order_acq_rel);
+            }
+        }
+    });
+
+    // Keep a batch write in flight the whole time, as a bus thread would be
+    // if the control loop stalled after handing it a cycle. Frames go to an
+    // absent motor in 4 byte pieces paced like a 4 Mbaud UART, so a trip
+    // almost always lands inside a half-sent frame.
+    std::thread lane([&]() {
+        PDGoMotorCRC motorCRC;
+        motorCRC.setVersion(1);
+        uint8_t batch[16][PDGoMotorCmd::kFrameSize];
+        for (unsigned i = 0; i < 16; i++) {
+            PDGoMotorCmd cmd;
+            cmd.setMotorID(2);
+            cmd.setFOCMode();
+            cmd.setQ(i);
+            memcpy(batch[i], cmd.getFrame(motorCRC), sizeof(batch[i]));
+        }
+        const uint8_t* bytes = &batch[0][0];
+        while (running.load(std::memory_order_relaxed)) {
+            for (size_t pos = 0; pos < sizeof(batch); pos += 4) {
+                size_t len = std::min<size_t>(4, sizeof(batch) - pos);
+                if (::write(sv[0], bytes + pos, len) != ssize_t(len)) {
+                    return;
+                }
+                uint64_t next = currentTimeNanos() + 10000;
+                while (currentTimeNanos() < next) {
+                }
+            }
+        }
+    });
+
+    const uint32_t kTimeout = 10;
+    const unsigned kTrips = 20;
+    PDGoMotorBus bus("bench", sv[0]);
+    PDWatchdog watchdog;
+    watchdog.addBus(&bus);
+    watchdog.setTimeout(kTimeout);
+    watchdog.start();
+    uint64_t total = 0;
+    uint64_t worst = 0;
+    unsigned trips = 0;
+    unsigned crcErrors = sim.getCRCErrors();
+    for (unsigned i = 0; i < kTrips; i++) {
+        // Feed for a few periods, then stall
+        for (unsigned j = 0; j < 5; j++) {
+            watchdog.feed();
+            usleep(2000);
+        }
+        uint64_t heartbeat = currentTimeNanos();
+        watchdog.feed(heartbeat);
+        received.store(0, std::memory_order_release);
+        uint64_t giveUp = heartbeat + PDCycleClock::fromMillis(kTimeout * 10);
+        while (received.load(std::memory_order_acquire) == 0 && currentTimeNanos() < giveUp) {
+            usleep(100);
+        }
+        uint64_t arrival = received.load(std::memory_order_acquire);
+        if (arrival == 0 || sim.getMotor(1).fMode != PDGoMotorCmd::BRAKE) {
+            continue;
+        }
+        uint64_t latency = arrival - (heartbeat + PDCycleClock::fromMillis(kTimeout));
+        total += latency;
+        worst = std::max(worst, latency);
+        trips++;
+    }
+    watchdog.stop();
+    running = false;
+    lane.join();
+    motors.join();
+    printf("%-36s %10.1f us avg %10.1f us max %6u/%u trips (%u ms timeout, %u torn frames)\n", name,
+        trips ? double(total) / trips / 1000 : 0.0, double(worst) / 1000, trips, kTrips, kTimeout,
+        sim.getCRCErrors() - crcErrors);
+    ::close(sv[1]);
+}
+
+// Trip the watchdog in the middle of clip playback, or during the lead-in
+// of a baked clip, on a robot with simulated buses. Playback must end and
+// leave every motor braked rather than pick up again once the loop is back.
+static void benchWatchdogPlayback(Bench& bench, bool baked) {
+    const char* name = baked ? "watchdog trip in play.baked lead-in" : "watchdog trip mid play.clip";
+    if (bench.fFilter != nullptr && strstr(name, bench.fFilter) == nullptr) {
+        return;
+    }
+    PDGoMotorSim sims[2];
+    PDConfig::Robot config = sRobotConfig;
+    for (unsigned b = 0; b < 2; b++) {
+        if (!sims[b].open()) {
+            return;
+        }
+        sims[b].setLatency(0);
+        for (uint8_t id = MOTOR_ID_ANKLE_PITCH; id <= MOTOR_ID_HIP_YAW; id++) {
+            sims[b].addMotor(id);
+        }
+        config.bus[b].adapter = sims[b].getPortName();
+    }
+    sims[0].addMotor(MOTOR_ID_NECK);
+    std::atomic<bool> running(true);
+    std::thread motors([&]() {
+        while (running.load(std::memory_order_relaxed) && sims[0].poll(1) && sims[1].poll(1)) {
+        }
+    });
+
+    bool played = false;
+    bool ended = false;
+    {
+        PDRobot robot(config);
+        robot.setControlRate(500);
+        robot.neck.setRange(-90, 90);
+        const char* labels[2 * PDLeg::kNumActuators];
+        char names[2 * PDLeg::kNumActuators][32];
+        uint8_t ids[2 * PDLeg::kNumActuators];
+        for (unsigned i = 0; i < 2 * PDLeg::kNumActuators; i++) {
+            PDLeg& leg = (i < PDLeg::kNumActuators) ? robot.left : robot.right;
+            PDGoActuator& actuator = leg.fActuator[i % PDLeg::kNumActuators];
+            actuator.setRange(-90, 90);
+            snprintf(names[i], sizeof(names[i]), "%s.%s", leg.getName(), actuator.getName());
+            labels[i] = names[i];
+            ids[i] = actuator.getID();
+        }
+        char path[64];
+        char bakePath[64];
+        snprintf(path, sizeof(path), "/tmp/puddle_bench.%d.clip", int(getpid()));
+        snprintf(bakePath, sizeof(bakePath), "/tmp/puddle_bench.%d.bake", int(getpid()));
+        PDClipWriter writer;
+        if (!writer.open(path, 2 * PDLeg::kNumActuators, labels, ids)) {
+            return;
+        }
+        for (uint32_t i = 0; i < 1000; i++) {
+            double positions[2 * PDLeg::kNumActuators];
+            for (unsigned j = 0; j < 2 * PDLeg::kNumActuators; j++) {
+                positions[j] = 0.5 + 0.4 * sin(i / 100.0 * (j + 1));
+            }
+            writer.add(i * 10, positions);
+        }
+        writer.close();
+        PDClip clip;
+        PDBakedClip bakedClip;
+        PDPlayback player;
+        PDBakedPlayback bakedPlayer;
+        bool ok = clip.open(path);
+        if (baked) {
+            ok = ok && PDBakedClip::bake(bakePath, clip, robot.getJoints()) &&
+                bakedClip.open(bakePath) && bakedPlayer.load(bakedClip, robot.getJoints());
+        } else {
+            ok = ok && player.load(clip, robot.getJoints());
+        }
+        unlink(path);
+        unlink(bakePath);
+        auto run = [&](auto& playback) {
+            // The cycle clock runs offset ahead of real time to skip the lead-in
+            uint64_t offset = 0;
+            auto cycles = [&](unsigned n) {
+                for (unsigned i = 0; i < n; i++) {
+                    robot.update(PDCycleClock::tick(currentTimeNanos() + offset));
+                    playback.update();
+                    usleep(2000);
+                }
+            };
+            robot.startWatchdog(PDWatchdog::kDefaultTimeout);
+            cycles(1);
+            playback.start();
+            if (!baked) {
+                offset = PDCycleClock::fromMillis(PDPlayback::kLeadIn);
+            }
+            cycles(100);
+            played = playback.isPlaying();
+            // Stall well past the timeout, then carry on past the lead-in
+            usleep(PDWatchdog::kDefaultTimeout * 3000);
+            cycles(10);
+            offset = PDCycleClock::fromMillis(PDPlayback::kLeadIn);
+            cycles(100);
+            ended = !playback.isPlaying() && robot.getWatchdogTrips() != 0;
+            robot.stopWatchdog();
+        };
+        if (ok && baked) {
+            run(bakedPlayer);
+        } else if (ok) {
+            run(player);
+        }
+    }
+    running = false;
+    motors.join();
+    unsigned armed = 0;
+    for (unsigned b = 0; b < 2; b++) {
+        for (uint8_t id = 0; id < PDGoMotorSim::kMaxMotors; id++) {
+            if (sims[b].getMotor(id).fPresent && sims[b].getMotor(id).fMode != PDGoMotorCmd::BRAKE) {
+                armed++;
+            }
+        }
+    }
+    printf("%-36s %s, %u motors armed after the trip\n", name,
+        !played ? "clip did not play" : ended ? "playback ended" : "PLAYBACK CARRIED ON", armed);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "Control loop microbenchmarks.\n\n");
+    fprintf(stderr, "usage: %s [-t ms] [filter]\n", argv0);
+    fprintf(stderr, "  -t ms   Minimum time per benchmark (default 200)\n");
+    fprintf(stderr, "  filter  Only run benchmarks whose name contains filter\n");
+}
+
+int main(int argc, const char* argv[]) {
+    Bench bench;
+    for (int argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            bench.fMinTime = uint64_t(atoi(argv[++argi])) * 1000000;
+        } else if (strcmp(argv[argi], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[argi][0] != '-') {
+            bench.fFilter = argv[argi];
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[argi]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    benchCommand(bench);
+    benchFeedback(bench);
+    benchCRC(bench);
+    benchEasing(bench);
+    benchActuator(bench);
+    benchStateExport(bench);
+    benchHistogram(bench);
+    benchClip(bench, PDClip::kRaw);
+    benchClip(bench, PDClip::kDelta);
+    benchReducer(bench);
+    benchPlayback(bench);
+    benchLeg(bench, false);
+    benchLeg(bench, true);
+    benchWatchdog(bench);
+    benchWatchdogPlayback(bench, false);
+    benchWatchdogPlayback(bench, true);
+    return 0;
+}